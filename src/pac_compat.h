@@ -0,0 +1,325 @@
+// Copyright (C) 2024 Manu Garg.
+// Author: Manu Garg <manugarg@gmail.com>
+//
+// pac_compat.h provides small portability wrappers (threads, mutexes and a
+// monotonic clock) shared by pacparser.c and pactester.c. Everything here is
+// static inline so that the header can be included from more than one
+// translation unit without adding a new object file to the build.
+//
+// pacparser is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// pacparser is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+#ifndef PAC_COMPAT_H
+#define PAC_COMPAT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#ifdef _WIN32
+typedef SRWLOCK pac_mutex_t;
+typedef CONDITION_VARIABLE pac_cond_t;
+typedef HANDLE pac_thread_t;
+#define PAC_MUTEX_INITIALIZER SRWLOCK_INIT
+#define PAC_COND_INITIALIZER CONDITION_VARIABLE_INIT
+#else
+typedef pthread_mutex_t pac_mutex_t;
+typedef pthread_cond_t pac_cond_t;
+typedef pthread_t pac_thread_t;
+#define PAC_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define PAC_COND_INITIALIZER PTHREAD_COND_INITIALIZER
+#endif
+
+#if defined(_MSC_VER)
+#define PAC_THREAD_LOCAL __declspec(thread)
+#else
+#define PAC_THREAD_LOCAL __thread
+#endif
+
+typedef void *(*pac_thread_func)(void *);
+
+#ifdef _WIN32
+typedef DWORD pac_tls_key_t;
+#else
+typedef pthread_key_t pac_tls_key_t;
+#endif
+
+#ifdef _WIN32
+typedef struct {
+  pac_thread_func func;
+  void *arg;
+} pac_thread_start_t;
+
+static inline DWORD WINAPI
+pac_thread_trampoline(LPVOID param)
+{
+  pac_thread_start_t start = *(pac_thread_start_t *)param;
+  free(param);
+  start.func(start.arg);
+  return 0;
+}
+#endif
+
+static inline void
+pac_mutex_init(pac_mutex_t *m)
+{
+#ifdef _WIN32
+  InitializeSRWLock(m);
+#else
+  pthread_mutex_init(m, NULL);
+#endif
+}
+
+static inline void
+pac_mutex_destroy(pac_mutex_t *m)
+{
+#ifdef _WIN32
+  (void)m;  // SRW locks need no cleanup.
+#else
+  pthread_mutex_destroy(m);
+#endif
+}
+
+static inline void
+pac_mutex_lock(pac_mutex_t *m)
+{
+#ifdef _WIN32
+  AcquireSRWLockExclusive(m);
+#else
+  pthread_mutex_lock(m);
+#endif
+}
+
+static inline void
+pac_mutex_unlock(pac_mutex_t *m)
+{
+#ifdef _WIN32
+  ReleaseSRWLockExclusive(m);
+#else
+  pthread_mutex_unlock(m);
+#endif
+}
+
+static inline void
+pac_cond_init(pac_cond_t *c)
+{
+#ifdef _WIN32
+  InitializeConditionVariable(c);
+#else
+  pthread_cond_init(c, NULL);
+#endif
+}
+
+static inline void
+pac_cond_destroy(pac_cond_t *c)
+{
+#ifdef _WIN32
+  (void)c;
+#else
+  pthread_cond_destroy(c);
+#endif
+}
+
+static inline void
+pac_cond_broadcast(pac_cond_t *c)
+{
+#ifdef _WIN32
+  WakeAllConditionVariable(c);
+#else
+  pthread_cond_broadcast(c);
+#endif
+}
+
+static inline void
+pac_cond_signal(pac_cond_t *c)
+{
+#ifdef _WIN32
+  WakeConditionVariable(c);
+#else
+  pthread_cond_signal(c);
+#endif
+}
+
+static inline void
+pac_cond_wait(pac_cond_t *c, pac_mutex_t *m)
+{
+#ifdef _WIN32
+  SleepConditionVariableSRW(c, m, INFINITE, 0);
+#else
+  pthread_cond_wait(c, m);
+#endif
+}
+
+// Waits on c for at most timeout_ms milliseconds. Spurious and timed out
+// wakeups are not distinguished; callers re-check their predicate.
+static inline void
+pac_cond_timedwait(pac_cond_t *c, pac_mutex_t *m, int64_t timeout_ms)
+{
+#ifdef _WIN32
+  SleepConditionVariableSRW(c, m, (DWORD)timeout_ms, 0);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout_ms / 1000;
+  ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(c, m, &ts);
+#endif
+}
+
+// Starts func(arg) on a new thread. Returns 0 on success.
+static inline int
+pac_thread_create(pac_thread_t *t, pac_thread_func func, void *arg)
+{
+#ifdef _WIN32
+  pac_thread_start_t *start = malloc(sizeof(*start));
+  if (start == NULL) return -1;
+  start->func = func;
+  start->arg = arg;
+  *t = CreateThread(NULL, 0, pac_thread_trampoline, start, 0, NULL);
+  if (*t == NULL) {
+    free(start);
+    return -1;
+  }
+  return 0;
+#else
+  return pthread_create(t, NULL, func, arg);
+#endif
+}
+
+static inline void
+pac_thread_join(pac_thread_t t)
+{
+#ifdef _WIN32
+  WaitForSingleObject(t, INFINITE);
+  CloseHandle(t);
+#else
+  pthread_join(t, NULL);
+#endif
+}
+
+// Lets t run on its own; it can't be joined afterwards.
+static inline void
+pac_thread_detach(pac_thread_t t)
+{
+#ifdef _WIN32
+  CloseHandle(t);
+#else
+  pthread_detach(t);
+#endif
+}
+
+// Creates a thread-specific slot. destructor, if not NULL, is called with
+// the thread's value when a thread that set one exits. Returns 0 on success.
+static inline int
+pac_tls_key_create(pac_tls_key_t *key, void (*destructor)(void *))
+{
+#ifdef _WIN32
+  // Fiber local storage runs the callback on thread exit, unlike TlsAlloc.
+  *key = FlsAlloc((PFLS_CALLBACK_FUNCTION)destructor);
+  return *key == FLS_OUT_OF_INDEXES ? -1 : 0;
+#else
+  return pthread_key_create(key, destructor);
+#endif
+}
+
+static inline void
+pac_tls_set(pac_tls_key_t key, void *value)
+{
+#ifdef _WIN32
+  FlsSetValue(key, value);
+#else
+  pthread_setspecific(key, value);
+#endif
+}
+
+// Adds n to a counter that only the calling thread writes but other threads
+// may read with pac_counter_load at any time.
+static inline void
+pac_counter_add(uint64_t *counter, uint64_t n)
+{
+#if defined(_MSC_VER)
+  *(volatile uint64_t *)counter += n;
+#else
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+#endif
+}
+
+static inline uint64_t
+pac_counter_load(const uint64_t *counter)
+{
+#if defined(_MSC_VER)
+  return *(const volatile uint64_t *)counter;
+#else
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+#endif
+}
+
+// A flag set by one thread and polled by others.
+static inline void
+pac_flag_store(int *flag, int value)
+{
+#if defined(_MSC_VER)
+  InterlockedExchange((volatile LONG *)flag, value);
+#else
+  __atomic_store_n(flag, value, __ATOMIC_RELEASE);
+#endif
+}
+
+static inline int
+pac_flag_load(const int *flag)
+{
+#if defined(_MSC_VER)
+  return *(const volatile int *)flag;
+#else
+  return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Monotonic clock in nanoseconds. Only differences are meaningful.
+static inline int64_t
+pac_now_ns(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (int64_t)(count.QuadPart / freq.QuadPart * 1000000000 +
+                   count.QuadPart % freq.QuadPart * 1000000000 /
+                   freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Monotonic clock in microseconds. Only differences are meaningful.
+static inline int64_t
+pac_now_us(void)
+{
+  return pac_now_ns() / 1000;
+}
+
+#endif  // PAC_COMPAT_H
@@ -19,32 +19,44 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 
+#include <ctype.h>
 #include <errno.h>
 #include "quickjs.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-#ifdef __FreeBSD__
-#include <arpa/inet.h>
+#ifndef _WIN32
+#include <arpa/inet.h>                 // for inet_pton
 #endif
 
 #ifndef _WIN32
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>                // for AF_INET
+#include <sys/stat.h>
 #include <netdb.h>
 #endif
 
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#ifdef _WIN32
+#include <sys/stat.h>
+#endif
+
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #endif
 
+#include "pac_compat.h"
 #include "pac_utils.h"
 #include "pacparser.h"
 
-#define MAX_IP_RESULTS 10
-
 #ifdef __GNUC__
 #  define UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
 #else
@@ -81,15 +93,578 @@ static int print_error(const char *fmt, ...)
   return ret;
 }
 
+// Logging.
+//
+// Diagnostic messages go through the error printer like errors, but only up
+// to the log level. The level is read from the environment once, on first
+// use, unless set with pacparser_set_log_level: PACPARSER_LOG_LEVEL (error,
+// info or debug) or, for compatibility, PACPARSER_DEBUG (any value means
+// debug). The log_* macros check the level before evaluating their
+// arguments. Building with -DPACPARSER_NO_DEBUG_LOG compiles debug messages
+// out.
+static int log_level = -1;              // -1 until read from the environment.
+
 static int
-_debug(void) {
-  if(getenv("PACPARSER_DEBUG")) return 1;
-  return 0;
+log_level_from_env(void)
+{
+  const char *env = getenv("PACPARSER_LOG_LEVEL");
+  int level = PACPARSER_LOG_ERROR;
+  if (env) {
+    if (strcmp(env, "debug") == 0) level = PACPARSER_LOG_DEBUG;
+    else if (strcmp(env, "info") == 0) level = PACPARSER_LOG_INFO;
+    else if (isdigit((unsigned char)env[0])) level = atoi(env);
+  } else if (getenv("PACPARSER_DEBUG")) {
+    level = PACPARSER_LOG_DEBUG;
+  }
+  return level;
+}
+
+static inline int
+log_enabled(int level)
+{
+  int current = log_level;
+  if (current < 0) current = log_level = log_level_from_env();
+  return current >= level;
+}
+
+static void
+log_print(const char *prefix, const char *fmt, ...)
+{
+  va_list args;
+  print_error("%s: ", prefix);
+  va_start(args, fmt);
+  (*error_printer_func)(fmt, args);
+  va_end(args);
+}
+
+#define log_info(...) \
+  do { \
+    if (log_enabled(PACPARSER_LOG_INFO)) log_print("INFO", __VA_ARGS__); \
+  } while (0)
+
+#ifdef PACPARSER_NO_DEBUG_LOG
+#define log_debug(...) do { } while (0)
+#else
+#define log_debug(...) \
+  do { \
+    if (log_enabled(PACPARSER_LOG_DEBUG)) log_print("DEBUG", __VA_ARGS__); \
+  } while (0)
+#endif
+
+void
+pacparser_set_log_level(int level)
+{
+  log_level = level < PACPARSER_LOG_ERROR ? PACPARSER_LOG_ERROR : level;
+}
+
+int
+pacparser_get_log_level(void)
+{
+  if (log_level < 0) log_level = log_level_from_env();
+  return log_level;
+}
+
+// Library statistics, see pacparser_get_stats.
+static pac_mutex_t stats_lock = PAC_MUTEX_INITIALIZER;
+static pacparser_stats stats;
+
+// Latency histograms and builtin call counters.
+//
+// Every thread records into its own block of counters, so timing a call takes
+// no locks. pacparser_get_stats sums the blocks of all threads. Blocks are
+// never freed: when a thread exits its block is handed to the next new thread,
+// which keeps adding to it, so the sums only ever grow and a reset just
+// remembers the sums at the time.
+#define LATENCY_SUB_BITS 3              // 8 buckets per power of two
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 40             // Longest time recorded, ~12 days.
+#define LATENCY_BUCKETS (LATENCY_SUB * (LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2))
+
+enum { LATENCY_PARSE, LATENCY_FIND_PROXY, LATENCY_DNS, LATENCY_KINDS };
+
+// PAC builtins whose calls are counted when builtin stats are enabled: the C
+// functions added by context_add_builtins and the functions in pac_utils.h.
+static const char *builtin_names[] = {
+  "dnsResolve", "dnsResolveEx", "myIpAddress", "myIpAddressEx", "alert",
+  "dnsDomainIs", "dnsDomainLevels", "convert_addr", "isInNet",
+  "convert_addr6", "isInNetEx6", "isInNetEx4", "isInNetEx",
+  "isPlainHostName", "isResolvable", "isResolvableEx", "localHostOrDomainIs",
+  "shExpMatch", "weekdayRange", "dateRange", "timeRange",
+};
+#define NUM_BUILTINS (int)(sizeof(builtin_names) / sizeof(builtin_names[0]))
+
+typedef struct {
+  uint64_t calls;
+  uint64_t total_ns;
+  uint64_t self_ns;
+} builtin_counters;
+
+// All counters are uint64_t, so that blocks can be summed as flat arrays.
+typedef struct {
+  uint64_t buckets[LATENCY_KINDS][LATENCY_BUCKETS];
+  uint64_t total_us[LATENCY_KINDS];
+  builtin_counters builtins[NUM_BUILTINS];
+} stats_sums;
+
+#define STATS_COUNTERS (sizeof(stats_sums) / sizeof(uint64_t))
+
+typedef struct stats_block {
+  stats_sums c;
+  int in_use;                           // Guarded by stats_lock.
+  struct stats_block *next;
+} stats_block;
+
+static stats_block *stats_blocks = NULL;  // Guarded by stats_lock.
+static stats_sums stats_base;             // Sums at the last reset.
+static pac_tls_key_t stats_key;
+static int stats_key_created = 0;
+static PAC_THREAD_LOCAL stats_block *thread_stats = NULL;
+
+static int
+latency_bucket(uint64_t us)
+{
+  if (us < LATENCY_SUB) return (int)us;
+  int bits = LATENCY_SUB_BITS;
+  while (bits < LATENCY_MAX_BITS && (us >> (bits + 1)) != 0) bits++;
+  if ((us >> (bits + 1)) != 0) return LATENCY_BUCKETS - 1;
+  return (bits - LATENCY_SUB_BITS + 1) * LATENCY_SUB +
+         (int)((us >> (bits - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
+
+// Largest value that falls in the given bucket.
+static uint64_t
+latency_bucket_max(int bucket)
+{
+  if (bucket < LATENCY_SUB) return bucket;
+  int shift = bucket / LATENCY_SUB - 1;
+  uint64_t sub = bucket % LATENCY_SUB;
+  return ((LATENCY_SUB + sub + 1) << shift) - 1;
+}
+
+// Thread exit callback: lets the next new thread take over the block.
+static void
+stats_block_release(void *block)
+{
+  pac_mutex_lock(&stats_lock);
+  ((stats_block *)block)->in_use = 0;
+  pac_mutex_unlock(&stats_lock);
+}
+
+static stats_block *
+stats_thread_block(void)
+{
+  if (thread_stats) return thread_stats;
+  pac_mutex_lock(&stats_lock);
+  if (!stats_key_created) {
+    if (pac_tls_key_create(&stats_key, stats_block_release) != 0) {
+      pac_mutex_unlock(&stats_lock);
+      return NULL;
+    }
+    stats_key_created = 1;
+  }
+  stats_block *b = stats_blocks;
+  while (b && b->in_use) b = b->next;
+  if (b == NULL && (b = calloc(1, sizeof(stats_block))) != NULL) {
+    b->next = stats_blocks;
+    stats_blocks = b;
+  }
+  if (b) b->in_use = 1;
+  pac_mutex_unlock(&stats_lock);
+  if (b) pac_tls_set(stats_key, b);
+  thread_stats = b;
+  return b;
+}
+
+// Records a call of the given kind that started at start_us.
+static void
+record_latency(int kind, int64_t start_us)
+{
+  int64_t us = pac_now_us() - start_us;
+  stats_block *b = stats_thread_block();
+  if (b == NULL) return;
+  if (us < 0) us = 0;
+  pac_counter_add(&b->c.buckets[kind][latency_bucket(us)], 1);
+  pac_counter_add(&b->c.total_us[kind], us);
+}
+
+// Sums the blocks of all threads. Caller must hold stats_lock.
+static void
+stats_sum_locked(stats_sums *sums)
+{
+  uint64_t *out = (uint64_t *)sums;
+  memset(sums, 0, sizeof(*sums));
+  for (stats_block *b = stats_blocks; b; b = b->next) {
+    const uint64_t *in = (const uint64_t *)&b->c;
+    for (size_t i = 0; i < STATS_COUNTERS; i++)
+      out[i] += pac_counter_load(&in[i]);
+  }
+}
+
+// Summarizes one kind of call of sums into *out.
+static void
+latency_summarize(const stats_sums *sums, int kind, pacparser_latency *out)
+{
+  static const int permille[] = {500, 900, 990, 999};
+  unsigned long *percentiles[] = {&out->p50_us, &out->p90_us, &out->p99_us,
+                                  &out->p999_us};
+  uint64_t count = 0, seen = 0;
+  int p = 0;
+
+  memset(out, 0, sizeof(*out));
+  for (int i = 0; i < LATENCY_BUCKETS; i++)
+    count += sums->buckets[kind][i] - stats_base.buckets[kind][i];
+  if (count == 0) return;
+  out->count = count;
+  out->mean_us = (sums->total_us[kind] - stats_base.total_us[kind]) / count;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    uint64_t n = sums->buckets[kind][i] - stats_base.buckets[kind][i];
+    if (n == 0) continue;
+    seen += n;
+    while (p < 4 && seen * 1000 >= count * permille[p])
+      *percentiles[p++] = latency_bucket_max(i);
+    out->max_us = latency_bucket_max(i);
+  }
+}
+
+// Fills in *out with the current statistics.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_get_stats(pacparser_stats *out)
+{
+  if (out == NULL) return 0;
+  stats_sums *sums = malloc(sizeof(stats_sums));
+  if (sums == NULL) return 0;
+  pac_mutex_lock(&stats_lock);
+  *out = stats;
+  stats_sum_locked(sums);
+  latency_summarize(sums, LATENCY_PARSE, &out->parse);
+  latency_summarize(sums, LATENCY_FIND_PROXY, &out->find_proxy);
+  latency_summarize(sums, LATENCY_DNS, &out->dns);
+  pac_mutex_unlock(&stats_lock);
+  free(sums);
+  return 1;
+}
+
+// Resets all statistics to zero.
+void
+pacparser_reset_stats(void)
+{
+  pac_mutex_lock(&stats_lock);
+  memset(&stats, 0, sizeof(stats));
+  stats_sum_locked(&stats_base);
+  pac_mutex_unlock(&stats_lock);
+}
+
+// Builtin call statistics.
+//
+// When enabled, context_add_builtins replaces each builtin in builtin_names
+// with a wrapper that times the call. Self time excludes the time spent in
+// builtins called from the builtin, e.g. convert_addr called from isInNet.
+static int builtin_stats_enabled = 0;
+static PAC_THREAD_LOCAL builtin_counters lookup_builtins[NUM_BUILTINS];
+static PAC_THREAD_LOCAL int64_t builtin_child_ns = 0;
+static PAC_THREAD_LOCAL int lookup_traced = 0;  // See trace_begin.
+
+static JSValue
+builtin_wrapper(JSContext *ctx, JSValueConst this_val, int argc,
+                JSValueConst *argv, int index, JSValueConst *func_data)
+{
+  if (!builtin_stats_enabled && !lookup_traced)
+    return JS_Call(ctx, func_data[0], this_val, argc, argv);
+  int64_t outer_child_ns = builtin_child_ns;
+  builtin_child_ns = 0;
+  int64_t start_ns = pac_now_ns();
+  JSValue ret = JS_Call(ctx, func_data[0], this_val, argc, argv);
+  int64_t elapsed = pac_now_ns() - start_ns;
+  int64_t self = elapsed - builtin_child_ns;
+  builtin_child_ns = outer_child_ns + elapsed;
+
+  builtin_counters *l = &lookup_builtins[index];
+  l->calls++;
+  l->total_ns += elapsed;
+  l->self_ns += self;
+  stats_block *b = builtin_stats_enabled ? stats_thread_block() : NULL;
+  if (b) {
+    pac_counter_add(&b->c.builtins[index].calls, 1);
+    pac_counter_add(&b->c.builtins[index].total_ns, elapsed);
+    pac_counter_add(&b->c.builtins[index].self_ns, self);
+  }
+  return ret;
+}
+
+// Replaces the builtins defined in ctx with timing wrappers.
+static void
+wrap_builtins(JSContext *ctx)
+{
+  JSValue global = JS_GetGlobalObject(ctx);
+  for (int i = 0; i < NUM_BUILTINS; i++) {
+    JSValue func = JS_GetPropertyStr(ctx, global, builtin_names[i]);
+    if (JS_IsFunction(ctx, func)) {
+      int32_t length = 0;
+      JSValue len = JS_GetPropertyStr(ctx, func, "length");
+      JS_ToInt32(ctx, &length, len);
+      JS_FreeValue(ctx, len);
+      JSValue wrapper = JS_NewCFunctionData(ctx, builtin_wrapper, length, i,
+                                            1, &func);
+      JS_DefinePropertyValueStr(ctx, wrapper, "name",
+                                JS_NewString(ctx, builtin_names[i]),
+                                JS_PROP_CONFIGURABLE);
+      JS_SetPropertyStr(ctx, global, builtin_names[i], wrapper);
+    }
+    JS_FreeValue(ctx, func);
+  }
+  JS_FreeValue(ctx, global);
+}
+
+// Clears the calling thread's per-lookup builtin counters.
+static void
+lookup_builtins_reset(void)
+{
+  if (builtin_stats_enabled || lookup_traced)
+    memset(lookup_builtins, 0, sizeof(lookup_builtins));
+}
+
+void
+pacparser_enable_builtin_stats(int enable)
+{
+  builtin_stats_enabled = enable ? 1 : 0;
+}
+
+// Copies counters into out, skipping builtins that were never called.
+static int
+fill_builtin_stats(const builtin_counters *counters,
+                   pacparser_builtin_stats *out, int max)
+{
+  int n = 0;
+  for (int i = 0; i < NUM_BUILTINS && n < max; i++) {
+    if (counters[i].calls == 0) continue;
+    out[n].name = builtin_names[i];
+    out[n].calls = counters[i].calls;
+    out[n].total_ns = counters[i].total_ns;
+    out[n].self_ns = counters[i].self_ns;
+    n++;
+  }
+  return n;
+}
+
+// Fills in out with the aggregate counters of up to max builtins.
+int                                     // Number of entries filled in.
+pacparser_get_builtin_stats(pacparser_builtin_stats *out, int max)
+{
+  if (out == NULL || max <= 0) return 0;
+  stats_sums *sums = malloc(sizeof(stats_sums));
+  if (sums == NULL) return 0;
+  builtin_counters counters[NUM_BUILTINS];
+  pac_mutex_lock(&stats_lock);
+  stats_sum_locked(sums);
+  for (int i = 0; i < NUM_BUILTINS; i++) {
+    counters[i].calls = sums->builtins[i].calls -
+                        stats_base.builtins[i].calls;
+    counters[i].total_ns = sums->builtins[i].total_ns -
+                           stats_base.builtins[i].total_ns;
+    counters[i].self_ns = sums->builtins[i].self_ns -
+                          stats_base.builtins[i].self_ns;
+  }
+  pac_mutex_unlock(&stats_lock);
+  free(sums);
+  return fill_builtin_stats(counters, out, max);
+}
+
+// Fills in out with the counters of the calling thread's last lookup.
+int                                     // Number of entries filled in.
+pacparser_get_lookup_builtin_stats(pacparser_builtin_stats *out, int max)
+{
+  if (out == NULL || max <= 0) return 0;
+  return fill_builtin_stats(lookup_builtins, out, max);
+}
+
+// Lookup tracing, see pacparser_set_trace_hook.
+//
+// Whether a lookup is traced is decided when it starts, so lookups that are
+// not sampled only pay for one random number.
+static pac_mutex_t trace_lock = PAC_MUTEX_INITIALIZER;
+static pacparser_trace_hook trace_hook = NULL;       // Guarded by trace_lock.
+static void *trace_opaque = NULL;                    // Guarded by trace_lock.
+static uint64_t trace_threshold = 0;  // Sample if random < threshold; 0: off.
+static PAC_THREAD_LOCAL uint64_t trace_random_state = 0;
+static PAC_THREAD_LOCAL int64_t trace_start_us;
+static PAC_THREAD_LOCAL const char **trace_dns_names = NULL;
+static PAC_THREAD_LOCAL int trace_num_dns_names = 0;
+static PAC_THREAD_LOCAL int trace_dns_names_size = 0;
+static PAC_THREAD_LOCAL int64_t trace_dns_us;
+
+void
+pacparser_set_trace_hook(pacparser_trace_hook hook, void *opaque,
+                         double sample_rate)
+{
+  pac_mutex_lock(&trace_lock);
+  trace_hook = hook;
+  trace_opaque = opaque;
+  if (hook == NULL || !(sample_rate > 0)) trace_threshold = 0;
+  else if (sample_rate >= 1) trace_threshold = UINT64_MAX;
+  else trace_threshold = (uint64_t)(sample_rate * 18446744073709551616.0);
+  pac_mutex_unlock(&trace_lock);
+}
+
+// xorshift64* generator, one per thread.
+static uint64_t
+trace_random(void)
+{
+  uint64_t x = trace_random_state;
+  if (x == 0) x = (uint64_t)pac_now_ns() ^ (uint64_t)(uintptr_t)&x;
+  if (x == 0) x = 1;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  trace_random_state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Decides whether the lookup about to start on this thread is traced.
+static void
+trace_begin(void)
+{
+  uint64_t threshold = trace_threshold;
+  lookup_traced = threshold != 0 &&
+                  (threshold == UINT64_MAX || trace_random() < threshold);
+  if (!lookup_traced) return;
+  trace_num_dns_names = 0;
+  trace_dns_us = 0;
+  trace_start_us = pac_now_us();
+}
+
+// Notes a hostname resolved by a builtin during a traced lookup.
+static void
+trace_dns(const char *name, int64_t start_us)
+{
+  if (!lookup_traced) return;
+  trace_dns_us += pac_now_us() - start_us;
+  for (int i = 0; i < trace_num_dns_names; i++) {
+    if (strcmp(trace_dns_names[i], name) == 0) return;
+  }
+  if (trace_num_dns_names == trace_dns_names_size) {
+    int size = trace_dns_names_size ? trace_dns_names_size * 2 : 8;
+    const char **names = realloc(trace_dns_names, size * sizeof(char *));
+    if (names == NULL) return;
+    trace_dns_names = names;
+    trace_dns_names_size = size;
+  }
+  char *copy = strdup(name);
+  if (copy) trace_dns_names[trace_num_dns_names++] = copy;
+}
+
+// Reports a traced lookup to the trace hook. Must be called without engine
+// locks held, so the hook may itself do lookups.
+static void
+trace_end(const char *url, const char *host, const char *result)
+{
+  if (!lookup_traced) return;
+  lookup_traced = 0;
+  pacparser_builtin_stats builtins[NUM_BUILTINS];
+  pacparser_trace trace;
+  trace.url = url;
+  trace.host = host;
+  trace.result = result;
+  trace.duration_us = pac_now_us() - trace_start_us;
+  trace.timed_out = pacparser_timed_out();
+  trace.dns_names = trace_dns_names;
+  trace.num_dns_names = trace_num_dns_names;
+  trace.dns_us = trace_dns_us;
+  trace.builtins = builtins;
+  trace.num_builtins = fill_builtin_stats(lookup_builtins, builtins,
+                                          NUM_BUILTINS);
+  // Take the names: the hook may start another traced lookup.
+  trace_dns_names = NULL;
+  trace_num_dns_names = trace_dns_names_size = 0;
+
+  pac_mutex_lock(&trace_lock);
+  pacparser_trace_hook hook = trace_hook;
+  void *opaque = trace_opaque;
+  pac_mutex_unlock(&trace_lock);
+  if (hook) hook(&trace, opaque);
+
+  for (int i = 0; i < trace.num_dns_names; i++)
+    free((char *)trace.dns_names[i]);
+  free(trace.dns_names);
+}
+
+static void
+count_parse(int changed)
+{
+  pac_mutex_lock(&stats_lock);
+  if (changed) stats.parses_changed++;
+  else stats.parses_unchanged++;
+  pac_mutex_unlock(&stats_lock);
+}
+
+static void
+count_timeout(void)
+{
+  pac_mutex_lock(&stats_lock);
+  stats.timeouts++;
+  pac_mutex_unlock(&stats_lock);
+}
+
+// 64-bit FNV-1a hash.
+static uint64_t
+hash_script(const char *script, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)script[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Identifies a PAC script without keeping a copy of it: its length, its
+// FNV-1a hash and a second 64-bit hash keyed with a random number per
+// process. Two scripts with the same digest can't be prepared in advance,
+// since the key isn't known until the process runs.
+typedef struct {
+  uint64_t hash;
+  uint64_t keyed_hash;
+  size_t len;
+} script_digest;
+
+static pac_mutex_t digest_lock = PAC_MUTEX_INITIALIZER;
+static uint64_t digest_key = 0;         // Odd once set. Guarded by digest_lock.
+
+static void
+digest_script(const char *script, size_t len, script_digest *d)
+{
+  pac_mutex_lock(&digest_lock);
+  if (digest_key == 0) {
+    digest_key = ((uint64_t)pac_now_ns() ^ (uint64_t)(uintptr_t)&d) *
+                 0x9E3779B97F4A7C15ULL | 1;
+  }
+  uint64_t key = digest_key;
+  pac_mutex_unlock(&digest_lock);
+
+  uint64_t h = 14695981039346656037ULL;
+  uint64_t k = key;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)script[i];
+    h *= 1099511628211ULL;
+    // The rotation keeps k from being a polynomial in key, which strings
+    // like Thue-Morse's collide for every odd multiplier.
+    k = (k ^ (unsigned char)script[i]) * key;
+    k = k << 29 | k >> 35;
+  }
+  d->hash = h;
+  d->keyed_hash = k;
+  d->len = len;
+}
+
+static int
+same_script_digest(const script_digest *a, const script_digest *b)
+{
+  return a->hash == b->hash && a->keyed_hash == b->keyed_hash &&
+         a->len == b->len;
 }
 
 // Utility function to read a file into string.
 static char *                      // File content in string or NULL if failed.
-read_file_into_str(const char *filename)
+read_file_into_str(const char *filename, size_t *len)
 {
   FILE *fptr = fopen(filename, "rb");
   if (fptr == NULL) return NULL;
@@ -115,6 +690,7 @@ read_file_into_str(const char *filename)
   if (bytes_read < file_size+1) {
     str[bytes_read] = '\0';
   }
+  *len = bytes_read;
   fclose(fptr);
   return str;
 error2:
@@ -122,6 +698,72 @@ error2:
   return NULL;
 }
 
+// A PAC file loaded into memory. data is always null terminated at data[len].
+typedef struct {
+  char *data;
+  size_t len;
+  size_t map_len;                 // Non-zero if data is mmap'd.
+} pac_file_buf;
+
+// Loads a PAC file into memory.
+//
+// Regular files are mapped read-only, which avoids copying multi-megabyte
+// scripts through the heap. QuickJS needs a null terminated buffer, so the
+// file is mapped at the start of a zero-filled anonymous mapping at least one
+// byte longer: the bytes past the end of the file, in its last page or in the
+// anonymous page after it, are zero. Everything else (empty files, pipes,
+// Windows) falls back to reading the file into a heap buffer.
+static int                         // 0 (=Failure) or 1 (=Success)
+load_pac_file(const char *filename, pac_file_buf *buf)
+{
+  memset(buf, 0, sizeof(*buf));
+#ifndef _WIN32
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat st;
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      page_size > 0) {
+    size_t size = st.st_size;
+    size_t map_len = (size / page_size + 1) * page_size;
+    void *p = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+    if (p != MAP_FAILED &&
+        mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == p) {
+#ifdef MADV_SEQUENTIAL
+      madvise(p, size, MADV_SEQUENTIAL);
+#endif
+      close(fd);
+      buf->data = p;
+      buf->map_len = map_len;
+      // Like the string API, stop at the first null byte.
+      buf->len = strnlen(buf->data, size);
+      return 1;
+    }
+    if (p != MAP_FAILED) munmap(p, map_len);
+  }
+  close(fd);
+#endif
+  buf->data = read_file_into_str(filename, &buf->len);
+  if (buf->data == NULL) return 0;
+  buf->len = strnlen(buf->data, buf->len);
+  return 1;
+}
+
+static void
+unload_pac_file(pac_file_buf *buf)
+{
+#ifndef _WIN32
+  if (buf->map_len) {
+    munmap(buf->data, buf->map_len);
+    buf->data = NULL;
+    return;
+  }
+#endif
+  free(buf->data);
+  buf->data = NULL;
+}
+
 // Helper to dump QuickJS exceptions.
 static void
 dump_js_exception(JSContext *ctx)
@@ -135,20 +777,207 @@ dump_js_exception(JSContext *ctx)
   JS_FreeValue(ctx, exception);
 }
 
+// DNS cache.
+//
+// Resolved addresses are cached per (hostname, address family) so that A and
+// AAAA answers can be looked up, expired and refreshed independently. Names
+// that don't exist are cached as well; isResolvable() on an unresolvable name
+// is one of the most common causes of slow PAC evaluation. Off until
+// pacparser_set_dns_cache_ttl is called.
+#define DNS_CACHE_BUCKETS 256
+#define DNS_CACHE_MAX_ENTRIES 4096
+
+typedef struct dns_cache_entry {
+  char *name;
+  int family;                     // AF_INET or AF_INET6
+  int error;                      // getaddrinfo() error, 0 on success
+  char *addrs;                    // ';'-separated addresses, "" on error
+  int64_t expires_us;
+  int pinned;                     // served even when stale; see prefetch
+  struct dns_cache_entry *next;
+} dns_cache_entry;
+
+static dns_cache_entry *dns_cache[DNS_CACHE_BUCKETS];
+static int dns_cache_count = 0;
+static int dns_cache_ttl = 0;           // seconds, 0 if disabled
+static pac_mutex_t dns_cache_lock = PAC_MUTEX_INITIALIZER;
+
+static unsigned int
+dns_cache_hash(const char *name, int family)
+{
+  unsigned int h = 5381 + family;
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    h = h * 33 + *p;
+  return h % DNS_CACHE_BUCKETS;
+}
+
+static void
+dns_cache_free_entry(dns_cache_entry *e)
+{
+  free(e->name);
+  free(e->addrs);
+  free(e);
+}
+
+// Drops all entries, except pinned ones if keep_pinned is set. Caller must
+// hold dns_cache_lock.
+static void
+dns_cache_clear_locked(int keep_pinned)
+{
+  for (int i = 0; i < DNS_CACHE_BUCKETS; i++) {
+    dns_cache_entry **pe = &dns_cache[i];
+    while (*pe) {
+      dns_cache_entry *e = *pe;
+      if (keep_pinned && e->pinned) {
+        pe = &e->next;
+        continue;
+      }
+      *pe = e->next;
+      dns_cache_free_entry(e);
+      dns_cache_count--;
+    }
+  }
+}
+
+static void
+dns_cache_clear(void)
+{
+  pac_mutex_lock(&dns_cache_lock);
+  dns_cache_clear_locked(0);
+  pac_mutex_unlock(&dns_cache_lock);
+}
+
+// Turns all pinned entries back into regular, expiring entries.
+static void
+dns_cache_unpin_all(void)
+{
+  pac_mutex_lock(&dns_cache_lock);
+  for (int i = 0; i < DNS_CACHE_BUCKETS; i++) {
+    for (dns_cache_entry *e = dns_cache[i]; e; e = e->next) e->pinned = 0;
+  }
+  pac_mutex_unlock(&dns_cache_lock);
+}
+
+// Looks up a fresh cache entry. On hit, returns 1 and sets *error and *addrs
+// (a malloc'd copy owned by the caller).
+static int
+dns_cache_get(const char *name, int family, int *error, char **addrs)
+{
+  int found = 0;
+  pac_mutex_lock(&dns_cache_lock);
+  for (dns_cache_entry *e = dns_cache[dns_cache_hash(name, family)]; e;
+       e = e->next) {
+    if (e->family != family || strcmp(e->name, name) != 0) continue;
+    if ((e->pinned || e->expires_us > pac_now_us()) &&
+        (*addrs = strdup(e->addrs))) {
+      *error = e->error;
+      found = 1;
+    }
+    break;
+  }
+  pac_mutex_unlock(&dns_cache_lock);
+  return found;
+}
+
+// Adds or updates a cache entry. If pin is set, the entry is pinned, and a
+// failure doesn't replace a good answer.
+static void
+dns_cache_put(const char *name, int family, int error, const char *addrs,
+              int pin)
+{
+  unsigned int h = dns_cache_hash(name, family);
+  char *copy = strdup(addrs);
+  if (copy == NULL) return;
+
+  pac_mutex_lock(&dns_cache_lock);
+  if (dns_cache_ttl <= 0) goto done;
+  dns_cache_entry *e;
+  for (e = dns_cache[h]; e; e = e->next) {
+    if (e->family == family && strcmp(e->name, name) == 0) break;
+  }
+  if (e == NULL) {
+    // Keep the cache bounded; a PAC rarely touches more than a handful of
+    // names, so simply starting over is good enough.
+    if (dns_cache_count >= DNS_CACHE_MAX_ENTRIES) dns_cache_clear_locked(1);
+    if ((e = calloc(1, sizeof(*e))) == NULL) goto done;
+    if ((e->name = strdup(name)) == NULL) {
+      free(e);
+      goto done;
+    }
+    e->family = family;
+    e->next = dns_cache[h];
+    dns_cache[h] = e;
+    dns_cache_count++;
+  }
+  e->pinned |= pin;
+  if (pin && error && e->addrs && e->error == 0) goto done;  // Keep it.
+  free(e->addrs);
+  e->addrs = copy;
+  copy = NULL;
+  e->error = error;
+  e->expires_us = pac_now_us() + (int64_t)dns_cache_ttl * 1000000;
+done:
+  pac_mutex_unlock(&dns_cache_lock);
+  free(copy);
+}
+
+// Set DNS cache lifetime. 0 disables caching.
+void
+pacparser_set_dns_cache_ttl(int seconds)
+{
+  pac_mutex_lock(&dns_cache_lock);
+  dns_cache_ttl = seconds > 0 ? seconds : 0;
+  if (dns_cache_ttl == 0) dns_cache_clear_locked(0);
+  pac_mutex_unlock(&dns_cache_lock);
+}
+
+// Resolver set with pacparser_set_dns_resolver, used instead of getaddrinfo.
+static pac_mutex_t dns_resolver_lock = PAC_MUTEX_INITIALIZER;
+static pacparser_dns_resolver dns_resolver = NULL;
+static void *dns_resolver_opaque = NULL;
+
+void
+pacparser_set_dns_resolver(pacparser_dns_resolver resolver, void *opaque)
+{
+  pac_mutex_lock(&dns_resolver_lock);
+  dns_resolver = resolver;
+  dns_resolver_opaque = opaque;
+  pac_mutex_unlock(&dns_resolver_lock);
+}
+
 // DNS Resolve function; used by other routines.
-// This function is used by dnsResolve, dnsResolveEx, myIpAddress,
-// myIpAddressEx.
+//
+// Resolves hostname for a single address family (AF_INET or AF_INET6). On
+// success, *addrs is set to a malloc'd ';'-separated list of all the
+// addresses returned by the resolver. On failure, *addrs is set to a malloc'd
+// empty string (or NULL if out of memory) and the getaddrinfo error is
+// returned.
 static int
-resolve_host(const char *hostname, char *ipaddr_list, int max_results,
-             int req_ai_family)
+resolve_host_uncached(const char *hostname, int family, char **addrs)
 {
   struct addrinfo hints;
   struct addrinfo *result;
   char ipaddr[INET6_ADDRSTRLEN];
   int error;
 
-  // Truncate ipaddr_list to an empty string.
-  ipaddr_list[0] = '\0';
+  *addrs = NULL;
+
+  pac_mutex_lock(&dns_resolver_lock);
+  pacparser_dns_resolver resolver = dns_resolver;
+  void *opaque = dns_resolver_opaque;
+  pac_mutex_unlock(&dns_resolver_lock);
+  if (resolver) {
+    int64_t start_us = pac_now_us();
+    char *list = resolver(hostname, family == AF_INET6 ? 6 : 4, opaque);
+    record_latency(LATENCY_DNS, start_us);
+    if (list == NULL || *list == '\0') {
+      free(list);
+      *addrs = strdup("");
+      return EAI_NONAME;
+    }
+    *addrs = list;
+    return 0;
+  }
 
 #ifdef _WIN32
   // On windows, we need to initialize the winsock dll first.
@@ -158,47 +987,344 @@ resolve_host(const char *hostname, char *ipaddr_list, int max_results,
 
   memset(&hints, 0, sizeof(struct addrinfo));
 
-  hints.ai_family = req_ai_family;
+  hints.ai_family = family;
   hints.ai_socktype = SOCK_STREAM;
 
+  int64_t start_us = pac_now_us();
   error = getaddrinfo(hostname, NULL, &hints, &result);
-  if (error) return error;
-  int i = 0;
-  size_t offset = 0;
-  for(struct addrinfo *ai = result; ai != NULL && i < max_results; ai = ai->ai_next, i++) {
-    getnameinfo(ai->ai_addr, ai->ai_addrlen, ipaddr, sizeof(ipaddr), NULL, 0,
-                NI_NUMERICHOST);
-    if (offset > 0) {
-      ipaddr_list[offset++] = ';';
+  record_latency(LATENCY_DNS, start_us);
+  if (error) {
+    *addrs = strdup("");
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return error;
+  }
+
+  size_t offset = 0, size = 0;
+  char *list = NULL;
+  for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, ipaddr, sizeof(ipaddr), NULL,
+                    0, NI_NUMERICHOST) != 0) {
+      error = EAI_FAIL;
+      continue;
     }
     size_t len = strlen(ipaddr);
-    strcpy(ipaddr_list + offset, ipaddr);
+    // Room for a separator, the address and the terminating null.
+    if (offset + len + 2 > size) {
+      size_t new_size = size ? size * 2 : 64;
+      while (new_size < offset + len + 2) new_size *= 2;
+      char *p = realloc(list, new_size);
+      if (p == NULL) {
+        error = EAI_MEMORY;
+        break;
+      }
+      list = p;
+      size = new_size;
+    }
+    if (offset > 0) list[offset++] = ';';
+    memcpy(list + offset, ipaddr, len + 1);
     offset += len;
   }
   freeaddrinfo(result);
 #ifdef _WIN32
   WSACleanup();
 #endif
+  if (list == NULL) {
+    *addrs = strdup("");
+    return error ? error : EAI_NONAME;
+  }
+  *addrs = list;
   return 0;
 }
 
-// dnsResolve in JS context; not available in core JavaScript.
-// returns javascript null if not able to resolve.
-static JSValue
-dns_resolve(JSContext *ctx, JSValueConst UNUSED(this_val), int UNUSED(argc), JSValueConst *argv)
+// Whether a resolver error says that the name has no addresses, as opposed to
+// a failure that may go away on retry (server failure, out of memory, ...).
+static int
+dns_error_is_final(int error)
 {
-  const char *name = JS_ToCString(ctx, argv[0]);
-  if (!name) return JS_EXCEPTION;
-  char ipaddr[INET6_ADDRSTRLEN] = "";
+#ifdef EAI_NODATA
+  if (error == EAI_NODATA) return 1;
+#endif
+  return error == EAI_NONAME;
+}
+
+// Same as resolve_host_uncached, but consults the DNS cache first.
+static int
+resolve_host(const char *hostname, int family, char **addrs)
+{
+  int error;
+  if (dns_cache_get(hostname, family, &error, addrs)) return error;
+  error = resolve_host_uncached(hostname, family, addrs);
+  if (*addrs && (error == 0 || dns_error_is_final(error)))
+    dns_cache_put(hostname, family, error, *addrs, 0);
+  return error;
+}
+
+typedef struct dns_query {
+  const char *hostname;
+  int family;
+  int error;
+  char *addrs;
+  int done;                       // Set by the DNS worker that ran it.
+  struct dns_query *next;         // In dns_jobs.
+} dns_query;
+
+static void
+dns_query_run(dns_query *q)
+{
+  q->error = resolve_host(q->hostname, q->family, &q->addrs);
+}
+
+// DNS workers.
+//
+// Threads that resolve one family of a dnsResolveEx lookup while the calling
+// thread resolves the other. Up to DNS_WORKERS_MAX are started, on demand,
+// and then kept (idle) for the life of the process, so that lookups don't pay
+// for creating a thread and pacparser_cleanup never waits on a resolver. A
+// lookup that finds all of them busy resolves both families itself.
+#define DNS_WORKERS_MAX 8
+
+static pac_mutex_t dns_worker_lock = PAC_MUTEX_INITIALIZER;
+static pac_cond_t dns_job_cond = PAC_COND_INITIALIZER;   // Jobs queued.
+static pac_cond_t dns_done_cond = PAC_COND_INITIALIZER;  // Jobs done.
+static dns_query *dns_jobs = NULL;        // Queued, not yet picked up.
+static int dns_jobs_queued = 0;
+static int dns_workers = 0;
+static int dns_workers_idle = 0;
+#ifndef _WIN32
+static pid_t dns_worker_pid;              // Threads don't survive fork().
+#endif
+
+static void *
+dns_worker(void *UNUSED(arg))
+{
+  pac_mutex_lock(&dns_worker_lock);
+  for (;;) {
+    dns_workers_idle++;
+    while (dns_jobs == NULL)
+      pac_cond_wait(&dns_job_cond, &dns_worker_lock);
+    dns_workers_idle--;
+    dns_query *q = dns_jobs;
+    dns_jobs = q->next;
+    dns_jobs_queued--;
+    pac_mutex_unlock(&dns_worker_lock);
+    dns_query_run(q);
+    pac_mutex_lock(&dns_worker_lock);
+    q->done = 1;
+    pac_cond_broadcast(&dns_done_cond);
+  }
+  return NULL;
+}
+
+// Hands q to a DNS worker, starting one if all are busy. Returns 0, without
+// running q, if DNS_WORKERS_MAX are busy or no worker can be started.
+static int
+dns_worker_submit(dns_query *q)
+{
+  pac_mutex_lock(&dns_worker_lock);
+#ifndef _WIN32
+  if (dns_workers > 0 && dns_worker_pid != getpid()) {
+    // Only this thread was forked; the workers, and whoever queued jobs for
+    // them, are gone.
+    dns_workers = dns_workers_idle = 0;
+    dns_jobs = NULL;
+    dns_jobs_queued = 0;
+  }
+#endif
+  if (dns_workers_idle <= dns_jobs_queued) {
+    pac_thread_t t;
+    if (dns_workers >= DNS_WORKERS_MAX ||
+        pac_thread_create(&t, dns_worker, NULL) != 0) {
+      pac_mutex_unlock(&dns_worker_lock);
+      return 0;
+    }
+    pac_thread_detach(t);
+    dns_workers++;
+#ifndef _WIN32
+    dns_worker_pid = getpid();
+#endif
+  }
+  // The queue is at most a few entries long; keep it in order.
+  dns_query **pq = &dns_jobs;
+  while (*pq) pq = &(*pq)->next;
+  q->done = 0;
+  q->next = NULL;
+  *pq = q;
+  dns_jobs_queued++;
+  pac_cond_signal(&dns_job_cond);
+  pac_mutex_unlock(&dns_worker_lock);
+  return 1;
+}
+
+// Waits for the query handed over by dns_worker_submit.
+static void
+dns_worker_wait(dns_query *q)
+{
+  pac_mutex_lock(&dns_worker_lock);
+  while (!q->done)
+    pac_cond_wait(&dns_done_cond, &dns_worker_lock);
+  pac_mutex_unlock(&dns_worker_lock);
+}
+
+// Whether the host has a route to addr, i.e. a socket of its family can be
+// connected to it (RFC 6724 destination rule 1). Nothing is sent.
+static int
+dns_addr_reachable(const char *addr, int family)
+{
+  struct sockaddr_storage ss;
+  socklen_t len;
+  memset(&ss, 0, sizeof(ss));
+  if (family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(53);
+    if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) != 1) return 0;
+    len = sizeof(*sin6);
+  } else {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(53);
+    if (inet_pton(AF_INET, addr, &sin->sin_addr) != 1) return 0;
+    len = sizeof(*sin);
+  }
+#ifdef _WIN32
+  WSADATA WsaData;
+  WSAStartup(MAKEWORD(2,0), &WsaData);
+  SOCKET fd = socket(family, SOCK_DGRAM, 0);
+  int reachable = fd != INVALID_SOCKET &&
+                  connect(fd, (struct sockaddr *)&ss, len) == 0;
+  if (fd != INVALID_SOCKET) closesocket(fd);
+  WSACleanup();
+#else
+  int fd = socket(family, SOCK_DGRAM, 0);
+  int reachable = fd >= 0 && connect(fd, (struct sockaddr *)&ss, len) == 0;
+  if (fd >= 0) close(fd);
+#endif
+  return reachable;
+}
+
+// Precedence of an IPv6 address in the RFC 6724 default policy table (rule
+// 6). IPv4 addresses have the precedence of ::ffff:0:0/96, 35.
+static int
+dns_addr_precedence(const char *addr)
+{
+  unsigned char a[16];
+  static const unsigned char v4mapped[12] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff,
+  };
+  if (inet_pton(AF_INET6, addr, a) != 1) return 35;
+  int loopback = a[15] == 1;
+  for (int i = 0; i < 15; i++) loopback &= a[i] == 0;
+  if (loopback) return 50;                                    // ::1/128
+  if (memcmp(a, v4mapped, 12) == 0) return 35;                // ::ffff:0:0/96
+  if (a[0] == 0x20 && a[1] == 0x02) return 30;                // 2002::/16
+  if (a[0] == 0x20 && a[1] == 0x01 && a[2] == 0 && a[3] == 0)
+    return 5;                                                 // 2001::/32
+  if ((a[0] & 0xfe) == 0xfc) return 3;                        // fc00::/7
+  if (memcmp(a, v4mapped, 10) == 0 && a[10] == 0 && a[11] == 0)
+    return 1;                                                 // ::/96
+  if (a[0] == 0xfe && (a[1] & 0xc0) == 0xc0) return 1;        // fec0::/10
+  if (a[0] == 0x3f && a[1] == 0xfe) return 1;                 // 3ffe::/16
+  return 40;                                                  // ::/0
+}
+
+// Whether the IPv6 answer goes before the IPv4 one in a dnsResolveEx result.
+// getaddrinfo with AF_UNSPEC sorts all addresses by RFC 6724; A and AAAA are
+// resolved separately here, so the two families are ordered as a whole, by
+// the rules that don't depend on the source address (1 and 6) applied to
+// their first addresses. Answers from a pacparser_dns_resolver put IPv6
+// first.
+static int
+dns_v6_first(const char *addrs6, const char *addrs4, int system_resolver)
+{
+  if (!system_resolver) return 1;
+  char first6[INET6_ADDRSTRLEN], first4[INET6_ADDRSTRLEN];
+  snprintf(first6, sizeof(first6), "%.*s", (int)strcspn(addrs6, ";"), addrs6);
+  snprintf(first4, sizeof(first4), "%.*s", (int)strcspn(addrs4, ";"), addrs4);
+  int reachable6 = dns_addr_reachable(first6, AF_INET6);
+  int reachable4 = dns_addr_reachable(first4, AF_INET);
+  if (reachable6 != reachable4) return reachable6;
+  return dns_addr_precedence(first6) >= dns_addr_precedence(first4);
+}
+
+// Resolves hostname to all of its IPv6 and IPv4 addresses.
+//
+// When neither family is cached, A and AAAA lookups are issued concurrently on
+// the calling thread and a DNS worker (getaddrinfo with AF_UNSPEC serializes
+// them on many systems) and cached separately. Returns a malloc'd
+// ';'-separated list, each family in the resolver's order and the families
+// ordered by dns_v6_first, which is empty if the name could not be resolved,
+// or NULL if out of memory.
+static char *
+resolve_host_all(const char *hostname)
+{
+  dns_query q6 = { hostname, AF_INET6, 0, NULL, 0, NULL };
+  dns_query q4 = { hostname, AF_INET, 0, NULL, 0, NULL };
+  int have6 = dns_cache_get(hostname, AF_INET6, &q6.error, &q6.addrs);
+  int have4 = dns_cache_get(hostname, AF_INET, &q4.error, &q4.addrs);
+
+  if (!have6 && !have4 && dns_worker_submit(&q6)) {
+    dns_query_run(&q4);
+    dns_worker_wait(&q6);
+  } else {
+    if (!have6) dns_query_run(&q6);
+    if (!have4) dns_query_run(&q4);
+  }
+
+  char *list = NULL;
+  size_t len6 = q6.addrs ? strlen(q6.addrs) : 0;
+  size_t len4 = q4.addrs ? strlen(q4.addrs) : 0;
+  if ((list = malloc(len6 + len4 + 2)) != NULL) {
+    pac_mutex_lock(&dns_resolver_lock);
+    int system_resolver = dns_resolver == NULL;
+    pac_mutex_unlock(&dns_resolver_lock);
+    const char *first = q6.addrs, *second = q4.addrs;
+    if (len6 && len4 && !dns_v6_first(q6.addrs, q4.addrs, system_resolver)) {
+      first = q4.addrs;
+      second = q6.addrs;
+    }
+    list[0] = '\0';
+    if (first && *first) strcpy(list, first);
+    if (len6 && len4) strcat(list, ";");
+    if (second && *second) strcat(list, second);
+  }
+  free(q6.addrs);
+  free(q4.addrs);
+  return list;
+}
+
+// Truncates a ';'-separated address list to its first address.
+static void
+first_addr(char *addrs)
+{
+  char *sep = strchr(addrs, ';');
+  if (sep) *sep = '\0';
+}
+
+// dnsResolve in JS context; not available in core JavaScript.
+// returns javascript null if not able to resolve.
+static JSValue
+dns_resolve(JSContext *ctx, JSValueConst UNUSED(this_val), int UNUSED(argc), JSValueConst *argv)
+{
+  const char *name = JS_ToCString(ctx, argv[0]);
+  if (!name) return JS_EXCEPTION;
+  char *addrs;
 
   // Return null on failure.
-  if(resolve_host(name, ipaddr, 1, AF_INET)) {
-    JS_FreeCString(ctx, name);
+  int64_t start_us = pac_now_us();
+  int error = resolve_host(name, AF_INET, &addrs);
+  trace_dns(name, start_us);
+  JS_FreeCString(ctx, name);
+  if (error || addrs == NULL) {
+    free(addrs);
     return JS_NULL;
   }
 
-  JS_FreeCString(ctx, name);
-  return JS_NewString(ctx, ipaddr);
+  first_addr(addrs);
+  JSValue ret = JS_NewString(ctx, addrs);
+  free(addrs);
+  return ret;
 }
 
 // dnsResolveEx in JS context; not available in core JavaScript.
@@ -208,13 +1334,277 @@ dns_resolve_ex(JSContext *ctx, JSValueConst UNUSED(this_val), int UNUSED(argc),
 {
   const char *name = JS_ToCString(ctx, argv[0]);
   if (!name) return JS_EXCEPTION;
-  char ipaddr[INET6_ADDRSTRLEN * MAX_IP_RESULTS + MAX_IP_RESULTS] = "";
 
   // Return "" on failure.
-  resolve_host(name, ipaddr, MAX_IP_RESULTS, AF_UNSPEC);
-
+  int64_t start_us = pac_now_us();
+  char *addrs = resolve_host_all(name);
+  trace_dns(name, start_us);
   JS_FreeCString(ctx, name);
-  return JS_NewString(ctx, ipaddr);
+  if (addrs == NULL) return JS_ThrowOutOfMemory(ctx);
+
+  JSValue ret = JS_NewString(ctx, addrs);
+  free(addrs);
+  return ret;
+}
+
+// DNS prefetch.
+//
+// Many PAC files call DNS-dependent builtins with constant hostnames, e.g.
+// dnsResolve("proxy-selector.corp") or isInNet("wpad", "10.0.0.0", ...).
+// When a script is parsed, such string literals are collected and resolved
+// on a background thread. Their cache entries are pinned: they are served
+// even after expiring and are refreshed in the background at half the cache
+// TTL, so lookups never wait on them. A failed refresh keeps the last good
+// answer. Off until pacparser_set_dns_prefetch(1) is called.
+#define PREFETCH_MAX_NAMES 256
+#define PREFETCH_V4 1
+#define PREFETCH_V6 2
+
+typedef struct {
+  char *name;
+  int families;                   // PREFETCH_V4 | PREFETCH_V6
+} prefetch_name;
+
+static const struct {
+  const char *builtin;
+  int families;
+} prefetch_builtins[] = {
+  { "dnsResolve", PREFETCH_V4 },
+  { "isResolvable", PREFETCH_V4 },
+  { "isInNet", PREFETCH_V4 },
+  { "dnsResolveEx", PREFETCH_V4 | PREFETCH_V6 },
+  { "isResolvableEx", PREFETCH_V4 | PREFETCH_V6 },
+};
+
+// One set of names being prefetched. Its thread is detached and frees the
+// set when it notices stop, so that stopping never waits on a resolver.
+typedef struct {
+  prefetch_name *names;
+  int count;
+  int stop;                       // Set under prefetch_lock.
+} prefetch_set;
+
+static int dns_prefetch_enabled = 0;
+static pac_mutex_t prefetch_lock = PAC_MUTEX_INITIALIZER;
+static pac_cond_t prefetch_cond = PAC_COND_INITIALIZER;
+static prefetch_set *prefetch_current = NULL;
+
+// Set whether literal hostnames in PAC scripts are resolved ahead of time.
+void
+pacparser_set_dns_prefetch(int enable)
+{
+  dns_prefetch_enabled = enable;
+}
+
+// Returns 1 if str is a numeric IPv4 or IPv6 address.
+static int
+is_numeric_ip(const char *str)
+{
+  unsigned char buf[sizeof(struct in6_addr)];
+  return inet_pton(AF_INET, str, buf) == 1 || inet_pton(AF_INET6, str, buf) == 1;
+}
+
+static void
+add_prefetch_name(prefetch_name *names, int *count, const char *start,
+                  size_t len, int families)
+{
+  for (int i = 0; i < *count; i++) {
+    if (strlen(names[i].name) == len && strncmp(names[i].name, start, len) == 0) {
+      names[i].families |= families;
+      return;
+    }
+  }
+  if (*count >= PREFETCH_MAX_NAMES) return;
+  char *name = malloc(len + 1);
+  if (name == NULL) return;
+  memcpy(name, start, len);
+  name[len] = '\0';
+  if (is_numeric_ip(name)) {
+    free(name);
+    return;
+  }
+  names[*count].name = name;
+  names[*count].families = families;
+  (*count)++;
+}
+
+// Collects string-literal first arguments of DNS-dependent builtins. This is
+// a lightweight scan rather than a real parse: comments and string literals
+// are skipped, regular expression literals are not recognized. A false
+// positive only costs an extra DNS query.
+static int
+find_literal_hostnames(const char *script, prefetch_name *names)
+{
+  int count = 0;
+  const char *p = script;
+  while (*p) {
+    if (p[0] == '/' && p[1] == '/') {
+      while (*p && *p != '\n') p++;
+      continue;
+    }
+    if (p[0] == '/' && p[1] == '*') {
+      const char *end = strstr(p + 2, "*/");
+      if (end == NULL) break;
+      p = end + 2;
+      continue;
+    }
+    if (*p == '"' || *p == '\'' || *p == '`') {
+      char quote = *p++;
+      while (*p && *p != quote) {
+        if (*p == '\\' && p[1]) p++;
+        p++;
+      }
+      if (*p) p++;
+      continue;
+    }
+    if (!(isalpha((unsigned char)*p) || *p == '_' || *p == '$')) {
+      p++;
+      continue;
+    }
+
+    // Identifier.
+    const char *ident = p;
+    while (isalnum((unsigned char)*p) || *p == '_' || *p == '$') p++;
+    size_t ident_len = p - ident;
+    if (ident > script && ident[-1] == '.') continue;  // method call
+    int families = 0;
+    for (size_t i = 0;
+         i < sizeof(prefetch_builtins) / sizeof(prefetch_builtins[0]); i++) {
+      if (strlen(prefetch_builtins[i].builtin) == ident_len &&
+          strncmp(prefetch_builtins[i].builtin, ident, ident_len) == 0) {
+        families = prefetch_builtins[i].families;
+        break;
+      }
+    }
+    if (!families) continue;
+
+    const char *q = p;
+    while (isspace((unsigned char)*q)) q++;
+    if (*q++ != '(') continue;
+    while (isspace((unsigned char)*q)) q++;
+    if (*q != '"' && *q != '\'') continue;
+    char quote = *q++;
+    const char *start = q;
+    while (*q && *q != quote && *q != '\\' && *q != '\n') q++;
+    if (*q != quote || q == start || q - start > 253) continue;
+    add_prefetch_name(names, &count, start, q - start, families);
+    p = q + 1;
+  }
+  return count;
+}
+
+static void
+prefetch_set_free(prefetch_set *set)
+{
+  for (int i = 0; i < set->count; i++) free(set->names[i].name);
+  free(set->names);
+  free(set);
+}
+
+// Resolves name and pins the answer, unless set was stopped meanwhile.
+// Failures that may be transient are dropped, and no failure replaces a good
+// answer: the last one is kept until a refresh succeeds.
+static void
+prefetch_resolve(prefetch_set *set, const char *name, int family)
+{
+  char *addrs;
+  int error = resolve_host_uncached(name, family, &addrs);
+  pac_mutex_lock(&prefetch_lock);
+  if (addrs && !set->stop && (error == 0 || dns_error_is_final(error)))
+    dns_cache_put(name, family, error, addrs, 1);
+  pac_mutex_unlock(&prefetch_lock);
+  free(addrs);
+}
+
+static void *
+prefetch_thread(void *arg)
+{
+  prefetch_set *set = arg;
+  pac_mutex_lock(&prefetch_lock);
+  while (!set->stop) {
+    for (int i = 0; i < set->count && !set->stop; i++) {
+      pac_mutex_unlock(&prefetch_lock);
+      if (set->names[i].families & PREFETCH_V4)
+        prefetch_resolve(set, set->names[i].name, AF_INET);
+      if (set->names[i].families & PREFETCH_V6)
+        prefetch_resolve(set, set->names[i].name, AF_INET6);
+      pac_mutex_lock(&prefetch_lock);
+    }
+
+    // Refresh at half the cache TTL so that pinned answers never go stale
+    // by more than that.
+    pac_mutex_lock(&dns_cache_lock);
+    int64_t refresh_us = (int64_t)dns_cache_ttl * 500000;
+    pac_mutex_unlock(&dns_cache_lock);
+    if (refresh_us < 1000000) refresh_us = 1000000;
+    int64_t deadline = pac_now_us() + refresh_us;
+    while (!set->stop && pac_now_us() < deadline) {
+      pac_cond_timedwait(&prefetch_cond, &prefetch_lock,
+                         (deadline - pac_now_us()) / 1000 + 1);
+    }
+  }
+  pac_mutex_unlock(&prefetch_lock);
+  prefetch_set_free(set);
+  return NULL;
+}
+
+// Stops prefetching and unpins the cache entries. Doesn't wait for the
+// prefetch thread: it may be blocked in the resolver, and it exits on its own
+// without touching the cache again.
+static void
+prefetch_stop(void)
+{
+  pac_mutex_lock(&prefetch_lock);
+  if (prefetch_current == NULL) {
+    pac_mutex_unlock(&prefetch_lock);
+    return;
+  }
+  prefetch_current->stop = 1;
+  prefetch_current = NULL;
+  pac_cond_broadcast(&prefetch_cond);
+  pac_mutex_unlock(&prefetch_lock);
+  dns_cache_unpin_all();
+}
+
+// Starts resolving the literal hostnames found in script in the background,
+// replacing any previous prefetch set.
+static void
+prefetch_start(const char *script)
+{
+  prefetch_stop();
+
+  pac_mutex_lock(&dns_cache_lock);
+  int ttl = dns_cache_ttl;
+  pac_mutex_unlock(&dns_cache_lock);
+  if (ttl <= 0) return;                 // Nowhere to keep the answers.
+
+  prefetch_name *names = calloc(PREFETCH_MAX_NAMES, sizeof(prefetch_name));
+  if (names == NULL) return;
+  int count = find_literal_hostnames(script, names);
+  if (count == 0) {
+    free(names);
+    return;
+  }
+
+  prefetch_set *set = calloc(1, sizeof(prefetch_set));
+  if (set == NULL) {
+    for (int i = 0; i < count; i++) free(names[i].name);
+    free(names);
+    return;
+  }
+  set->names = names;
+  set->count = count;
+
+  pac_mutex_lock(&prefetch_lock);
+  pac_thread_t t;
+  if (pac_thread_create(&t, prefetch_thread, set) == 0) {
+    pac_thread_detach(t);
+    prefetch_current = set;
+  } else {
+    prefetch_set_free(set);
+  }
+  pac_mutex_unlock(&prefetch_lock);
+  log_debug("Prefetching %d literal hostname(s).\n", count);
 }
 
 // Prints space-separated args via the error printer (stderr by default).
@@ -252,19 +1642,21 @@ pac_console_log(JSContext *ctx, JSValueConst UNUSED(this_val), int argc, JSValue
 static JSValue
 my_ip(JSContext *ctx, JSValueConst UNUSED(this_val), int UNUSED(argc), JSValueConst *UNUSED(argv))
 {
-  char ipaddr[INET6_ADDRSTRLEN];
-
   if (my_ip_set)                  // If my (client's) IP address is already set.
-    strcpy(ipaddr, my_ip_buf);
-  else {
-    char name[256];
-    gethostname(name, sizeof(name));
-    if (resolve_host(name, ipaddr, 1, AF_INET)) {
-      strcpy(ipaddr, "127.0.0.1");
-    }
+    return JS_NewString(ctx, my_ip_buf);
+
+  char name[256];
+  char *addrs;
+  gethostname(name, sizeof(name));
+  if (resolve_host(name, AF_INET, &addrs) || addrs == NULL) {
+    free(addrs);
+    return JS_NewString(ctx, "127.0.0.1");
   }
 
-  return JS_NewString(ctx, ipaddr);
+  first_addr(addrs);
+  JSValue ret = JS_NewString(ctx, addrs);
+  free(addrs);
+  return ret;
 }
 
 // myIpAddressEx in JS context; not available in core JavaScript.
@@ -272,114 +1664,1307 @@ my_ip(JSContext *ctx, JSValueConst UNUSED(this_val), int UNUSED(argc), JSValueCo
 static JSValue
 my_ip_ex(JSContext *ctx, JSValueConst UNUSED(this_val), int UNUSED(argc), JSValueConst *UNUSED(argv))
 {
-  char ipaddr[INET6_ADDRSTRLEN * MAX_IP_RESULTS + MAX_IP_RESULTS];
-
   if (my_ip_set)                  // If my (client's) IP address is already set.
-    strcpy(ipaddr, my_ip_buf);
-  else {
-    char name[256];
-    gethostname(name, sizeof(name));
-    if (resolve_host(name, ipaddr, MAX_IP_RESULTS, AF_UNSPEC)) {
-      strcpy(ipaddr, "");
-    }
-  }
+    return JS_NewString(ctx, my_ip_buf);
 
-  return JS_NewString(ctx, ipaddr);
+  char name[256];
+  gethostname(name, sizeof(name));
+  char *addrs = resolve_host_all(name);
+  if (addrs == NULL) return JS_ThrowOutOfMemory(ctx);
+
+  JSValue ret = JS_NewString(ctx, addrs);
+  free(addrs);
+  return ret;
 }
 
-// Define some JS context related variables.
-static JSRuntime *rt = NULL;
-static JSContext *ctx = NULL;
-static JSValue global;
-static const char *proxy_result = NULL;
+// PAC coverage.
+//
+// When enabled, PAC scripts are rewritten before evaluation so that every
+// return statement in the body of FindProxyForURL reports which rule matched,
+// and every condition evaluated there counts a predicate:
+//
+//   if (a && b) return "X";
+//     =>  if (__pacparser_if(), a && __pacparser_if(true) && b)
+//           return __pacparser_return(0), "X";
+//   c ? x : y  =>  c ? __pacparser_if() ? 0 : x : __pacparser_if() ? 0 : y
+//   case v:    =>  case __pacparser_if(), v:
+//
+// __pacparser_if returns its argument, so the rewritten conditions have the
+// values of the original ones. Functions defined outside FindProxyForURL or
+// nested in it are left alone, and the rewrite keeps line numbers. Like
+// find_literal_hostnames it's a lightweight scan rather than a real parse,
+// but it also skips regular expression literals, so that quotes in them are
+// not taken for strings.
+typedef struct {
+  int line;
+  int column;
+  unsigned long hits;
+  unsigned long predicates;
+} coverage_rule;
 
-// Set my (client's) IP address to a custom value.
-int
-pacparser_setmyip(const char *ip)
+// The return statements of an instrumented script. Each engine and registry
+// entry has its own, guarded by the lock that serializes lookups in it.
+typedef struct {
+  coverage_rule *rules;
+  int num_rules;
+} coverage_table;
+
+// A bracket the scanner is in.
+typedef struct {
+  int control;          // The ( of an if, for, while, switch, catch or with.
+  int ternaries;        // Rewritten ?: at this level whose : is still to come.
+} coverage_scope;
+
+#define COVERAGE_MAX_DEPTH 256
+
+static int coverage_enabled = 0;
+// Of the lookup in progress on this thread: the conditions it evaluated and
+// the rule it returned at, or -1. The rule is credited when the lookup ends,
+// after its return value (which may have conditions of its own) is known.
+static PAC_THREAD_LOCAL unsigned long lookup_predicates = 0;
+static PAC_THREAD_LOCAL int lookup_rule = -1;
+
+typedef struct {
+  char *data;
+  size_t len, size;
+} coverage_buf;
+
+static int                              // 0 (=Failure) or 1 (=Success)
+coverage_append(coverage_buf *b, const char *s, size_t len)
 {
-  if (strlen(ip) > INET6_ADDRSTRLEN) {
-    fprintf(stderr, "pacparser_setmyip: IP too long: %s\n", ip);
-    return 0;
+  if (b->len + len + 1 > b->size) {
+    size_t size = b->size ? b->size : 4096;
+    while (size < b->len + len + 1) size *= 2;
+    char *data = realloc(b->data, size);
+    if (data == NULL) return 0;
+    b->data = data;
+    b->size = size;
   }
+  memcpy(b->data + b->len, s, len);
+  b->len += len;
+  b->data[b->len] = '\0';
+  return 1;
+}
 
-  strcpy(my_ip_buf, ip);
-  my_ip_set = 1;
+// Copies the script up to at, then text, to b.
+static int                              // 0 (=Failure) or 1 (=Success)
+coverage_insert(coverage_buf *b, const char **copied, const char *at,
+                const char *text)
+{
+  if (!coverage_append(b, *copied, at - *copied) ||
+      !coverage_append(b, text, strlen(text)))
+    return 0;
+  *copied = at;
   return 1;
 }
 
-// Deprecated: This function doesn't do anything.
-//
-// This function doesn't do anything. Microsoft extensions are now enabled by
-// default.
-void
-pacparser_enable_microsoft_extensions()
+static int
+is_ident_char(char c)
 {
-  return;
+  return isalnum((unsigned char)c) || c == '_' || c == '$';
 }
 
-// Initialize PAC parser.
-//
-// - Initializes JavaScript engine,
-// - Exports dns_functions (defined above) to JavaScript context.
-// - Evaluates JavaScript code in pacUtils variable defined in pac_utils.h.
-int                                     // 0 (=Failure) or 1 (=Success)
-pacparser_init()
+// Returns the instrumented copy of script, to be freed by the caller, and
+// sets table to its return statements. Returns NULL if out of memory or if
+// the script nests brackets too deeply.
+static char *
+coverage_instrument(const char *script, size_t len, size_t *out_len,
+                    coverage_table *table)
 {
-  char *error_prefix = "pacparser.c: pacparser_init:";
-  // Initialize JS engine
-  if (!(rt = JS_NewRuntime())) {
-    print_error("%s %s\n", error_prefix, "Could not create JavaScript runtime.");
-    return 0;
+  coverage_buf out = { NULL, 0, 0 };
+  coverage_rule *rules = NULL;
+  int num_rules = 0, rules_size = 0;
+  const char *p = script, *end = script + len, *copied = script;
+  int line = 1;
+  const char *line_start = script;
+  char last = '\0';               // Last significant character.
+  int last_ident_allows_regex = 1;
+  int last_control = 0;           // Last token was if, for, while, ...
+  int fn_head = 0;                // Last token ended a function's head.
+  coverage_scope scopes[COVERAGE_MAX_DEPTH];
+  int depth = 0;
+  // Depths of the body of FindProxyForURL and of a function nested in it,
+  // or 0, and of the expression body of an arrow function in it, or -1.
+  int fpfu_pending = 0, fpfu_depth = 0, nested_depth = 0, arrow_depth = -1;
+  int ok = 1;
+
+  scopes[0].control = 0;
+  scopes[0].ternaries = 0;
+  while (p < end && ok) {
+    if (*p == '\n') {
+      line++;
+      line_start = ++p;
+      continue;
+    }
+    if (isspace((unsigned char)*p)) {
+      p++;
+      continue;
+    }
+    if (p[0] == '/' && p + 1 < end && p[1] == '/') {
+      while (p < end && *p != '\n') p++;
+      continue;
+    }
+    if (p[0] == '/' && p + 1 < end && p[1] == '*') {
+      for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/'); p++) {
+        if (*p == '\n') {
+          line++;
+          line_start = p + 1;
+        }
+      }
+      p += 2;
+      continue;
+    }
+    int active = fpfu_depth && !nested_depth && arrow_depth < 0;
+    int was_control = last_control, was_fn_head = fn_head;
+    last_control = fn_head = 0;
+    int regex = *p == '/' &&
+                (last_ident_allows_regex && (last == '\0' || last == 'a' ||
+                 strchr("(,=:[!&|?{};+-*%<>~^", last)));
+    if (*p == '"' || *p == '\'' || *p == '`' || regex) {
+      char quote = *p++;
+      int in_class = 0;
+      while (p < end && (*p != quote || in_class)) {
+        if (*p == '\\' && p + 1 < end) p++;
+        else if (regex && *p == '[') in_class = 1;
+        else if (regex && *p == ']') in_class = 0;
+        else if (*p == '\n') {
+          if (quote != '`') break;        // Unterminated.
+          line++;
+          line_start = p + 1;
+        }
+        p++;
+      }
+      if (p < end && *p == quote) p++;
+      last = ')';                         // Like an operand.
+      last_ident_allows_regex = 1;
+      continue;
+    }
+    if (!is_ident_char(*p)) {
+      char c = *p++;
+      if (c == '(' || c == '[' || c == '{') {
+        if (++depth == COVERAGE_MAX_DEPTH) {
+          ok = 0;
+          break;
+        }
+        scopes[depth].control = c == '(' && was_control;
+        scopes[depth].ternaries = 0;
+        if (c == '{' && fpfu_pending) {
+          fpfu_pending = 0;
+          fpfu_depth = depth;
+        } else if (c == '{' && was_fn_head && active) {
+          nested_depth = depth;
+        }
+      } else if ((c == ')' || c == ']' || c == '}') && depth > 0) {
+        // A function's body follows the ) of its parameters.
+        fn_head = c == ')' && !scopes[depth].control;
+        if (depth == nested_depth) nested_depth = 0;
+        if (depth == fpfu_depth) fpfu_depth = 0;
+        if (depth == arrow_depth) arrow_depth = -1;
+        depth--;
+      } else if (c == ',' || c == ';') {
+        if (depth == arrow_depth) arrow_depth = -1;
+      } else if ((c == '&' || c == '|') && p < end && *p == c &&
+                 !(p + 1 < end && p[1] == '=')) {
+        p++;
+        if (active)
+          ok = coverage_insert(&out, &copied, p, c == '&' ?
+                               " __pacparser_if(true) &&" :
+                               " __pacparser_if(false) ||");
+      } else if (c == '=' && p < end && *p == '>') {
+        const char *q = ++p;
+        while (q < end && isspace((unsigned char)*q)) q++;
+        if (q < end && *q == '{') fn_head = 1;
+        else if (active) arrow_depth = depth;
+      } else if (c == '?' && p < end &&
+                 (*p == '?' ||
+                  (*p == '.' && !(p + 1 < end && isdigit((unsigned char)p[1]))))) {
+        p++;                              // ?? or ?.
+      } else if (c == '?' && active) {
+        ok = coverage_insert(&out, &copied, p, " __pacparser_if() ? 0 :");
+        scopes[depth].ternaries++;
+      } else if (c == ':' && scopes[depth].ternaries > 0) {
+        scopes[depth].ternaries--;
+        if (depth == arrow_depth) arrow_depth = -1;
+        ok = coverage_insert(&out, &copied, p, " __pacparser_if() ? 0 :");
+      }
+      last = c;
+      last_ident_allows_regex = 1;
+      continue;
+    }
+
+    // Identifier, keyword or number.
+    const char *ident = p;
+    while (p < end && is_ident_char(*p)) p++;
+    size_t ident_len = p - ident;
+    int after_dot = ident > script && ident[-1] == '.';
+#define IDENT_IS(s) (ident_len == strlen(s) && strncmp(ident, s, ident_len) == 0)
+    const char *q = p;
+    while (q < end && (*q == ' ' || *q == '\t')) q++;
+    if (!after_dot && !fpfu_depth && IDENT_IS("FindProxyForURL") &&
+        (last == 'f' || (q < end && *q == '='))) {
+      fpfu_pending = 1;
+    } else if (active && !after_dot && IDENT_IS("if") && q < end &&
+               *q == '(') {
+      ok = coverage_insert(&out, &copied, q + 1, "__pacparser_if(), ");
+    } else if (active && !after_dot && IDENT_IS("case")) {
+      ok = coverage_insert(&out, &copied, p, " __pacparser_if(),");
+    } else if (active && !after_dot && IDENT_IS("return")) {
+      char call[64];
+      int has_value = q < end && *q != ';' && *q != '}' && *q != '\n' &&
+                      *q != '\r';
+      snprintf(call, sizeof(call), " __pacparser_return(%d)%s", num_rules,
+               has_value ? "," : "");
+      if (num_rules == rules_size) {
+        rules_size = rules_size ? rules_size * 2 : 64;
+        coverage_rule *r = realloc(rules, rules_size * sizeof(coverage_rule));
+        if (r == NULL) {
+          ok = 0;
+          break;
+        }
+        rules = r;
+      }
+      rules[num_rules].line = line;
+      rules[num_rules].column = (int)(ident - line_start) + 1;
+      rules[num_rules].hits = 0;
+      rules[num_rules].predicates = 0;
+      num_rules++;
+      ok = coverage_insert(&out, &copied, p, call);
+    }
+    last_control = !after_dot &&
+                   (IDENT_IS("if") || IDENT_IS("for") || IDENT_IS("while") ||
+                    IDENT_IS("switch") || IDENT_IS("catch") ||
+                    IDENT_IS("with"));
+    // Regular expressions may follow keywords like return and typeof, but
+    // not names and numbers.
+    last_ident_allows_regex = IDENT_IS("return") || IDENT_IS("typeof") ||
+                              IDENT_IS("case") || IDENT_IS("in") ||
+                              IDENT_IS("void") || IDENT_IS("delete");
+    last = IDENT_IS("function") ? 'f' : 'a';
+#undef IDENT_IS
   }
-  if (!(ctx = JS_NewContext(rt))) {
-    print_error("%s %s\n", error_prefix, "Could not create JavaScript context.");
-    return 0;
+  if (ok) ok = coverage_append(&out, copied, end - copied);
+  if (!ok) {
+    free(out.data);
+    free(rules);
+    return NULL;
   }
+  table->rules = rules;
+  table->num_rules = num_rules;
+  *out_len = out.len;
+  return out.data;
+}
 
-  global = JS_GetGlobalObject(ctx);
+// Copies up to max rules of table to rules.
+static int                              // Number of rules in table.
+coverage_get(const coverage_table *table, pacparser_rule_coverage *rules,
+             int max)
+{
+  for (int i = 0; rules && i < table->num_rules && i < max; i++) {
+    rules[i].line = table->rules[i].line;
+    rules[i].column = table->rules[i].column;
+    rules[i].hits = table->rules[i].hits;
+    rules[i].predicates = table->rules[i].predicates;
+  }
+  return table->num_rules;
+}
 
-  // Export our functions to Javascript engine
-  JS_SetPropertyStr(ctx, global, "dnsResolve",
-    JS_NewCFunction(ctx, dns_resolve, "dnsResolve", 1));
-  JS_SetPropertyStr(ctx, global, "myIpAddress",
-    JS_NewCFunction(ctx, my_ip, "myIpAddress", 0));
-  JS_SetPropertyStr(ctx, global, "dnsResolveEx",
-    JS_NewCFunction(ctx, dns_resolve_ex, "dnsResolveEx", 1));
-  JS_SetPropertyStr(ctx, global, "myIpAddressEx",
-    JS_NewCFunction(ctx, my_ip_ex, "myIpAddressEx", 0));
+static JSValue
+coverage_if(JSContext *ctx, JSValueConst UNUSED(this_val), int argc,
+            JSValueConst *argv)
+{
+  lookup_predicates++;
+  return argc > 0 ? JS_DupValue(ctx, argv[0]) : JS_UNDEFINED;
+}
 
-  JS_SetPropertyStr(ctx, global, "alert",
-    JS_NewCFunction(ctx, pac_alert, "alert", 1));
-  JSValue console = JS_NewObject(ctx);
-  JS_SetPropertyStr(ctx, console, "log",
-    JS_NewCFunction(ctx, pac_console_log, "log", 1));
-  JS_SetPropertyStr(ctx, global, "console", console);
+static JSValue
+coverage_return(JSContext *ctx, JSValueConst UNUSED(this_val), int argc,
+                JSValueConst *argv)
+{
+  int32_t rule = -1;
+  if (argc > 0) JS_ToInt32(ctx, &rule, argv[0]);
+  lookup_rule = rule;
+  return JS_UNDEFINED;
+}
 
-  // Evaluate pacUtils. Utility functions required to parse pac files.
-  JSValue result = JS_Eval(ctx, pacUtils, strlen(pacUtils), "pac_utils",
-                           JS_EVAL_TYPE_GLOBAL);
-  if (JS_IsException(result)) {
-    dump_js_exception(ctx);
-    print_error("%s %s\n", error_prefix,
-		  "Could not evaluate pacUtils defined in pac_utils.h.");
-    JS_FreeValue(ctx, result);
-    return 0;
+static void
+coverage_lookup_begin(void)
+{
+  lookup_predicates = 0;
+  lookup_rule = -1;
+}
+
+// Credits a lookup in a script with the given rules, if it succeeded.
+static void
+coverage_lookup_end(coverage_table *table, const char *proxy)
+{
+  if (proxy && lookup_rule >= 0 && lookup_rule < table->num_rules) {
+    table->rules[lookup_rule].hits++;
+    table->rules[lookup_rule].predicates += lookup_predicates;
   }
-  JS_FreeValue(ctx, result);
+}
 
-  if (_debug()) print_error("DEBUG: Pacparser Initialized.\n");
-  return 1;
+void
+pacparser_enable_coverage(int enable)
+{
+  coverage_enabled = enable ? 1 : 0;
 }
 
-// Parses the given PAC script string.
+// Sampling profiler.
 //
-// Evaluates the given PAC script string in the JavaScript context created
-// by pacparser_init.
+// While profiling, the interrupt handler (see below) captures the JavaScript
+// stack at most once per sampling interval. QuickJS only calls the handler
+// every few thousand bytecode instructions, on function calls and loop back
+// edges, and exposes no stack walking API, so a sample is taken by creating
+// an Error and parsing its stack trace, which is limited to the innermost 10
+// frames by default (Error.stackTraceLimit). QuickJS records a frame's line
+// only when it makes a call, so frames sampled in a loop carry the line of
+// their last call, or none, before the first.
+#define PROFILE_BUCKETS 1024
+#define PROFILE_MAX_FRAMES 64
+#define PROFILE_MAX_STACK 4096
+
+typedef struct profile_stack {
+  struct profile_stack *next;
+  uint64_t hash;
+  unsigned long samples;
+  char stack[];                   // Folded: "outer;...;inner".
+} profile_stack;
+
+static int profile_interval_us = 0;       // 0 when not profiling.
+static pac_mutex_t profile_lock = PAC_MUTEX_INITIALIZER;
+static profile_stack *profile_stacks[PROFILE_BUCKETS];  // Guarded by
+static unsigned long *profile_lines = NULL;             // profile_lock.
+static int profile_num_lines = 0;
+static PAC_THREAD_LOCAL int64_t profile_next_us = 0;
+static PAC_THREAD_LOCAL int profile_sampling = 0;
+
+static void
+profile_clear_locked(void)
+{
+  for (int i = 0; i < PROFILE_BUCKETS; i++) {
+    while (profile_stacks[i]) {
+      profile_stack *next = profile_stacks[i]->next;
+      free(profile_stacks[i]);
+      profile_stacks[i] = next;
+    }
+  }
+  free(profile_lines);
+  profile_lines = NULL;
+  profile_num_lines = 0;
+}
+
+// Counts a sample of the folded stack, whose innermost PAC script frame was
+// at the given line (0 if none).
+static void
+profile_record(const char *folded, int line)
+{
+  size_t len = strlen(folded);
+  uint64_t hash = hash_script(folded, len);
+  pac_mutex_lock(&profile_lock);
+  profile_stack **ps = &profile_stacks[hash % PROFILE_BUCKETS];
+  while (*ps && ((*ps)->hash != hash || strcmp((*ps)->stack, folded) != 0))
+    ps = &(*ps)->next;
+  if (*ps == NULL && (*ps = malloc(sizeof(profile_stack) + len + 1))) {
+    (*ps)->next = NULL;
+    (*ps)->hash = hash;
+    (*ps)->samples = 0;
+    memcpy((*ps)->stack, folded, len + 1);
+  }
+  if (*ps) (*ps)->samples++;
+  if (line > 0 && line >= profile_num_lines) {
+    int n = profile_num_lines ? profile_num_lines : 256;
+    while (n <= line) n *= 2;
+    unsigned long *lines = realloc(profile_lines, n * sizeof(unsigned long));
+    if (lines) {
+      memset(lines + profile_num_lines, 0,
+             (n - profile_num_lines) * sizeof(unsigned long));
+      profile_lines = lines;
+      profile_num_lines = n;
+    }
+  }
+  if (line > 0 && line < profile_num_lines) profile_lines[line]++;
+  pac_mutex_unlock(&profile_lock);
+}
+
+// Turns a QuickJS stack trace ("    at name (file:line:col)" lines, innermost
+// first) into a folded stack. Frames of the PAC script are labeled
+// "name:line", others (builtins) just "name".
+static void
+profile_fold(const char *trace)
+{
+  char frames[PROFILE_MAX_FRAMES][128];
+  int num_frames = 0, line = 0;
+  const char *p = trace;
+  while (num_frames < PROFILE_MAX_FRAMES && (p = strstr(p, "at ")) != NULL) {
+    p += 3;
+    const char *eol = strchr(p, '\n');
+    if (eol == NULL) eol = p + strlen(p);
+    const char *paren = eol;
+    while (paren > p && *paren != '(') paren--;
+    int name_len = (int)(paren > p ? paren - p - 1 : eol - p);
+    int frame_line = 0;
+    if (paren > p && strncmp(paren + 1, "PAC script:", 11) == 0)
+      frame_line = atoi(paren + 12);
+    if (frame_line > 0) {
+      snprintf(frames[num_frames], sizeof(frames[0]), "%.*s:%d", name_len, p,
+               frame_line);
+      if (line == 0) line = frame_line;
+    } else {
+      snprintf(frames[num_frames], sizeof(frames[0]), "%.*s", name_len, p);
+    }
+    // ';' separates frames in the folded format.
+    for (char *c = frames[num_frames]; *c; c++) if (*c == ';') *c = ',';
+    num_frames++;
+    p = eol;
+  }
+  if (num_frames == 0) return;
+
+  char folded[PROFILE_MAX_STACK];
+  size_t len = 0;
+  for (int i = num_frames - 1; i >= 0 && len < sizeof(folded); i--) {
+    len += snprintf(folded + len, sizeof(folded) - len, "%s%s", frames[i],
+                    i ? ";" : "");
+  }
+  profile_record(folded, line);
+}
+
+// Samples the JavaScript stack of the evaluation running in ctx's runtime.
+static void
+profile_sample(JSContext *ctx)
+{
+  // Error.prepareStackTrace, if a script defines it, runs JavaScript.
+  if (profile_sampling) return;
+  profile_sampling = 1;
+  JSValue error = JS_NewError(ctx);
+  if (JS_IsException(error)) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+  } else {
+    JSValue stack = JS_GetPropertyStr(ctx, error, "stack");
+    const char *trace = JS_IsString(stack) ? JS_ToCString(ctx, stack) : NULL;
+    if (trace) profile_fold(trace);
+    JS_FreeCString(ctx, trace);
+    if (JS_IsException(stack)) JS_FreeValue(ctx, JS_GetException(ctx));
+    JS_FreeValue(ctx, stack);
+  }
+  JS_FreeValue(ctx, error);
+  profile_sampling = 0;
+}
+
+// Starts sampling JavaScript stacks.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_start_profile(int interval_us)
+{
+  if (interval_us <= 0) return 0;
+  pac_mutex_lock(&profile_lock);
+  profile_clear_locked();
+  pac_mutex_unlock(&profile_lock);
+  profile_interval_us = interval_us;
+  return 1;
+}
+
+void
+pacparser_stop_profile(void)
+{
+  profile_interval_us = 0;
+}
+
+// Reports the samples collected since pacparser_start_profile.
+void
+pacparser_get_profile(pacparser_profile_stack_fn stack_fn,
+                      pacparser_profile_line_fn line_fn, void *opaque)
+{
+  pac_mutex_lock(&profile_lock);
+  for (int i = 0; stack_fn && i < PROFILE_BUCKETS; i++) {
+    for (profile_stack *ps = profile_stacks[i]; ps; ps = ps->next)
+      stack_fn(ps->stack, ps->samples, opaque);
+  }
+  for (int line = 1; line_fn && line < profile_num_lines; line++) {
+    if (profile_lines[line]) line_fn(line, profile_lines[line], opaque);
+  }
+  pac_mutex_unlock(&profile_lock);
+}
+
+// Evaluation deadlines.
+//
+// Runtimes get an interrupt handler that aborts JavaScript evaluation once
+// the deadline of the evaluation in progress has passed. QuickJS calls it
+// every few thousand bytecode instructions and regular expression matching
+// steps, so runaway loops and regular expressions are stopped shortly after
+// the deadline. Time spent blocked in DNS lookups is not interruptible.
+typedef struct eval_deadline {
+  int64_t deadline_us;            // 0 if none.
+  int expired;
+  JSContext *ctx;                 // For sampling stacks while profiling.
+} eval_deadline;
+
+static int eval_timeout_ms = 0;           // 0 for no deadline.
+static char *timeout_fallback = NULL;     // Protected by timeout_lock.
+static pac_mutex_t timeout_lock = PAC_MUTEX_INITIALIZER;
+
+// Whether the last lookup or parse on this thread timed out.
+static PAC_THREAD_LOCAL int timed_out = 0;
+
+static int
+interrupt_handler(JSRuntime *UNUSED(rt), void *opaque)
+{
+  eval_deadline *d = opaque;
+  int interval_us = profile_interval_us;
+  if (interval_us && d->ctx) {
+    int64_t now_us = pac_now_us();
+    if (now_us >= profile_next_us) {
+      profile_next_us = now_us + interval_us;
+      profile_sample(d->ctx);
+    }
+  }
+  if (d->deadline_us == 0 || pac_now_us() < d->deadline_us) return 0;
+  d->expired = 1;
+  return 1;
+}
+
+// Starts an evaluation in ctx, or another context of the same runtime, under
+// deadline d.
+static void
+deadline_start(eval_deadline *d, JSContext *ctx)
+{
+  int timeout_ms = eval_timeout_ms;
+  d->ctx = ctx;
+  d->expired = 0;
+  d->deadline_us = timeout_ms > 0 ? pac_now_us() + (int64_t)timeout_ms * 1000
+                                  : 0;
+}
+
+// Ends the evaluation under deadline d. Returns 1 if it was aborted because
+// the deadline passed.
+static int
+deadline_stop(eval_deadline *d, const char *error_prefix)
+{
+  d->deadline_us = 0;
+  d->ctx = NULL;
+  if (!d->expired) return 0;
+  d->expired = 0;
+  timed_out = 1;
+  count_timeout();
+  print_error("%s %s %d ms.\n", error_prefix, "Evaluation timed out after",
+              eval_timeout_ms);
+  return 1;
+}
+
+// Ends a lookup that returned proxy under deadline d. If it timed out,
+// returns a copy of the timeout fallback, if any, instead.
+static char *
+deadline_lookup_result(eval_deadline *d, char *proxy, const char *error_prefix)
+{
+  if (!deadline_stop(d, error_prefix)) return proxy;
+  free(proxy);
+  proxy = NULL;
+  pac_mutex_lock(&timeout_lock);
+  if (timeout_fallback) proxy = strdup(timeout_fallback);
+  pac_mutex_unlock(&timeout_lock);
+  return proxy;
+}
+
+// Sets the deadline for each lookup and parse.
+void
+pacparser_set_timeout(int timeout_ms)
+{
+  eval_timeout_ms = timeout_ms > 0 ? timeout_ms : 0;
+}
+
+// Sets the result of lookups that time out.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_set_timeout_fallback(const char *proxy)
+{
+  char *copy = NULL;
+  if (proxy && !(copy = strdup(proxy))) return 0;
+  pac_mutex_lock(&timeout_lock);
+  char *old = timeout_fallback;
+  timeout_fallback = copy;
+  pac_mutex_unlock(&timeout_lock);
+  free(old);
+  return 1;
+}
+
+// Returns 1 if the last lookup or parse on this thread timed out.
+int
+pacparser_timed_out(void)
+{
+  return timed_out;
+}
+
+typedef struct pac_pool pac_pool;
+
+// A JavaScript engine with the pacparser builtins and, once parsed, a PAC
+// script loaded into it.
+//
+// The global API works on the "current" engine. Engines are reference
+// counted so that the current engine can be replaced (see
+// pacparser_reload_pac_file) without stalling lookups: lookups that started
+// on the old engine finish on it, new lookups go to the new one, and the old
+// engine is freed once its last lookup is done. A QuickJS runtime must not be
+// used by two threads at once, so every use of an engine's runtime is
+// serialized by the engine's own lock.
+typedef struct pac_engine {
+  JSRuntime *rt;
+  pac_pool *pool;                 // rt's allocator, if using the pool.
+  pacparser_allocator allocator;  // Wrapped by rt's, if no usable_size_fn.
+  int profile;                    // PACPARSER_PROFILE_* of its contexts.
+  eval_deadline deadline;         // Of the evaluation in progress.
+  JSContext *ctx;
+  JSValue global;
+  pac_mutex_t lock;               // Serializes use of rt and ctx.
+  int refcount;                   // Protected by engine_lock.
+  // Digest of the last PAC script successfully evaluated in this engine, if
+  // script_loaded is set. Protected by lock.
+  int script_loaded;
+  script_digest script;
+  // Bytecode of that PAC script, captured if isolated lookups were enabled
+  // when it was parsed. Protected by lock.
+  uint8_t *snapshot;
+  size_t snapshot_len;
+  coverage_table coverage;        // Of that PAC script. Protected by lock.
+} pac_engine;
+
+static pac_engine *engine = NULL;         // Current engine.
+static pac_mutex_t engine_lock = PAC_MUTEX_INITIALIZER;
+
+// Whether lookups run in a fresh context (see pacparser_set_isolated_lookups).
+static int isolated_lookups = 0;
+
+// Allocator for new engines' runtimes. Protected by engine_lock.
+static int pool_allocator_enabled = 0;
+static int custom_allocator_set = 0;
+static pacparser_allocator custom_allocator;
+
+// Profile of new engines' contexts (see pacparser_set_engine_profile).
+// Protected by engine_lock.
+static int engine_profile = PACPARSER_PROFILE_FULL;
+
+// Memory and stack settings for the runtimes of engines and registries, 0 for
+// QuickJS defaults. Protected by engine_lock.
+#define GC_DEFAULT_THRESHOLD (256 * 1024)     // QuickJS's initial threshold.
+static size_t memory_limit = 0;
+static size_t gc_threshold = 0;
+static size_t max_stack_size = 0;
+
+// Installs the interrupt handler for deadline d, and the memory and stack
+// settings, in a new runtime. Every runtime, whether it's an engine's (global,
+// reloaded or cached by pacparser_just_find_proxy) or a registry's, is set up
+// here.
+static void
+runtime_set_limits(JSRuntime *rt, eval_deadline *d)
+{
+  pac_mutex_lock(&engine_lock);
+  size_t limit = memory_limit;
+  size_t threshold = gc_threshold;
+  size_t stack = max_stack_size;
+  pac_mutex_unlock(&engine_lock);
+  JS_SetInterruptHandler(rt, interrupt_handler, d);
+  if (limit) JS_SetMemoryLimit(rt, limit);
+  if (threshold) JS_SetGCThreshold(rt, threshold);
+  if (stack) JS_SetMaxStackSize(rt, stack);
+}
+
+// Last result returned by pacparser_find_proxy on this thread.
+static PAC_THREAD_LOCAL char *proxy_result = NULL;
+
+// Pool allocator.
+//
+// A simple size-class allocator for a single runtime. Blocks of up to
+// POOL_MAX_SMALL bytes are carved out of 64 KiB slabs and recycled through
+// per-class free lists; larger ones go to malloc. A runtime is only ever used
+// by one thread at a time (see pac_engine), so the pool needs no locking,
+// unlike malloc, which has to synchronize between threads running different
+// engines. Memory is returned to the system when the runtime is freed.
+#define POOL_HEADER 16                  // Keeps malloc's alignment.
+#define POOL_SLAB_SIZE (64 * 1024)
+#define POOL_MAX_SMALL 512
+#define POOL_NUM_CLASSES 20
+#define POOL_LARGE UINT32_MAX
+
+// 16 byte steps up to 256, then 64 byte steps up to POOL_MAX_SMALL.
+static const uint16_t pool_class_size[POOL_NUM_CLASSES] = {
+  16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+  320, 384, 448, 512,
+};
+
+typedef struct {
+  size_t size;                    // Usable size.
+  uint32_t cls;                   // Size class, or POOL_LARGE.
+} pool_header;
+
+typedef struct pool_block {
+  struct pool_block *next;
+} pool_block;
+
+struct pac_pool {
+  pool_block *free_lists[POOL_NUM_CLASSES];
+  char *slab_next;
+  char *slab_end;
+  void *slabs;                    // Linked through their first word.
+};
+
+static uint32_t
+pool_class(size_t size)
+{
+  if (size <= 256) return size ? (uint32_t)((size - 1) >> 4) : 0;
+  return 16 + (uint32_t)((size - 257) >> 6);
+}
+
+static void *
+pool_malloc(void *opaque, size_t size)
+{
+  pac_pool *pool = opaque;
+  char *p;
+  size_t usable;
+  uint32_t cls;
+  if (size > POOL_MAX_SMALL) {
+    if (size > SIZE_MAX - POOL_HEADER) return NULL;
+    if (!(p = malloc(POOL_HEADER + size))) return NULL;
+    usable = size;
+    cls = POOL_LARGE;
+  } else {
+    cls = pool_class(size);
+    usable = pool_class_size[cls];
+    pool_block *b = pool->free_lists[cls];
+    if (b) {
+      pool->free_lists[cls] = b->next;
+      return b;
+    }
+    size_t need = POOL_HEADER + usable;
+    if ((size_t)(pool->slab_end - pool->slab_next) < need) {
+      char *slab = malloc(POOL_SLAB_SIZE);
+      if (slab == NULL) return NULL;
+      *(void **)slab = pool->slabs;
+      pool->slabs = slab;
+      pool->slab_next = slab + POOL_HEADER;
+      pool->slab_end = slab + POOL_SLAB_SIZE;
+    }
+    p = pool->slab_next;
+    pool->slab_next += need;
+  }
+  pool_header *h = (pool_header *)p;
+  h->size = usable;
+  h->cls = cls;
+  return p + POOL_HEADER;
+}
+
+static void
+pool_free(void *opaque, void *ptr)
+{
+  if (ptr == NULL) return;
+  pac_pool *pool = opaque;
+  pool_header *h = (pool_header *)((char *)ptr - POOL_HEADER);
+  if (h->cls == POOL_LARGE) {
+    free(h);
+    return;
+  }
+  pool_block *b = ptr;
+  b->next = pool->free_lists[h->cls];
+  pool->free_lists[h->cls] = b;
+}
+
+static void *
+pool_calloc(void *opaque, size_t count, size_t size)
+{
+  if (size && count > SIZE_MAX / size) return NULL;
+  void *p = pool_malloc(opaque, count * size);
+  if (p) memset(p, 0, count * size);
+  return p;
+}
+
+static void *
+pool_realloc(void *opaque, void *ptr, size_t size)
+{
+  if (ptr == NULL) return pool_malloc(opaque, size);
+  if (size == 0) {
+    pool_free(opaque, ptr);
+    return NULL;
+  }
+  pool_header *h = (pool_header *)((char *)ptr - POOL_HEADER);
+  if (h->cls == POOL_LARGE && size > POOL_MAX_SMALL) {
+    if (size > SIZE_MAX - POOL_HEADER) return NULL;
+    pool_header *n = realloc(h, POOL_HEADER + size);
+    if (n == NULL) return NULL;
+    n->size = size;
+    return (char *)n + POOL_HEADER;
+  }
+  if (h->cls != POOL_LARGE && size <= h->size) return ptr;
+  void *p = pool_malloc(opaque, size);
+  if (p == NULL) return NULL;
+  memcpy(p, ptr, h->size < size ? h->size : size);
+  pool_free(opaque, ptr);
+  return p;
+}
+
+static size_t
+pool_usable_size(const void *ptr)
+{
+  return ((const pool_header *)((const char *)ptr - POOL_HEADER))->size;
+}
+
+static const JSMallocFunctions pool_malloc_functions = {
+  pool_calloc, pool_malloc, pool_free, pool_realloc, pool_usable_size,
+};
+
+static pac_pool *
+pool_new(void)
+{
+  return calloc(1, sizeof(pac_pool));
+}
+
+static void
+pool_destroy(pac_pool *pool)
+{
+  if (pool == NULL) return;
+  void *slab = pool->slabs;
+  while (slab) {
+    void *next = *(void **)slab;
+    free(slab);
+    slab = next;
+  }
+  free(pool);
+}
+
+// Wrapper for a custom allocator without usable_size_fn. QuickJS accounts
+// memory, and so enforces the memory limit, by usable size, so the size of
+// each block is kept in a header in front of it. opaque is the allocator.
+#define SIZED_HEADER 16                 // Keeps malloc's alignment.
+
+static void *
+sized_malloc(void *opaque, size_t size)
+{
+  const pacparser_allocator *a = opaque;
+  if (size > SIZE_MAX - SIZED_HEADER) return NULL;
+  char *p = a->malloc_fn(a->opaque, size + SIZED_HEADER);
+  if (p == NULL) return NULL;
+  *(size_t *)p = size;
+  return p + SIZED_HEADER;
+}
+
+static void *
+sized_calloc(void *opaque, size_t count, size_t size)
+{
+  if (size && count > SIZE_MAX / size) return NULL;
+  void *p = sized_malloc(opaque, count * size);
+  if (p) memset(p, 0, count * size);
+  return p;
+}
+
+static void
+sized_free(void *opaque, void *ptr)
+{
+  const pacparser_allocator *a = opaque;
+  if (ptr) a->free_fn(a->opaque, (char *)ptr - SIZED_HEADER);
+}
+
+static void *
+sized_realloc(void *opaque, void *ptr, size_t size)
+{
+  const pacparser_allocator *a = opaque;
+  if (ptr == NULL) return sized_malloc(opaque, size);
+  if (size == 0) {
+    sized_free(opaque, ptr);
+    return NULL;
+  }
+  if (size > SIZE_MAX - SIZED_HEADER) return NULL;
+  char *p = a->realloc_fn(a->opaque, (char *)ptr - SIZED_HEADER,
+                          size + SIZED_HEADER);
+  if (p == NULL) return NULL;
+  *(size_t *)p = size;
+  return p + SIZED_HEADER;
+}
+
+static size_t
+sized_usable_size(const void *ptr)
+{
+  return *(const size_t *)((const char *)ptr - SIZED_HEADER);
+}
+
+static const JSMallocFunctions sized_malloc_functions = {
+  sized_calloc, sized_malloc, sized_free, sized_realloc, sized_usable_size,
+};
+
+// Sets the allocator used by the runtimes of engines created afterwards.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_set_allocator(const pacparser_allocator *allocator)
+{
+  if (allocator && !(allocator->calloc_fn && allocator->malloc_fn &&
+                     allocator->free_fn && allocator->realloc_fn)) {
+    print_error("%s %s\n", "pacparser.c: pacparser_set_allocator:",
+                "Allocator functions missing.");
+    return 0;
+  }
+  pac_mutex_lock(&engine_lock);
+  custom_allocator_set = allocator != NULL;
+  if (allocator) custom_allocator = *allocator;
+  pac_mutex_unlock(&engine_lock);
+  return 1;
+}
+
+// Sets the profile of engines created afterwards.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_set_engine_profile(int profile)
+{
+  if (profile != PACPARSER_PROFILE_FULL &&
+      profile != PACPARSER_PROFILE_MINIMAL) {
+    print_error("%s %s\n", "pacparser.c: pacparser_set_engine_profile:",
+                "Unknown profile.");
+    return 0;
+  }
+  pac_mutex_lock(&engine_lock);
+  engine_profile = profile;
+  pac_mutex_unlock(&engine_lock);
+  return 1;
+}
+
+// Enables or disables the pool allocator for engines created afterwards.
+void
+pacparser_set_pool_allocator(int enable)
+{
+  pac_mutex_lock(&engine_lock);
+  pool_allocator_enabled = enable;
+  pac_mutex_unlock(&engine_lock);
+}
+
+// Set my (client's) IP address to a custom value, or back to this host's
+// address if ip is NULL.
+int
+pacparser_setmyip(const char *ip)
+{
+  if (ip == NULL) {
+    my_ip_set = 0;
+    return 1;
+  }
+  if (strlen(ip) > INET6_ADDRSTRLEN) {
+    fprintf(stderr, "pacparser_setmyip: IP too long: %s\n", ip);
+    return 0;
+  }
+
+  strcpy(my_ip_buf, ip);
+  my_ip_set = 1;
+  return 1;
+}
+
+// Enables or disables isolated lookups.
+//
+// Takes effect for PAC scripts parsed after the call.
+void
+pacparser_set_isolated_lookups(int enable)
+{
+  isolated_lookups = enable;
+}
+
+// Deprecated: This function doesn't do anything.
+//
+// This function doesn't do anything. Microsoft extensions are now enabled by
+// default.
+void
+pacparser_enable_microsoft_extensions()
+{
+  return;
+}
+
+static void
+engine_free(pac_engine *e)
+{
+  if (e == NULL) return;
+  if (e->ctx) {
+    JS_FreeValue(e->ctx, e->global);
+    JS_FreeContext(e->ctx);
+  }
+  if (e->rt) JS_FreeRuntime(e->rt);
+  pool_destroy(e->pool);
+  free(e->snapshot);
+  free(e->coverage.rules);
+  pac_mutex_destroy(&e->lock);
+  free(e);
+}
+
+// Copies a compiled function into a malloc'd buffer of serialized bytecode,
+// which can be evaluated in any context with JS_ReadObject and
+// JS_EvalFunction. Returns NULL on failure.
+static uint8_t *
+serialize_function(JSContext *ctx, JSValueConst func, size_t *bc_len)
+{
+  size_t size;
+  uint8_t *js_buf = JS_WriteObject(ctx, &size, func, JS_WRITE_OBJ_BYTECODE);
+  if (js_buf == NULL) return NULL;
+  // Copy out of the runtime's allocator so the buffer can outlive it.
+  uint8_t *buf = malloc(size);
+  if (buf) {
+    memcpy(buf, js_buf, size);
+    *bc_len = size;
+  }
+  js_free(ctx, js_buf);
+  return buf;
+}
+
+// Compiles JavaScript source into serialized bytecode (see
+// serialize_function). Returns NULL on failure.
+static uint8_t *
+compile_to_bytecode(JSContext *ctx, const char *source, size_t len,
+                    const char *filename, size_t *bc_len)
+{
+  JSValue func = JS_Eval(ctx, source, len, filename,
+                         JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+  if (JS_IsException(func)) {
+    dump_js_exception(ctx);
+    return NULL;
+  }
+  uint8_t *buf = serialize_function(ctx, func, bc_len);
+  JS_FreeValue(ctx, func);
+  return buf;
+}
+
+// Evaluates serialized bytecode in ctx.
+static JSValue
+eval_bytecode(JSContext *ctx, const uint8_t *bc, size_t bc_len)
+{
+  JSValue func = JS_ReadObject(ctx, bc, bc_len, JS_READ_OBJ_BYTECODE);
+  if (JS_IsException(func)) return func;
+  return JS_EvalFunction(ctx, func);
+}
+
+// pacUtils compiled to bytecode, shared by every context in the process.
+// Compiling pac_utils takes most of the time of setting up a context, so it's
+// done once, on first use, and never freed.
+static uint8_t *utils_bc = NULL;
+static size_t utils_bc_len = 0;
+static pac_mutex_t utils_bc_lock = PAC_MUTEX_INITIALIZER;
+
+// Returns the compiled pacUtils, compiling it in ctx if needed.
+static const uint8_t *
+get_utils_bytecode(JSContext *ctx, size_t *len)
+{
+  pac_mutex_lock(&utils_bc_lock);
+  if (utils_bc == NULL) {
+    utils_bc = compile_to_bytecode(ctx, pacUtils, strlen(pacUtils),
+                                   "pac_utils", &utils_bc_len);
+  }
+  *len = utils_bc_len;
+  pac_mutex_unlock(&utils_bc_lock);
+  return utils_bc;
+}
+
+// Creates a context with the intrinsics of the given profile.
+//
+// PACPARSER_PROFILE_MINIMAL has what PAC scripts and pac_utils use: the base
+// objects (Object, Function, Array, String, Number, Math, Error, ...), Date,
+// RegExp and JSON, and Eval, which JS_Eval itself needs. It leaves out Proxy,
+// Map/Set, typed arrays, Promise, WeakRef, DOMException and performance.
+static JSContext *
+new_pac_context(JSRuntime *rt, int profile)
+{
+  if (profile != PACPARSER_PROFILE_MINIMAL) return JS_NewContext(rt);
+  JSContext *ctx = JS_NewContextRaw(rt);
+  if (ctx == NULL) return NULL;
+  if (JS_AddIntrinsicBaseObjects(ctx) ||
+      JS_AddIntrinsicDate(ctx) ||
+      JS_AddIntrinsicEval(ctx) ||
+      JS_AddIntrinsicRegExp(ctx) ||
+      JS_AddIntrinsicJSON(ctx)) {
+    JS_FreeContext(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+// Adds pacparser's builtins to a fresh context:
+//
+// - Exports dns_functions (defined above) to JavaScript context.
+// - Evaluates JavaScript code in pacUtils variable defined in pac_utils.h,
+//   from its shared bytecode (see get_utils_bytecode).
+static int                              // 0 (=Failure) or 1 (=Success)
+context_add_builtins(JSContext *ctx, const char *error_prefix)
+{
+  JSValue global = JS_GetGlobalObject(ctx);
+
+  // Export our functions to Javascript engine
+  JS_SetPropertyStr(ctx, global, "dnsResolve",
+    JS_NewCFunction(ctx, dns_resolve, "dnsResolve", 1));
+  JS_SetPropertyStr(ctx, global, "myIpAddress",
+    JS_NewCFunction(ctx, my_ip, "myIpAddress", 0));
+  JS_SetPropertyStr(ctx, global, "dnsResolveEx",
+    JS_NewCFunction(ctx, dns_resolve_ex, "dnsResolveEx", 1));
+  JS_SetPropertyStr(ctx, global, "myIpAddressEx",
+    JS_NewCFunction(ctx, my_ip_ex, "myIpAddressEx", 0));
+
+  JS_SetPropertyStr(ctx, global, "alert",
+    JS_NewCFunction(ctx, pac_alert, "alert", 1));
+  JSValue console = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, console, "log",
+    JS_NewCFunction(ctx, pac_console_log, "log", 1));
+  JS_SetPropertyStr(ctx, global, "console", console);
+  if (coverage_enabled) {
+    JS_SetPropertyStr(ctx, global, "__pacparser_if",
+      JS_NewCFunction(ctx, coverage_if, "__pacparser_if", 0));
+    JS_SetPropertyStr(ctx, global, "__pacparser_return",
+      JS_NewCFunction(ctx, coverage_return, "__pacparser_return", 1));
+  }
+  JS_FreeValue(ctx, global);
+
+  // Evaluate pacUtils. Utility functions required to parse pac files.
+  size_t bc_len;
+  const uint8_t *bc = get_utils_bytecode(ctx, &bc_len);
+  if (bc == NULL) {
+    print_error("%s %s\n", error_prefix,
+		  "Could not compile pacUtils defined in pac_utils.h.");
+    return 0;
+  }
+  JSValue result = eval_bytecode(ctx, bc, bc_len);
+  if (JS_IsException(result)) {
+    dump_js_exception(ctx);
+    print_error("%s %s\n", error_prefix,
+		  "Could not evaluate pacUtils defined in pac_utils.h.");
+    return 0;
+  }
+  JS_FreeValue(ctx, result);
+  if (builtin_stats_enabled || trace_threshold) wrap_builtins(ctx);
+  return 1;
+}
+
+// Creates the runtime of a new engine with the configured allocator and
+// memory settings.
+static JSRuntime *
+engine_new_runtime(pac_engine *e)
+{
+  pac_mutex_lock(&engine_lock);
+  int use_pool = pool_allocator_enabled;
+  int use_custom = custom_allocator_set;
+  pacparser_allocator a = custom_allocator;
+  e->profile = engine_profile;
+  pac_mutex_unlock(&engine_lock);
+
+  JSRuntime *rt;
+  if (use_pool) {
+    if (!(e->pool = pool_new())) return NULL;
+    rt = JS_NewRuntime2(&pool_malloc_functions, e->pool);
+  } else if (use_custom && a.usable_size_fn == NULL) {
+    e->allocator = a;
+    rt = JS_NewRuntime2(&sized_malloc_functions, &e->allocator);
+  } else if (use_custom) {
+    JSMallocFunctions mf = {
+      a.calloc_fn, a.malloc_fn, a.free_fn, a.realloc_fn, a.usable_size_fn,
+    };
+    rt = JS_NewRuntime2(&mf, a.opaque);
+  } else {
+    rt = JS_NewRuntime();
+  }
+  if (rt == NULL) return NULL;
+  runtime_set_limits(rt, &e->deadline);
+  return rt;
+}
+
+// Creates a new engine.
+//
+// - Initializes JavaScript engine,
+// - Adds pacparser's builtins to its context.
+static pac_engine *                     // New engine or NULL on failure.
+engine_new(void)
+{
+  char *error_prefix = "pacparser.c: pacparser_init:";
+  pac_engine *e = calloc(1, sizeof(pac_engine));
+  if (e == NULL) {
+    print_error("%s %s\n", error_prefix, "Out of memory.");
+    return NULL;
+  }
+  pac_mutex_init(&e->lock);
+  e->global = JS_UNDEFINED;
+  e->refcount = 1;
+
+  // Initialize JS engine
+  if (!(e->rt = engine_new_runtime(e))) {
+    print_error("%s %s\n", error_prefix, "Could not create JavaScript runtime.");
+    engine_free(e);
+    return NULL;
+  }
+  if (!(e->ctx = new_pac_context(e->rt, e->profile))) {
+    print_error("%s %s\n", error_prefix, "Could not create JavaScript context.");
+    engine_free(e);
+    return NULL;
+  }
+  e->global = JS_GetGlobalObject(e->ctx);
+  if (!context_add_builtins(e->ctx, error_prefix)) {
+    engine_free(e);
+    return NULL;
+  }
+  return e;
+}
+
+// Returns a new reference to the current engine, or NULL if there is none.
+static pac_engine *
+engine_acquire(void)
+{
+  pac_mutex_lock(&engine_lock);
+  pac_engine *e = engine;
+  if (e) e->refcount++;
+  pac_mutex_unlock(&engine_lock);
+  return e;
+}
+
+// Drops a reference to e, freeing it when the last one goes away.
+static void
+engine_release(pac_engine *e)
+{
+  if (e == NULL) return;
+  pac_mutex_lock(&engine_lock);
+  int last = --e->refcount == 0;
+  pac_mutex_unlock(&engine_lock);
+  if (last) engine_free(e);
+}
+
+// Makes e (whose reference is taken over) the current engine and releases
+// the previous one.
+static void
+engine_publish(pac_engine *e)
+{
+  pac_mutex_lock(&engine_lock);
+  pac_engine *old = engine;
+  engine = e;
+  pac_mutex_unlock(&engine_lock);
+  engine_release(old);
+}
+
+// Locks e for use by the calling thread.
+static void
+engine_lock_for_use(pac_engine *e)
+{
+  pac_mutex_lock(&e->lock);
+  // The runtime may have been created, or last used, on another thread.
+  JS_UpdateStackTop(e->rt);
+}
+
+// Initialize PAC parser.
+//
+// Creates a new engine and makes it the current one.
 int                                     // 0 (=Failure) or 1 (=Success)
-pacparser_parse_pac_string(const char *script)
+pacparser_init()
+{
+  pac_engine *e = engine_new();
+  if (e == NULL) return 0;
+  engine_publish(e);
+  log_info("Pacparser Initialized.\n");
+  return 1;
+}
+
+// Returns 1 if script is the last PAC script evaluated in e, and e has its
+// snapshot if isolated lookups need one. Caller must hold e->lock.
+static int
+engine_has_script(pac_engine *e, const script_digest *d)
+{
+  return e->script_loaded && same_script_digest(&e->script, d) &&
+         (e->snapshot || !isolated_lookups);
+}
+
+// Evaluates the given PAC script in the engine e, unless it's identical to
+// the last script evaluated there, in which case *unchanged is set and the
+// evaluation is skipped. script must be null terminated at script[len].
+static int                              // 0 (=Failure) or 1 (=Success)
+engine_eval_pac(pac_engine *e, const char *script, size_t len, int *unchanged)
 {
   char *error_prefix = "pacparser.c: pacparser_parse_pac_string:";
-  if (ctx == NULL) {
+  timed_out = 0;
+  if (e == NULL) {
     print_error("%s %s\n", error_prefix, "Pac parser is not initialized.");
     return 0;
   }
@@ -387,21 +2972,119 @@ pacparser_parse_pac_string(const char *script)
     print_error("%s %s\n", error_prefix, "PAC script is NULL.");
     return 0;
   }
-  JSValue result = JS_Eval(ctx, script, strlen(script), "PAC script",
-                           JS_EVAL_TYPE_GLOBAL);
+  script_digest digest;
+  digest_script(script, len, &digest);
+  engine_lock_for_use(e);
+  *unchanged = engine_has_script(e, &digest);
+  if (*unchanged) {
+    pac_mutex_unlock(&e->lock);
+    log_debug("PAC script unchanged, not parsing.\n");
+    return 1;
+  }
+  JSValue result;
+  uint8_t *snapshot = NULL;
+  size_t snapshot_len = 0;
+  const char *source = script;
+  size_t source_len = len;
+  char *instrumented = NULL;
+  coverage_table coverage = { NULL, 0 };
+  if (coverage_enabled &&
+      (instrumented = coverage_instrument(script, len, &source_len,
+                                          &coverage))) {
+    source = instrumented;
+  }
+  int64_t start_us = pac_now_us();
+  deadline_start(&e->deadline, e->ctx);
+  if (isolated_lookups) {
+    // Keep the script's bytecode to restore this state for each lookup.
+    result = JS_Eval(e->ctx, source, source_len, "PAC script",
+                     JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+    if (!JS_IsException(result)) {
+      snapshot = serialize_function(e->ctx, result, &snapshot_len);
+      result = JS_EvalFunction(e->ctx, result);
+    }
+  } else {
+    result = JS_Eval(e->ctx, source, source_len, "PAC script",
+                     JS_EVAL_TYPE_GLOBAL);
+  }
+  deadline_stop(&e->deadline, error_prefix);
+  record_latency(LATENCY_PARSE, start_us);
+  free(instrumented);
   if (JS_IsException(result)) {
-    dump_js_exception(ctx);
+    // The script may have been partially evaluated. Isolated lookups keep
+    // using the snapshot of the last script that was.
+    e->script_loaded = 0;
+    free(snapshot);
+    free(coverage.rules);
+    dump_js_exception(e->ctx);
+    pac_mutex_unlock(&e->lock);
     print_error("%s %s\n", error_prefix, "Failed to evaluate the pac script.");
-    if (_debug()) print_error("DEBUG: Failed to parse the PAC script:\n%s\n",
-				script);
-    JS_FreeValue(ctx, result);
+    log_debug("Failed to parse the PAC script:\n%s\n", script);
     return 0;
   }
-  JS_FreeValue(ctx, result);
-  if (_debug()) print_error("DEBUG: Parsed the PAC script.\n");
+  JS_FreeValue(e->ctx, result);
+  e->script_loaded = 1;
+  e->script = digest;
+  free(e->snapshot);
+  e->snapshot = snapshot;
+  e->snapshot_len = snapshot_len;
+  // The rewritten return statements index the new script's rules.
+  free(e->coverage.rules);
+  e->coverage = coverage;
+  pac_mutex_unlock(&e->lock);
+  log_debug("Parsed the PAC script.\n");
+  return 1;
+}
+
+// Evaluates the given PAC script in the current engine, and optionally starts
+// prefetching the literal hostnames it references. Re-parsing the script
+// that was parsed last is a no-op. script must be null terminated at
+// script[len].
+static int                              // 0 (=Failure) or 1 (=Success)
+parse_pac_buffer(const char *script, size_t len, int prefetch_dns)
+{
+  int unchanged = 0;
+  pac_engine *e = engine_acquire();
+  int result = engine_eval_pac(e, script, len, &unchanged);
+  engine_release(e);
+  if (!result) return 0;
+  count_parse(!unchanged);
+  if (!unchanged && prefetch_dns) prefetch_start(script);
   return 1;
 }
 
+// Loads the given PAC file and parses it with parse_pac_buffer.
+static int                              // 0 (=Failure) or 1 (=Success)
+parse_pac_file(const char *pacfile, int prefetch_dns)
+{
+  pac_file_buf script;
+
+  if (!load_pac_file(pacfile, &script)) {
+    print_error("pacparser.c: pacparser_parse_pac: %s: %s: %s\n",
+            "Could not read the pacfile: ", pacfile, strerror(errno));
+    return 0;
+  }
+
+  int result = parse_pac_buffer(script.data, script.len, prefetch_dns);
+  unload_pac_file(&script);
+
+  if (result) log_info("Parsed the PAC file: %s\n", pacfile);
+  else log_debug("Could not parse the PAC file: %s\n", pacfile);
+
+  return result;
+}
+
+// Parses the given PAC script string.
+//
+// Evaluates the given PAC script string in the JavaScript context created
+// by pacparser_init.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_parse_pac_string(const char *script)
+{
+  return parse_pac_buffer(script, script ? strlen(script) : 0,
+                          dns_prefetch_enabled);
+}
+
 // Parses the given PAC file.
 //
 // reads the given PAC file and evaluates it in the JavaScript context created
@@ -409,121 +3092,814 @@ pacparser_parse_pac_string(const char *script)
 int                                     // 0 (=Failure) or 1 (=Success)
 pacparser_parse_pac_file(const char *pacfile)
 {
-  char *script = NULL;
+  return parse_pac_file(pacfile, dns_prefetch_enabled);
+}
 
-  if ((script = read_file_into_str(pacfile)) == NULL) {
-    print_error("pacparser.c: pacparser_parse_pac: %s: %s: %s\n",
+// Parses PAC file (same as pacparser_parse_pac_file)
+//
+// (Deprecated) Use pacparser_parse_pac_file instead.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_parse_pac(const char *pacfile)
+{
+  return pacparser_parse_pac_file(pacfile);
+}
+
+// Parses the PAC script into a fresh engine and, on success, atomically makes
+// it the current engine. Lookups keep being served by the previous engine
+// while the new one is being built. Reloading the script the current engine
+// already runs is a no-op.
+static int                              // 0 (=Failure) or 1 (=Success)
+reload_pac_buffer(const char *script, size_t len)
+{
+  script_digest digest;
+  digest_script(script, len, &digest);
+  pac_engine *cur = engine_acquire();
+  if (cur) {
+    pac_mutex_lock(&cur->lock);
+    int unchanged = engine_has_script(cur, &digest);
+    pac_mutex_unlock(&cur->lock);
+    engine_release(cur);
+    if (unchanged) {
+      count_parse(0);
+      log_debug("PAC script unchanged, not reloading.\n");
+      return 1;
+    }
+  }
+
+  int unchanged = 0;
+  pac_engine *e = engine_new();
+  if (e == NULL) return 0;
+  if (!engine_eval_pac(e, script, len, &unchanged)) {
+    engine_release(e);
+    return 0;
+  }
+  engine_publish(e);
+  count_parse(1);
+  if (dns_prefetch_enabled) prefetch_start(script);
+  log_info("Reloaded the PAC script.\n");
+  return 1;
+}
+
+// Replaces the current PAC script with the given one without interrupting
+// lookups.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_reload_pac_string(const char *script)
+{
+  if (script == NULL) {
+    print_error("pacparser.c: pacparser_reload_pac_string: %s\n",
+                "PAC script is NULL.");
+    return 0;
+  }
+  return reload_pac_buffer(script, strlen(script));
+}
+
+// Replaces the current PAC script with the given PAC file without
+// interrupting lookups.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_reload_pac_file(const char *pacfile)
+{
+  pac_file_buf script;
+
+  if (!load_pac_file(pacfile, &script)) {
+    print_error("pacparser.c: pacparser_reload_pac_file: %s: %s: %s\n",
             "Could not read the pacfile: ", pacfile, strerror(errno));
     return 0;
   }
+  int result = reload_pac_buffer(script.data, script.len);
+  unload_pac_file(&script);
+  return result;
+}
+
+// PAC file watcher.
+//
+// Reloads the PAC file (with pacparser_reload_pac_file) whenever it changes.
+// On Linux changes are picked up with inotify on the file's directory, which
+// also catches editors and deploy tools that replace the file with rename().
+// Elsewhere the file's size and modification time are polled.
+#define WATCH_POLL_MS 1000
+
+static pac_mutex_t watch_lock = PAC_MUTEX_INITIALIZER;
+static pac_thread_t watch_thread_handle;
+static int watch_running = 0;
+static int watch_stop_requested = 0;    // Read with pac_flag_load.
+
+typedef struct {
+  int exists;
+  int64_t size;
+  int64_t mtime;                  // Nanoseconds, where available.
+  uint64_t dev;
+  uint64_t ino;
+} file_version;
+
+// What the watcher thread watches. Set up before the thread starts, so that
+// changes made as soon as pacparser_watch_pac_file returns are not missed.
+typedef struct {
+  char *path;
+  file_version last;              // Version of the file last loaded.
+#ifdef __linux__
+  char *dir;                      // Directory of path, NULL for ".".
+  const char *name;               // File name in dir.
+  int fd;                         // inotify instance, or -1 to poll.
+#endif
+} watch_state;
+
+static watch_state *watch = NULL;      // Protected by watch_lock.
+
+static void
+get_file_version(const char *path, file_version *v)
+{
+  struct stat st;
+  memset(v, 0, sizeof(*v));
+  if (stat(path, &st) != 0) return;
+  v->exists = 1;
+  v->size = st.st_size;
+  v->mtime = (int64_t)st.st_mtime * 1000000000;
+#if defined(__linux__)
+  v->mtime += st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+  v->mtime += st.st_mtimespec.tv_nsec;
+#endif
+  v->dev = st.st_dev;
+  v->ino = st.st_ino;
+}
+
+static int
+same_file_version(const file_version *a, const file_version *b)
+{
+  return a->exists == b->exists && a->size == b->size &&
+         a->mtime == b->mtime && a->dev == b->dev && a->ino == b->ino;
+}
+
+static void
+watch_state_free(watch_state *w)
+{
+  if (w == NULL) return;
+#ifdef __linux__
+  if (w->fd >= 0) close(w->fd);
+  free(w->dir);
+#endif
+  free(w->path);
+  free(w);
+}
+
+// Returns the state to watch pacfile from its current version on, or NULL if
+// out of memory.
+static watch_state *
+watch_state_new(const char *pacfile)
+{
+  watch_state *w = calloc(1, sizeof(watch_state));
+  if (w == NULL) return NULL;
+#ifdef __linux__
+  w->fd = -1;
+#endif
+  if ((w->path = strdup(pacfile)) == NULL) {
+    watch_state_free(w);
+    return NULL;
+  }
+#ifdef __linux__
+  // Watch the directory: the file itself may be replaced.
+  const char *sep = strrchr(w->path, '/');
+  const char *watch_dir = ".";
+  w->name = sep ? sep + 1 : w->path;
+  if (sep) {
+    if ((w->dir = strndup(w->path, sep - w->path)) == NULL) {
+      watch_state_free(w);
+      return NULL;
+    }
+    watch_dir = *w->dir ? w->dir : "/";
+  }
+  w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (w->fd >= 0 && inotify_add_watch(w->fd, watch_dir, IN_CLOSE_WRITE |
+                                      IN_MOVED_TO | IN_CREATE) < 0) {
+    close(w->fd);
+    w->fd = -1;
+  }
+#endif
+  // After the watch, so that any later change is either seen by the watch or
+  // differs from this version.
+  get_file_version(w->path, &w->last);
+  return w;
+}
+
+static void *
+watch_thread(void *arg)
+{
+  watch_state *w = arg;
+  file_version cur;
+  while (!pac_flag_load(&watch_stop_requested)) {
+    int changed = 0;
+#ifdef __linux__
+    if (w->fd >= 0) {
+      struct pollfd pfd = { w->fd, POLLIN, 0 };
+      if (poll(&pfd, 1, 250) <= 0) continue;
+      char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+      ssize_t n;
+      while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+          struct inotify_event *ev = (struct inotify_event *)p;
+          if (ev->len && strcmp(ev->name, w->name) == 0) changed = 1;
+          p += sizeof(struct inotify_event) + ev->len;
+        }
+      }
+      if (changed) get_file_version(w->path, &cur);
+    } else
+#endif
+    {
+      for (int waited = 0;
+           waited < WATCH_POLL_MS && !pac_flag_load(&watch_stop_requested);
+           waited += 50) {
+#ifdef _WIN32
+        Sleep(50);
+#else
+        usleep(50 * 1000);
+#endif
+      }
+      get_file_version(w->path, &cur);
+      changed = cur.exists && !same_file_version(&cur, &w->last);
+    }
+    if (!changed || !cur.exists || pac_flag_load(&watch_stop_requested))
+      continue;
+    w->last = cur;
+    log_info("PAC file changed: %s\n", w->path);
+    pacparser_reload_pac_file(w->path);
+  }
+  return NULL;
+}
+
+// Stops watching the PAC file.
+void
+pacparser_unwatch_pac_file(void)
+{
+  pac_mutex_lock(&watch_lock);
+  if (watch_running) {
+    pac_flag_store(&watch_stop_requested, 1);
+    pac_thread_join(watch_thread_handle);
+    watch_running = 0;
+    pac_flag_store(&watch_stop_requested, 0);
+    watch_state_free(watch);
+    watch = NULL;
+  }
+  pac_mutex_unlock(&watch_lock);
+}
+
+// Reloads the given PAC file whenever it changes.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_watch_pac_file(const char *pacfile)
+{
+  pacparser_unwatch_pac_file();
+  pac_mutex_lock(&watch_lock);
+  if ((watch = watch_state_new(pacfile)) == NULL ||
+      pac_thread_create(&watch_thread_handle, watch_thread, watch) != 0) {
+    watch_state_free(watch);
+    watch = NULL;
+    pac_mutex_unlock(&watch_lock);
+    print_error("pacparser.c: pacparser_watch_pac_file: %s\n",
+                "Could not start the watcher thread.");
+    return 0;
+  }
+  watch_running = 1;
+  pac_mutex_unlock(&watch_lock);
+  return 1;
+}
+
+// Checks the url and host arguments of a lookup.
+static int                              // 0 (=Invalid) or 1 (=Valid)
+valid_lookup_args(const char *url, const char *host, const char *error_prefix)
+{
+  if (url == NULL || (strcmp(url, "") == 0)) {
+    print_error("%s %s\n", error_prefix, "URL not defined");
+    return 0;
+  }
+  if (host == NULL || (strcmp(host,"") == 0)) {
+    print_error("%s %s\n", error_prefix, "Host not defined");
+    return 0;
+  }
+  return 1;
+}
+
+// Evaluates findProxyForURL(url, host) in the given context. Returns the
+// result as a malloc'd string, or NULL on error.
+static char *
+context_find_proxy(JSContext *ctx, JSValueConst global, const char *url,
+                   const char *host, const char *error_prefix)
+{
+  // Test if findProxyForURL is defined.
+  const char *script = "typeof(findProxyForURL);";
+  log_debug("Executing JavaScript: %s\n", script);
+  JSValue check = JS_Eval(ctx, script, strlen(script), NULL, JS_EVAL_TYPE_GLOBAL);
+  const char *type_str = JS_ToCString(ctx, check);
+  int is_function = type_str && strcmp("function", type_str) == 0;
+  JS_FreeCString(ctx, type_str);
+  JS_FreeValue(ctx, check);
+  if (!is_function) {
+    print_error("%s %s\n", error_prefix,
+		  "Javascript function findProxyForURL not defined.");
+    return NULL;
+  }
+
+  // Get function and call it
+  JSValue func = JS_GetPropertyStr(ctx, global, "findProxyForURL");
+  JSValue args[2] = { JS_NewString(ctx, url), JS_NewString(ctx, host) };
+  JSValue rval = JS_Call(ctx, func, global, 2, args);
+
+  JS_FreeValue(ctx, args[0]);
+  JS_FreeValue(ctx, args[1]);
+  JS_FreeValue(ctx, func);
+
+  if (JS_IsException(rval)) {
+    dump_js_exception(ctx);
+    print_error("%s %s\n", error_prefix, "Problem in executing findProxyForURL.");
+    return NULL;
+  }
+
+  char *proxy = NULL;
+  const char *result = JS_ToCString(ctx, rval);
+  if (result) {
+    proxy = strdup(result);
+    JS_FreeCString(ctx, result);
+  }
+  JS_FreeValue(ctx, rval);
+  return proxy;
+}
+
+// Evaluates findProxyForURL(url, host) in a new context of e's runtime,
+// restored to the state right after the PAC script was parsed by evaluating
+// e's snapshot, and discards the context afterwards. Fails if there is no
+// snapshot, rather than sharing e's context. Caller must hold e->lock.
+static char *
+engine_find_proxy_isolated(pac_engine *e, const char *url, const char *host,
+                           const char *error_prefix)
+{
+  if (e->snapshot == NULL) {
+    print_error("%s %s\n", error_prefix, "No snapshot of the PAC script for "
+                "an isolated lookup; parse it after enabling them.");
+    return NULL;
+  }
+  JSContext *ctx = new_pac_context(e->rt, e->profile);
+  if (ctx == NULL) {
+    print_error("%s %s\n", error_prefix, "Could not create JavaScript context.");
+    return NULL;
+  }
+  char *proxy = NULL;
+  e->deadline.ctx = ctx;          // Profile the context that runs the lookup.
+  if (context_add_builtins(ctx, error_prefix)) {
+    JSValue result = eval_bytecode(ctx, e->snapshot, e->snapshot_len);
+    if (JS_IsException(result)) {
+      dump_js_exception(ctx);
+      print_error("%s %s\n", error_prefix, "Failed to evaluate the pac script.");
+    } else {
+      JSValue global = JS_GetGlobalObject(ctx);
+      proxy = context_find_proxy(ctx, global, url, host, error_prefix);
+      JS_FreeValue(ctx, global);
+    }
+    JS_FreeValue(ctx, result);
+  }
+  e->deadline.ctx = e->ctx;
+  JS_FreeContext(ctx);
+  return proxy;
+}
+
+// Looks up the proxy for url and host in engine e, in a fresh context if
+// isolated lookups are enabled, under the lookup deadline. Caller must hold
+// e->lock.
+static char *
+engine_lookup(pac_engine *e, const char *url, const char *host,
+              const char *error_prefix)
+{
+  char *proxy;
+  int64_t start_us = pac_now_us();
+  lookup_builtins_reset();
+  coverage_lookup_begin();
+  deadline_start(&e->deadline, e->ctx);
+  if (isolated_lookups) {
+    proxy = engine_find_proxy_isolated(e, url, host, error_prefix);
+  } else {
+    proxy = context_find_proxy(e->ctx, e->global, url, host, error_prefix);
+  }
+  proxy = deadline_lookup_result(&e->deadline, proxy, error_prefix);
+  coverage_lookup_end(&e->coverage, proxy);
+  record_latency(LATENCY_FIND_PROXY, start_us);
+  return proxy;
+}
+
+// Finds proxy for the given URL and Host.
+//
+// If JavaScript engine is intialized and findProxyForURL function is defined,
+// it evaluates code findProxyForURL(url,host) in JavaScript context and
+// returns the result.
+char *                                  // Proxy string or NULL if failed.
+pacparser_find_proxy(const char *url, const char *host)
+{
+  char *error_prefix = "pacparser.c: pacparser_find_proxy:";
+  timed_out = 0;
+  log_debug("Finding proxy for URL: %s and Host: %s\n", url, host);
+  if (!valid_lookup_args(url, host, error_prefix)) return NULL;
+  pac_engine *e = engine_acquire();
+  if (e == NULL) {
+    print_error("%s %s\n", error_prefix, "Pac parser is not initialized.");
+    return NULL;
+  }
+
+  // Free previous result if any
+  free(proxy_result);
+
+  trace_begin();
+  engine_lock_for_use(e);
+  proxy_result = engine_lookup(e, url, host, error_prefix);
+  pac_mutex_unlock(&e->lock);
+  engine_release(e);
+  trace_end(url, host, proxy_result);
+  return proxy_result;  // valid until next call on this thread or cleanup
+}
+
+// Destroys JavaScript Engine.
+void
+pacparser_cleanup()
+{
+  // Re-initialize config variables.
+  my_ip_set = 0;
+  pacparser_unwatch_pac_file();
+  prefetch_stop();
+  dns_cache_clear();
+
+  free(proxy_result);
+  proxy_result = NULL;
+  engine_publish(NULL);
+  pacparser_clear_pac_cache();
+  log_info("Pacparser destroyed.\n");
+}
+
+// Cache of engines with a parsed PAC file, for pacparser_just_find_proxy.
+//
+// Entries are keyed by the file's path and version (inode, size and mtime),
+// so an edited or replaced file is parsed again. The cache is bounded both by
+// number of entries and by the memory their runtimes use; least recently used
+// entries are evicted first.
+#define PAC_CACHE_DEFAULT_ENTRIES 8
+#define PAC_CACHE_DEFAULT_BYTES (64 * 1024 * 1024)
+
+typedef struct pac_cache_entry {
+  char *path;
+  file_version version;
+  pac_engine *engine;             // Holds a reference.
+  size_t memory;
+  struct pac_cache_entry *next;   // Most recently used first.
+} pac_cache_entry;
+
+static pac_mutex_t pac_cache_lock = PAC_MUTEX_INITIALIZER;
+static pac_cache_entry *pac_cache = NULL;
+static int pac_cache_max_entries = PAC_CACHE_DEFAULT_ENTRIES;
+static size_t pac_cache_max_bytes = PAC_CACHE_DEFAULT_BYTES;
+
+static void
+pac_cache_entry_free(pac_cache_entry *c)
+{
+  engine_release(c->engine);
+  free(c->path);
+  free(c);
+}
+
+// Evicts entries until the cache is within its limits, with room for an
+// entry of extra_bytes more if extra_entries is set. Caller must hold
+// pac_cache_lock. Returns the evicted entries, to be freed with
+// pac_cache_entry_free outside the lock.
+static pac_cache_entry *
+pac_cache_trim_locked(int extra_entries, size_t extra_bytes)
+{
+  int entries = extra_entries;
+  size_t bytes = extra_bytes;
+  pac_cache_entry **pc = &pac_cache;
+  while (*pc) {
+    entries++;
+    bytes += (*pc)->memory;
+    if (entries > pac_cache_max_entries || bytes > pac_cache_max_bytes) break;
+    pc = &(*pc)->next;
+  }
+  // Everything from *pc on doesn't fit.
+  pac_cache_entry *evicted = *pc;
+  *pc = NULL;
+  return evicted;
+}
+
+static void
+pac_cache_free_list(pac_cache_entry *c)
+{
+  while (c) {
+    pac_cache_entry *next = c->next;
+    pac_cache_entry_free(c);
+    c = next;
+  }
+}
+
+// Returns a new reference to the cached engine for the given file version, or
+// NULL if there is none.
+static pac_engine *
+pac_cache_get(const char *path, const file_version *v)
+{
+  pac_engine *e = NULL;
+  pac_mutex_lock(&pac_cache_lock);
+  for (pac_cache_entry **pc = &pac_cache; *pc; pc = &(*pc)->next) {
+    pac_cache_entry *c = *pc;
+    if (strcmp(c->path, path) != 0) continue;
+    if (same_file_version(&c->version, v)) {
+      // Move to front.
+      *pc = c->next;
+      c->next = pac_cache;
+      pac_cache = c;
+      e = c->engine;
+      pac_mutex_lock(&engine_lock);
+      e->refcount++;
+      pac_mutex_unlock(&engine_lock);
+    }
+    break;
+  }
+  pac_mutex_unlock(&pac_cache_lock);
+  return e;
+}
+
+// Adds the engine e, with the given file parsed into it, to the cache.
+static void
+pac_cache_put(const char *path, const file_version *v, pac_engine *e)
+{
+  JSMemoryUsage usage;
+  engine_lock_for_use(e);
+  JS_ComputeMemoryUsage(e->rt, &usage);
+  pac_mutex_unlock(&e->lock);
+  size_t memory = usage.malloc_size;
 
-  int result = pacparser_parse_pac_string(script);
-  if (script != NULL) free(script);
+  pac_cache_entry *c = calloc(1, sizeof(pac_cache_entry));
+  if (c == NULL || (c->path = strdup(path)) == NULL) {
+    free(c);
+    return;
+  }
+  c->version = *v;
+  c->engine = e;
+  c->memory = memory;
+  pac_mutex_lock(&engine_lock);
+  e->refcount++;
+  pac_mutex_unlock(&engine_lock);
 
-  if (_debug()) {
-    if(result) print_error("DEBUG: Parsed the PAC file: %s\n", pacfile);
-    else print_error("DEBUG: Could not parse the PAC file: %s\n", pacfile);
+  pac_cache_entry *evicted = NULL;
+  pac_mutex_lock(&pac_cache_lock);
+  if (pac_cache_max_entries > 0 && memory <= pac_cache_max_bytes) {
+    // Drop any older version of the same file.
+    for (pac_cache_entry **pc = &pac_cache; *pc; pc = &(*pc)->next) {
+      if (strcmp((*pc)->path, path) == 0) {
+        evicted = *pc;
+        *pc = evicted->next;
+        evicted->next = NULL;
+        break;
+      }
+    }
+    pac_cache_entry *trimmed = pac_cache_trim_locked(1, memory);
+    if (evicted) evicted->next = trimmed;
+    else evicted = trimmed;
+    c->next = pac_cache;
+    pac_cache = c;
+    c = NULL;
   }
+  pac_mutex_unlock(&pac_cache_lock);
+  pac_cache_free_list(evicted);
+  if (c) pac_cache_entry_free(c);
+}
 
-  return result;
+// Frees all cached engines.
+void
+pacparser_clear_pac_cache(void)
+{
+  pac_mutex_lock(&pac_cache_lock);
+  pac_cache_entry *evicted = pac_cache;
+  pac_cache = NULL;
+  pac_mutex_unlock(&pac_cache_lock);
+  pac_cache_free_list(evicted);
 }
 
-// Parses PAC file (same as pacparser_parse_pac_file)
-//
-// (Deprecated) Use pacparser_parse_pac_file instead.
-int                                     // 0 (=Failure) or 1 (=Success)
-pacparser_parse_pac(const char *pacfile)
+// Sets the limits of the parsed PAC file cache used by
+// pacparser_just_find_proxy. max_entries 0 disables the cache.
+void
+pacparser_set_pac_cache_limits(int max_entries, size_t max_bytes)
 {
-  return pacparser_parse_pac_file(pacfile);
+  pac_mutex_lock(&pac_cache_lock);
+  pac_cache_max_entries = max_entries < 0 ? 0 : max_entries;
+  pac_cache_max_bytes = max_bytes;
+  pac_cache_entry *evicted = pac_cache_trim_locked(0, 0);
+  pac_mutex_unlock(&pac_cache_lock);
+  pac_cache_free_list(evicted);
 }
 
-// Finds proxy for the given URL and Host.
+// Memory controls.
 //
-// If JavaScript engine is intialized and findProxyForURL function is defined,
-// it evaluates code findProxyForURL(url,host) in JavaScript context and
-// returns the result.
-char *                                  // Proxy string or NULL if failed.
-pacparser_find_proxy(const char *url, const char *host)
+// Settings apply to the current engine, to the engines in the parsed PAC file
+// cache and to engines and registries created afterwards (see
+// runtime_set_limits). Registries that already exist keep their settings.
+// pacparser_gc also collects the engines in the parsed PAC file cache.
+
+// Calls set(rt, bytes) on the runtimes of the current engine and of the
+// engines in the parsed PAC file cache.
+static void
+engines_apply(void (*set)(JSRuntime *rt, size_t bytes), size_t bytes)
 {
-  char *error_prefix = "pacparser.c: pacparser_find_proxy:";
-  if (_debug()) print_error("DEBUG: Finding proxy for URL: %s and Host:"
-                        " %s\n", url, host);
-  if (url == NULL || (strcmp(url, "") == 0)) {
-    print_error("%s %s\n", error_prefix, "URL not defined");
-    return NULL;
-  }
-  if (host == NULL || (strcmp(host,"") == 0)) {
-    print_error("%s %s\n", error_prefix, "Host not defined");
-    return NULL;
+  pac_engine *e = engine_acquire();
+  if (e) {
+    engine_lock_for_use(e);
+    set(e->rt, bytes);
+    pac_mutex_unlock(&e->lock);
+    engine_release(e);
   }
-  if (ctx == NULL) {
-    print_error("%s %s\n", error_prefix, "Pac parser is not initialized.");
-    return NULL;
+  // Engines are only ever locked after pac_cache_lock, never the other way
+  // round, so it's safe to hold it here.
+  pac_mutex_lock(&pac_cache_lock);
+  for (pac_cache_entry *c = pac_cache; c; c = c->next) {
+    engine_lock_for_use(c->engine);
+    set(c->engine->rt, bytes);
+    pac_mutex_unlock(&c->engine->lock);
   }
+  pac_mutex_unlock(&pac_cache_lock);
+}
 
-  // Free previous result if any
-  if (proxy_result) {
-    JS_FreeCString(ctx, proxy_result);
-    proxy_result = NULL;
-  }
+static void
+runtime_set_gc_threshold(JSRuntime *rt, size_t bytes)
+{
+  JS_SetGCThreshold(rt, bytes ? bytes : GC_DEFAULT_THRESHOLD);
+}
 
-  // Test if findProxyForURL is defined.
-  const char *script = "typeof(findProxyForURL);";
-  if (_debug()) print_error("DEBUG: Executing JavaScript: %s\n", script);
-  JSValue check = JS_Eval(ctx, script, strlen(script), NULL, JS_EVAL_TYPE_GLOBAL);
-  const char *type_str = JS_ToCString(ctx, check);
-  int is_function = type_str && strcmp("function", type_str) == 0;
-  JS_FreeCString(ctx, type_str);
-  JS_FreeValue(ctx, check);
-  if (!is_function) {
-    print_error("%s %s\n", error_prefix,
-		  "Javascript function findProxyForURL not defined.");
-    return NULL;
-  }
+static void
+runtime_set_max_stack_size(JSRuntime *rt, size_t bytes)
+{
+  JS_SetMaxStackSize(rt, bytes ? bytes : JS_DEFAULT_STACK_SIZE);
+}
 
-  // Get function and call it
-  JSValue func = JS_GetPropertyStr(ctx, global, "findProxyForURL");
-  JSValue args[2] = { JS_NewString(ctx, url), JS_NewString(ctx, host) };
-  JSValue rval = JS_Call(ctx, func, global, 2, args);
+// Sets the memory limit of engines' runtimes. 0 means no limit.
+void
+pacparser_set_memory_limit(size_t bytes)
+{
+  pac_mutex_lock(&engine_lock);
+  memory_limit = bytes;
+  pac_mutex_unlock(&engine_lock);
+  engines_apply(JS_SetMemoryLimit, bytes);
+}
 
-  JS_FreeValue(ctx, args[0]);
-  JS_FreeValue(ctx, args[1]);
-  JS_FreeValue(ctx, func);
+// Sets the allocated size at which engines' runtimes next collect garbage.
+// 0 restores QuickJS's default.
+void
+pacparser_set_gc_threshold(size_t bytes)
+{
+  pac_mutex_lock(&engine_lock);
+  gc_threshold = bytes;
+  pac_mutex_unlock(&engine_lock);
+  engines_apply(runtime_set_gc_threshold, bytes);
+}
 
-  if (JS_IsException(rval)) {
-    dump_js_exception(ctx);
-    print_error("%s %s\n", error_prefix, "Problem in executing findProxyForURL.");
-    JS_FreeValue(ctx, rval);
-    return NULL;
-  }
+// Sets the maximum JavaScript stack size of engines' runtimes. 0 restores
+// QuickJS's default.
+void
+pacparser_set_max_stack_size(size_t bytes)
+{
+  pac_mutex_lock(&engine_lock);
+  max_stack_size = bytes;
+  pac_mutex_unlock(&engine_lock);
+  engines_apply(runtime_set_max_stack_size, bytes);
+}
 
-  proxy_result = JS_ToCString(ctx, rval);
-  JS_FreeValue(ctx, rval);
-  return (char *)proxy_result;  // valid until next call or cleanup
+static void
+engine_gc(pac_engine *e)
+{
+  engine_lock_for_use(e);
+  JS_RunGC(e->rt);
+  pac_mutex_unlock(&e->lock);
 }
 
-// Destroys JavaScript Engine.
+// Runs the garbage collector on the current engine and on cached engines.
 void
-pacparser_cleanup()
+pacparser_gc(void)
 {
-  // Re-initialize config variables.
-  my_ip_set = 0;
+  pac_engine *e = engine_acquire();
+  if (e) {
+    engine_gc(e);
+    engine_release(e);
+  }
+  // Engines are only ever locked after pac_cache_lock, never the other way
+  // round, so it's safe to hold it here.
+  pac_mutex_lock(&pac_cache_lock);
+  for (pac_cache_entry *c = pac_cache; c; c = c->next) engine_gc(c->engine);
+  pac_mutex_unlock(&pac_cache_lock);
+}
 
-  if (proxy_result && ctx) {
-    JS_FreeCString(ctx, proxy_result);
-    proxy_result = NULL;
+// Fills in the memory usage of the current engine. Cached engines and
+// registries are not included.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_memory_usage(pacparser_memory_stats *usage)
+{
+  if (usage == NULL) return 0;
+  pac_engine *e = engine_acquire();
+  if (e == NULL) {
+    print_error("%s %s\n", "pacparser.c: pacparser_memory_usage:",
+                "Pac parser is not initialized.");
+    return 0;
   }
-  if (ctx) {
-    JS_FreeValue(ctx, global);
-    global = JS_UNDEFINED;
-    JS_FreeContext(ctx);
-    ctx = NULL;
+  JSMemoryUsage u;
+  engine_lock_for_use(e);
+  JS_ComputeMemoryUsage(e->rt, &u);
+  size_t threshold = JS_GetGCThreshold(e->rt);
+  pac_mutex_unlock(&e->lock);
+  engine_release(e);
+
+  memset(usage, 0, sizeof(*usage));
+  usage->malloc_size = u.malloc_size;
+  usage->malloc_count = u.malloc_count;
+  usage->malloc_limit = u.malloc_limit;
+  usage->gc_threshold = threshold;
+  usage->memory_used_size = u.memory_used_size;
+  usage->atom_count = u.atom_count;
+  usage->atom_size = u.atom_size;
+  usage->str_count = u.str_count;
+  usage->str_size = u.str_size;
+  usage->obj_count = u.obj_count;
+  usage->obj_size = u.obj_size + u.prop_size + u.shape_size;
+  usage->js_func_count = u.js_func_count;
+  usage->js_func_size = u.js_func_size + u.js_func_pc2line_size;
+  usage->js_func_code_size = u.js_func_code_size;
+  return 1;
+}
+
+// Fills in rules with the coverage of the PAC script in the current engine.
+int                                     // Number of rules in the script.
+pacparser_get_coverage(pacparser_rule_coverage *rules, int max)
+{
+  pac_engine *e = engine_acquire();
+  if (e == NULL) return 0;
+  pac_mutex_lock(&e->lock);
+  int count = coverage_get(&e->coverage, rules, max);
+  pac_mutex_unlock(&e->lock);
+  engine_release(e);
+  return count;
+}
+
+// Implements pacparser_just_find_proxy when pacparser is not initialized.
+//
+// Rather than initializing and tearing down the global state, this uses a
+// private engine, which is cheaper (no DNS prefetching to stop, DNS cache is
+// kept) and can run concurrently with other calls. Engines are kept in the
+// parsed PAC file cache above, so repeated calls for the same file don't
+// parse it again.
+static char *                           // Proxy string or NULL if failed.
+just_find_proxy_private(const char *pacfile, const char *url, const char *host,
+                        const char *error_prefix)
+{
+  if (!valid_lookup_args(url, host, error_prefix)) return NULL;
+  file_version version;
+  get_file_version(pacfile, &version);
+  pac_engine *e = version.exists ? pac_cache_get(pacfile, &version) : NULL;
+  if (e && isolated_lookups) {
+    // Parsed before isolated lookups were enabled: parse it again.
+    pac_mutex_lock(&e->lock);
+    int has_snapshot = e->snapshot != NULL;
+    pac_mutex_unlock(&e->lock);
+    if (!has_snapshot) {
+      engine_release(e);
+      e = NULL;
+    }
+  }
+  if (e == NULL) {
+    if (!(e = engine_new())) {
+      print_error("%s %s\n", error_prefix, "Could not initialize pacparser");
+      return NULL;
+    }
+    pac_file_buf script;
+    if (!load_pac_file(pacfile, &script)) {
+      print_error("pacparser.c: pacparser_parse_pac: %s: %s: %s\n",
+              "Could not read the pacfile: ", pacfile, strerror(errno));
+      print_error("%s %s %s\n", error_prefix, "Could not parse pacfile",
+		    pacfile);
+      engine_release(e);
+      return NULL;
+    }
+    int unchanged = 0;
+    int parsed = engine_eval_pac(e, script.data, script.len, &unchanged);
+    unload_pac_file(&script);
+    if (!parsed) {
+      print_error("%s %s %s\n", error_prefix, "Could not parse pacfile",
+		    pacfile);
+      engine_release(e);
+      return NULL;
+    }
+    count_parse(1);
+    if (version.exists) pac_cache_put(pacfile, &version, e);
+  } else {
+    count_parse(0);
   }
-  if (rt) {
-    JS_FreeRuntime(rt);
-    rt = NULL;
+
+  trace_begin();
+  engine_lock_for_use(e);
+  char *proxy = engine_lookup(e, url, host, error_prefix);
+  pac_mutex_unlock(&e->lock);
+  engine_release(e);
+  trace_end(url, host, proxy);
+  if (proxy == NULL) {
+    print_error("%s %s %s\n", error_prefix,
+		  "Could not determine proxy for url", url);
   }
-  if (_debug()) print_error("DEBUG: Pacparser destroyed.\n");
+  return proxy;
 }
 
 // Finds proxy for the given PAC file, url and host.
@@ -531,7 +3907,8 @@ pacparser_cleanup()
 // This function is a wrapper around functions pacparser_init,
 // pacparser_parse_pac, pacparser_find_proxy and pacparser_cleanup. If you just
 // want to find out proxy a given set of pac file, url and host, this is the
-// function to call.
+// function to call. If pacparser is not initialized, a private engine is used
+// (see just_find_proxy_private).
 char *                                  // Proxy string or NULL if failed.
 pacparser_just_find_proxy(const char *pacfile,
                          const char *url,
@@ -539,33 +3916,496 @@ pacparser_just_find_proxy(const char *pacfile,
 {
   char *proxy;
   char *out;
-  int initialized_here = 0;
   char *error_prefix = "pacparser.c: pacparser_just_find_proxy:";
-  if (!ctx) {
-    if (!pacparser_init()) {
-      print_error("%s %s\n", error_prefix, "Could not initialize pacparser");
-      return NULL;
-    }
-    initialized_here = 1;
-  }
-  if (!pacparser_parse_pac(pacfile)) {
+  timed_out = 0;
+  pac_engine *e = engine_acquire();
+  engine_release(e);
+  if (!e) return just_find_proxy_private(pacfile, url, host, error_prefix);
+
+  if (!parse_pac_file(pacfile, dns_prefetch_enabled)) {
     print_error("%s %s %s\n", error_prefix, "Could not parse pacfile",
 		  pacfile);
-    if (initialized_here) pacparser_cleanup();
     return NULL;
   }
   if (!(out = pacparser_find_proxy(url, host))) {
     print_error("%s %s %s\n", error_prefix,
 		  "Could not determine proxy for url", url);
-    if (initialized_here) pacparser_cleanup();
     return NULL;
   }
   proxy = (char*) malloc(strlen(out) + 1);
   strcpy(proxy, out);
-  if (initialized_here) pacparser_cleanup();
   return proxy;
 }
 
+// Multi-PAC registry.
+//
+// Holds many PAC scripts, keyed by string IDs, in contexts that share a
+// single JSRuntime (atoms, shapes and the class table are per runtime) and,
+// like every context, use the process-wide compiled pac_utils. QuickJS binds
+// compiled functions to the context they were loaded into, so each context
+// still instantiates its own function objects from that bytecode; only the
+// compilation is shared.
+//
+// A runtime is single-threaded, so registry calls are serialized by the
+// registry's lock, held for the whole of each evaluation: a PAC script blocked
+// in dnsResolve is still on the runtime's stack, so other scripts can't run
+// meanwhile. Each PAC script is also kept as bytecode, which lets idle
+// contexts be evicted and cheaply re-instantiated on their next lookup.
+#define REGISTRY_MIN_BUCKETS 64
+#define REGISTRY_ALLOC_HEADER 16        // Keeps malloc's alignment.
+
+typedef struct registry_entry {
+  char *id;
+  JSContext *ctx;                 // NULL while evicted.
+  JSValue global;
+  uint8_t *bytecode;              // Compiled PAC script.
+  size_t bytecode_len;
+  size_t ctx_memory;              // Runtime memory taken by ctx when loaded.
+  coverage_table coverage;        // Of the PAC script.
+  int64_t last_used_us;
+  struct registry_entry *next;
+} registry_entry;
+
+struct pacparser_registry {
+  pac_mutex_t lock;
+  JSRuntime *rt;
+  eval_deadline deadline;         // Of the evaluation in progress.
+  size_t memory;                  // Bytes allocated by rt.
+  int use_custom;                 // Allocate through custom_allocator.
+  pacparser_allocator allocator;  // Copy of custom_allocator if set.
+  int profile;                    // PACPARSER_PROFILE_* of new contexts.
+  registry_entry **buckets;
+  size_t num_buckets;
+  size_t count;
+};
+
+// Allocator for the registry's runtime that keeps track of the total number
+// of bytes allocated, used to attribute memory to registry entries. The
+// allocation size is stored in a header in front of each block. Blocks come
+// from the custom allocator if one was set when the registry was created.
+static void *
+registry_malloc(void *opaque, size_t size)
+{
+  pacparser_registry *reg = opaque;
+  char *p = reg->use_custom ?
+      reg->allocator.malloc_fn(reg->allocator.opaque,
+                               size + REGISTRY_ALLOC_HEADER) :
+      malloc(size + REGISTRY_ALLOC_HEADER);
+  if (p == NULL) return NULL;
+  *(size_t *)p = size;
+  reg->memory += size;
+  return p + REGISTRY_ALLOC_HEADER;
+}
+
+static void *
+registry_calloc(void *opaque, size_t count, size_t size)
+{
+  if (size && count > SIZE_MAX / size) return NULL;
+  void *p = registry_malloc(opaque, count * size);
+  if (p) memset(p, 0, count * size);
+  return p;
+}
+
+static void
+registry_free(void *opaque, void *ptr)
+{
+  if (ptr == NULL) return;
+  pacparser_registry *reg = opaque;
+  char *p = (char *)ptr - REGISTRY_ALLOC_HEADER;
+  reg->memory -= *(size_t *)p;
+  if (reg->use_custom) reg->allocator.free_fn(reg->allocator.opaque, p);
+  else free(p);
+}
+
+static void *
+registry_realloc(void *opaque, void *ptr, size_t size)
+{
+  pacparser_registry *reg = opaque;
+  if (ptr == NULL) return registry_malloc(opaque, size);
+  if (size == 0) {
+    registry_free(opaque, ptr);
+    return NULL;
+  }
+  char *p = (char *)ptr - REGISTRY_ALLOC_HEADER;
+  size_t old_size = *(size_t *)p;
+  char *q = reg->use_custom ?
+      reg->allocator.realloc_fn(reg->allocator.opaque, p,
+                                size + REGISTRY_ALLOC_HEADER) :
+      realloc(p, size + REGISTRY_ALLOC_HEADER);
+  if (q == NULL) return NULL;
+  *(size_t *)q = size;
+  reg->memory = reg->memory - old_size + size;
+  return q + REGISTRY_ALLOC_HEADER;
+}
+
+static size_t
+registry_usable_size(const void *ptr)
+{
+  return *(const size_t *)((const char *)ptr - REGISTRY_ALLOC_HEADER);
+}
+
+static const JSMallocFunctions registry_malloc_functions = {
+  registry_calloc, registry_malloc, registry_free, registry_realloc,
+  registry_usable_size,
+};
+
+static unsigned int
+registry_hash(const char *id)
+{
+  unsigned int h = 5381;
+  for (const unsigned char *p = (const unsigned char *)id; *p; p++)
+    h = h * 33 + *p;
+  return h;
+}
+
+static registry_entry **
+registry_find(pacparser_registry *reg, const char *id)
+{
+  registry_entry **pe = &reg->buckets[registry_hash(id) % reg->num_buckets];
+  while (*pe && strcmp((*pe)->id, id) != 0) pe = &(*pe)->next;
+  return pe;
+}
+
+static void
+registry_grow(pacparser_registry *reg)
+{
+  size_t num_buckets = reg->num_buckets * 2;
+  registry_entry **buckets = calloc(num_buckets, sizeof(registry_entry *));
+  if (buckets == NULL) return;          // Keep going with longer chains.
+  for (size_t i = 0; i < reg->num_buckets; i++) {
+    registry_entry *e = reg->buckets[i];
+    while (e) {
+      registry_entry *next = e->next;
+      size_t b = registry_hash(e->id) % num_buckets;
+      e->next = buckets[b];
+      buckets[b] = e;
+      e = next;
+    }
+  }
+  free(reg->buckets);
+  reg->buckets = buckets;
+  reg->num_buckets = num_buckets;
+}
+
+// Frees the entry's context, keeping its bytecode. Caller must hold the
+// registry lock.
+static void
+registry_entry_unload(pacparser_registry *reg, registry_entry *e)
+{
+  if (e->ctx == NULL) return;
+  JS_FreeValue(e->ctx, e->global);
+  JS_FreeContext(e->ctx);
+  e->ctx = NULL;
+  e->global = JS_UNDEFINED;
+  e->ctx_memory = 0;
+  (void)reg;
+}
+
+static void
+registry_entry_free(pacparser_registry *reg, registry_entry *e)
+{
+  registry_entry_unload(reg, e);
+  free(e->bytecode);
+  free(e->coverage.rules);
+  free(e->id);
+  free(e);
+}
+
+// Creates the entry's context from its bytecode. Caller must hold the
+// registry lock.
+static int                              // 0 (=Failure) or 1 (=Success)
+registry_entry_instantiate(pacparser_registry *reg, registry_entry *e,
+                           const char *error_prefix)
+{
+  size_t memory_before = reg->memory;
+  JSContext *ctx = new_pac_context(reg->rt, reg->profile);
+  if (ctx == NULL) {
+    print_error("%s %s\n", error_prefix, "Could not create JavaScript context.");
+    return 0;
+  }
+  if (!context_add_builtins(ctx, error_prefix)) {
+    JS_FreeContext(ctx);
+    return 0;
+  }
+  deadline_start(&reg->deadline, ctx);
+  JSValue result = eval_bytecode(ctx, e->bytecode, e->bytecode_len);
+  deadline_stop(&reg->deadline, error_prefix);
+  if (JS_IsException(result)) {
+    dump_js_exception(ctx);
+    print_error("%s %s %s\n", error_prefix,
+                "Failed to evaluate the pac script for", e->id);
+    JS_FreeContext(ctx);
+    return 0;
+  }
+  JS_FreeValue(ctx, result);
+  e->ctx = ctx;
+  e->global = JS_GetGlobalObject(ctx);
+  e->ctx_memory = reg->memory - memory_before;
+  return 1;
+}
+
+// Creates a new, empty registry.
+pacparser_registry *
+pacparser_registry_new(void)
+{
+  char *error_prefix = "pacparser.c: pacparser_registry_new:";
+  pacparser_registry *reg = calloc(1, sizeof(pacparser_registry));
+  if (reg == NULL ||
+      (reg->buckets = calloc(REGISTRY_MIN_BUCKETS,
+                             sizeof(registry_entry *))) == NULL) {
+    free(reg);
+    print_error("%s %s\n", error_prefix, "Out of memory.");
+    return NULL;
+  }
+  reg->num_buckets = REGISTRY_MIN_BUCKETS;
+  pac_mutex_init(&reg->lock);
+  pac_mutex_lock(&engine_lock);
+  reg->use_custom = custom_allocator_set;
+  reg->allocator = custom_allocator;
+  pac_mutex_unlock(&engine_lock);
+  if (!(reg->rt = JS_NewRuntime2(&registry_malloc_functions, reg))) {
+    print_error("%s %s\n", error_prefix, "Could not create JavaScript runtime.");
+    pacparser_registry_free(reg);
+    return NULL;
+  }
+  runtime_set_limits(reg->rt, &reg->deadline);
+  return reg;
+}
+
+// Sets the profile of contexts created afterwards in the registry.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_registry_set_profile(pacparser_registry *reg, int profile)
+{
+  if (reg == NULL || (profile != PACPARSER_PROFILE_FULL &&
+                      profile != PACPARSER_PROFILE_MINIMAL)) {
+    print_error("%s %s\n", "pacparser.c: pacparser_registry_set_profile:",
+                "Invalid arguments.");
+    return 0;
+  }
+  pac_mutex_lock(&reg->lock);
+  reg->profile = profile;
+  pac_mutex_unlock(&reg->lock);
+  return 1;
+}
+
+// Frees the registry and all the PAC scripts in it.
+void
+pacparser_registry_free(pacparser_registry *reg)
+{
+  if (reg == NULL) return;
+  for (size_t i = 0; i < reg->num_buckets; i++) {
+    registry_entry *e = reg->buckets[i];
+    while (e) {
+      registry_entry *next = e->next;
+      registry_entry_free(reg, e);
+      e = next;
+    }
+  }
+  if (reg->rt) JS_FreeRuntime(reg->rt);
+  free(reg->buckets);
+  pac_mutex_destroy(&reg->lock);
+  free(reg);
+}
+
+// Adds a PAC script under the given ID, or replaces the one already there.
+static int                              // 0 (=Failure) or 1 (=Success)
+registry_load_buffer(pacparser_registry *reg, const char *id,
+                     const char *script, size_t len)
+{
+  char *error_prefix = "pacparser.c: pacparser_registry_load:";
+  timed_out = 0;
+  if (reg == NULL || id == NULL || script == NULL) {
+    print_error("%s %s\n", error_prefix, "Invalid arguments.");
+    return 0;
+  }
+  registry_entry *e = calloc(1, sizeof(registry_entry));
+  if (e == NULL || (e->id = strdup(id)) == NULL) {
+    free(e);
+    print_error("%s %s\n", error_prefix, "Out of memory.");
+    return 0;
+  }
+  e->global = JS_UNDEFINED;
+
+  char *instrumented = NULL;
+  if (coverage_enabled &&
+      (instrumented = coverage_instrument(script, len, &len, &e->coverage))) {
+    script = instrumented;
+  }
+
+  pac_mutex_lock(&reg->lock);
+  JS_UpdateStackTop(reg->rt);
+  int64_t start_us = pac_now_us();
+  JSContext *ctx = new_pac_context(reg->rt, reg->profile);
+  if (ctx) {
+    e->bytecode = compile_to_bytecode(ctx, script, len, "PAC script",
+                                      &e->bytecode_len);
+    JS_FreeContext(ctx);
+  }
+  free(instrumented);
+  int loaded = e->bytecode && registry_entry_instantiate(reg, e, error_prefix);
+  record_latency(LATENCY_PARSE, start_us);
+  if (!loaded) {
+    pac_mutex_unlock(&reg->lock);
+    print_error("%s %s %s\n", error_prefix, "Could not load PAC script for",
+                id);
+    registry_entry_free(reg, e);
+    return 0;
+  }
+  e->last_used_us = pac_now_us();
+
+  registry_entry **pe = registry_find(reg, id);
+  if (*pe) {
+    e->next = (*pe)->next;
+    registry_entry_free(reg, *pe);
+    *pe = e;
+    JS_RunGC(reg->rt);            // See pacparser_registry_unload.
+  } else {
+    *pe = e;
+    if (++reg->count > reg->num_buckets * 2) registry_grow(reg);
+  }
+  pac_mutex_unlock(&reg->lock);
+  return 1;
+}
+
+// Adds the PAC script string under the given ID.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_registry_load_string(pacparser_registry *reg, const char *id,
+                               const char *script)
+{
+  return registry_load_buffer(reg, id, script, script ? strlen(script) : 0);
+}
+
+// Adds the PAC file under the given ID.
+int                                     // 0 (=Failure) or 1 (=Success)
+pacparser_registry_load_file(pacparser_registry *reg, const char *id,
+                             const char *pacfile)
+{
+  pac_file_buf script;
+
+  if (!load_pac_file(pacfile, &script)) {
+    print_error("pacparser.c: pacparser_registry_load_file: %s: %s: %s\n",
+            "Could not read the pacfile: ", pacfile, strerror(errno));
+    return 0;
+  }
+  int result = registry_load_buffer(reg, id, script.data, script.len);
+  unload_pac_file(&script);
+  return result;
+}
+
+// Removes the PAC script with the given ID.
+int                                     // 0 (=Not found) or 1 (=Removed)
+pacparser_registry_unload(pacparser_registry *reg, const char *id)
+{
+  if (reg == NULL || id == NULL) return 0;
+  pac_mutex_lock(&reg->lock);
+  JS_UpdateStackTop(reg->rt);
+  registry_entry **pe = registry_find(reg, id);
+  registry_entry *e = *pe;
+  if (e) {
+    *pe = e->next;
+    registry_entry_free(reg, e);
+    reg->count--;
+    // Contexts are reference counted but may be kept alive by cycles.
+    JS_RunGC(reg->rt);
+  }
+  pac_mutex_unlock(&reg->lock);
+  return e != NULL;
+}
+
+// Finds proxy for the given URL and host using the PAC script with the given
+// ID, re-instantiating it first if it was evicted.
+char *                                  // Proxy string or NULL if failed.
+pacparser_registry_find_proxy(pacparser_registry *reg, const char *id,
+                              const char *url, const char *host)
+{
+  char *error_prefix = "pacparser.c: pacparser_registry_find_proxy:";
+  if (!valid_lookup_args(url, host, error_prefix)) return NULL;
+  if (reg == NULL || id == NULL) {
+    print_error("%s %s\n", error_prefix, "Invalid arguments.");
+    return NULL;
+  }
+  char *proxy = NULL;
+  timed_out = 0;
+  trace_begin();
+  pac_mutex_lock(&reg->lock);
+  JS_UpdateStackTop(reg->rt);
+  registry_entry *e = *registry_find(reg, id);
+  if (e == NULL) {
+    print_error("%s %s %s\n", error_prefix, "No PAC script loaded for", id);
+  } else if (e->ctx || registry_entry_instantiate(reg, e, error_prefix)) {
+    int64_t start_us = e->last_used_us = pac_now_us();
+    lookup_builtins_reset();
+    coverage_lookup_begin();
+    deadline_start(&reg->deadline, e->ctx);
+    proxy = context_find_proxy(e->ctx, e->global, url, host, error_prefix);
+    proxy = deadline_lookup_result(&reg->deadline, proxy, error_prefix);
+    coverage_lookup_end(&e->coverage, proxy);
+    record_latency(LATENCY_FIND_PROXY, start_us);
+  }
+  pac_mutex_unlock(&reg->lock);
+  trace_end(url, host, proxy);
+  return proxy;
+}
+
+// Evicts the contexts of PAC scripts not used for idle_seconds.
+int                                     // Number of contexts evicted.
+pacparser_registry_evict_idle(pacparser_registry *reg, int idle_seconds)
+{
+  if (reg == NULL) return 0;
+  int evicted = 0;
+  int64_t cutoff = pac_now_us() - (int64_t)idle_seconds * 1000000;
+  pac_mutex_lock(&reg->lock);
+  JS_UpdateStackTop(reg->rt);
+  for (size_t i = 0; i < reg->num_buckets; i++) {
+    for (registry_entry *e = reg->buckets[i]; e; e = e->next) {
+      if (e->ctx && e->last_used_us <= cutoff) {
+        registry_entry_unload(reg, e);
+        evicted++;
+      }
+    }
+  }
+  // Contexts are reference counted but may be kept alive by cycles.
+  if (evicted) JS_RunGC(reg->rt);
+  pac_mutex_unlock(&reg->lock);
+  return evicted;
+}
+
+// Returns memory used by the PAC script with the given ID, or by the whole
+// registry if id is NULL.
+long                                    // Bytes, or -1 if id is not found.
+pacparser_registry_memory_usage(pacparser_registry *reg, const char *id)
+{
+  if (reg == NULL) return -1;
+  long memory = -1;
+  pac_mutex_lock(&reg->lock);
+  if (id == NULL) {
+    memory = (long)reg->memory;
+    for (size_t i = 0; i < reg->num_buckets; i++) {
+      for (registry_entry *e = reg->buckets[i]; e; e = e->next)
+        memory += (long)e->bytecode_len;
+    }
+  } else {
+    registry_entry *e = *registry_find(reg, id);
+    if (e) memory = (long)(e->ctx_memory + e->bytecode_len);
+  }
+  pac_mutex_unlock(&reg->lock);
+  return memory;
+}
+
+// Fills in rules with the coverage of the PAC script with the given ID.
+int                                     // Number of rules in the script.
+pacparser_registry_get_coverage(pacparser_registry *reg, const char *id,
+                                pacparser_rule_coverage *rules, int max)
+{
+  if (reg == NULL || id == NULL) return 0;
+  int count = 0;
+  pac_mutex_lock(&reg->lock);
+  registry_entry *e = *registry_find(reg, id);
+  if (e) count = coverage_get(&e->coverage, rules, max);
+  pac_mutex_unlock(&reg->lock);
+  return count;
+}
+
 #define QUOTEME_(x) #x
 #define QUOTEME(x) QUOTEME_(x)
 
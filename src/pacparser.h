@@ -22,6 +22,7 @@
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 
 #include <stdarg.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -46,7 +47,12 @@ int pacparser_init(void);
 /// @returns 0 on failure and 1 on success.
 ///
 /// Reads the given PAC file and evaluates it in the JavaScript context created
-/// by pacparser_init.
+/// by pacparser_init. If the file's content is identical to the last script
+/// successfully parsed in this context, it is not evaluated again.
+///
+/// Regular files are memory-mapped instead of read. Truncating the file while
+/// it's parsed kills the process with SIGBUS, so replace PAC files with
+/// rename() rather than rewriting them in place.
 int pacparser_parse_pac_file(const char *pacfile       // PAC file to parse
                              );
 
@@ -55,7 +61,8 @@ int pacparser_parse_pac_file(const char *pacfile       // PAC file to parse
 /// @returns 0 on failure and 1 on success.
 ///
 /// Evaluates the given PAC script string in the JavaScript context created
-/// by pacparser_init.
+/// by pacparser_init. If the script is identical to the last script
+/// successfully parsed in this context, it is not evaluated again.
 int pacparser_parse_pac_string(const char *pacstring      // PAC string to parse
                                );
 
@@ -68,6 +75,44 @@ int pacparser_parse_pac_string(const char *pacstring      // PAC string to parse
 int pacparser_parse_pac(const char *pacfile               // PAC file to parse
                         );
 
+/// @brief Replaces the current PAC script with the given PAC file.
+/// @param pacfile PAC file to load.
+/// @returns 0 on failure and 1 on success.
+///
+/// Parses the PAC file into a fresh JavaScript engine and, if that succeeds,
+/// atomically makes it the current engine. Lookups (pacparser_find_proxy) on
+/// other threads are not blocked while the new engine is being built: the ones
+/// already in progress finish on the old engine, new ones use the new engine,
+/// and the old engine is freed once the last of its lookups is done. On
+/// failure, the current engine is left untouched. If the PAC script is
+/// identical to the one the current engine runs, nothing is reloaded.
+/// pacparser_init must have been called before.
+int pacparser_reload_pac_file(const char *pacfile     // PAC file to load
+                              );
+
+/// @brief Replaces the current PAC script with the given PAC string.
+/// @param pacstring PAC script to load.
+/// @returns 0 on failure and 1 on success.
+///
+/// Same as pacparser_reload_pac_file, but takes the PAC script as a string.
+int pacparser_reload_pac_string(const char *pacstring // PAC script to load
+                                );
+
+/// @brief Reloads the given PAC file whenever it changes.
+/// @param pacfile PAC file to watch.
+/// @returns 0 on failure and 1 on success.
+///
+/// Starts a background thread that calls pacparser_reload_pac_file whenever
+/// the PAC file is written or replaced. Uses inotify on Linux and polls the
+/// file's size and modification time every second elsewhere. Only one file is
+/// watched at a time; calling this again replaces the watched file. The
+/// watcher is stopped by pacparser_unwatch_pac_file and pacparser_cleanup.
+int pacparser_watch_pac_file(const char *pacfile      // PAC file to watch
+                             );
+
+/// @brief Stops watching the PAC file.
+void pacparser_unwatch_pac_file(void);
+
 /// @brief Finds proxy for the given URL and Host.
 /// @param url URL to find proxy for.
 /// @param host Host part of the URL.
@@ -76,7 +121,9 @@ int pacparser_parse_pac(const char *pacfile               // PAC file to parse
 /// Finds proxy for the given URL and Host. This function should be called only
 /// after pacparser engine has been initialized (using pacparser_init) and pac
 /// script has been parsed (using pacparser_parse_pac_file or
-/// pacparser_parse_pac_string).
+/// pacparser_parse_pac_string). The returned string is owned by pacparser and
+/// stays valid until the next call to this function on the same thread, or
+/// pacparser_cleanup.
 char *pacparser_find_proxy(const char *url,           // URL to find proxy for
                            const char *host           // Host part of the URL
                            );
@@ -92,6 +139,11 @@ char *pacparser_find_proxy(const char *url,           // URL to find proxy for
 /// you just want to find out proxy for a given set of pac file, url and host, this
 /// is the function to call. This function takes care of all the initialization
 /// and cleanup.
+///
+/// If pacparser is not initialized, the PAC file is evaluated in a private
+/// engine, leaving the global state (DNS cache, client IP set with
+/// pacparser_setmyip) untouched. Private engines are cached, see
+/// pacparser_set_pac_cache_limits.
 char *pacparser_just_find_proxy(const char *pacfile,       // PAC file
 				const char *url,           // URL to find proxy for
 				const char *host           // Host part of the URL
@@ -103,7 +155,7 @@ char *pacparser_just_find_proxy(const char *pacfile,       // PAC file
 void pacparser_cleanup(void);
 
 /// @brief Sets my IP address.
-/// @param ip Custom IP address.
+/// @param ip Custom IP address, or NULL to use this host's address again.
 /// @returns 1 on success and 0 on error.
 ///
 /// Sets my IP address to a custom value. This is the IP address returned by
@@ -111,6 +163,309 @@ void pacparser_cleanup(void);
 int pacparser_setmyip(const char *ip                 // Custom IP address.
                        );
 
+/// @brief Sets DNS cache lifetime.
+/// @param seconds Lifetime of cached DNS answers, 0 to disable caching.
+///
+/// dnsResolve, dnsResolveEx, myIpAddress and myIpAddressEx cache resolver
+/// answers per hostname and address family, including names that don't exist
+/// but not transient failures. The cache is disabled by default, so every
+/// call asks the resolver. The cache is flushed by pacparser_cleanup. May be
+/// called before pacparser_init().
+void pacparser_set_dns_cache_ttl(int seconds           // Cache lifetime
+                                 );
+
+/// @brief Enables or disables DNS prefetch for PAC scripts.
+/// @param enable 1 to enable, 0 to disable (default).
+///
+/// When enabled, string literals passed as hostnames to dnsResolve,
+/// dnsResolveEx, isResolvable, isResolvableEx and isInNet are collected when
+/// a PAC script is parsed and resolved on a background thread. Their DNS cache
+/// entries are pinned and refreshed in the background until the next parse or
+/// pacparser_cleanup, so lookups never wait on them. A failed refresh keeps
+/// the last good answer. Neither the next parse nor pacparser_cleanup waits
+/// for a resolution in progress. Has no effect if the DNS cache is disabled.
+void pacparser_set_dns_prefetch(int enable             // 1 or 0
+                                );
+
+/// @brief Type definition for pacparser_dns_resolver.
+/// @returns ';' separated list of the addresses, allocated with malloc (pacparser
+/// frees it), or NULL if hostname doesn't resolve.
+typedef char *(*pacparser_dns_resolver)(const char *hostname, // Name to resolve
+                                        int ip_version,   // 4 or 6
+                                        void *opaque      // As given to
+                                                          // pacparser_set_dns_resolver
+                                        );
+
+/// @brief Sets a function to resolve hostnames instead of the system resolver.
+/// @param resolver Function to call, or NULL to use the system resolver.
+/// @param opaque Passed on to resolver.
+///
+/// Every resolution dnsResolve, dnsResolveEx, myIpAddress and DNS prefetch
+/// would make through getaddrinfo goes to resolver instead, e.g. to serve
+/// names from a fixed table for reproducible tests and benchmarks. Answers
+/// are cached like the system resolver's (see pacparser_set_dns_cache_ttl).
+/// resolver may be called from several threads at once.
+///
+/// dnsResolveEx resolves IPv4 and IPv6 separately and at the same time, on
+/// the calling thread and one of up to 8 DNS worker threads. Each family's
+/// addresses keep the resolver's order. Unlike getaddrinfo with AF_UNSPEC,
+/// the two families are not interleaved. For the system resolver, the family
+/// whose first address RFC 6724 prefers comes first, judged by reachability
+/// and precedence only. For resolver, IPv6 comes first.
+void pacparser_set_dns_resolver(pacparser_dns_resolver resolver, // Or NULL
+                                void *opaque          // Passed on to resolver
+                                );
+
+/// @brief Latency summary of one kind of call.
+///
+/// Times are in microseconds. Percentiles are read off a histogram with eight
+/// buckets per power of two, so they are upper bounds accurate to within
+/// 12.5%.
+typedef struct pacparser_latency {
+  /// Number of calls timed.
+  unsigned long count;
+  /// Mean time per call.
+  unsigned long mean_us;
+  unsigned long p50_us;
+  unsigned long p90_us;
+  unsigned long p99_us;
+  unsigned long p999_us;
+  /// Slowest call.
+  unsigned long max_us;
+} pacparser_latency;
+
+/// @brief Library statistics.
+///
+/// Counters are process-wide and cumulative since the library was loaded or
+/// pacparser_reset_stats was last called. Latencies are recorded per thread
+/// without locking and merged when the stats are read.
+typedef struct pacparser_stats {
+  /// PAC parses and reloads that evaluated a new script.
+  unsigned long parses_changed;
+  /// PAC parses and reloads skipped because the script was identical to the
+  /// one parsed last.
+  unsigned long parses_unchanged;
+  /// Lookups and parses aborted because they ran past the timeout set with
+  /// pacparser_set_timeout.
+  unsigned long timeouts;
+  /// Time spent evaluating PAC scripts, excluding reading PAC files and
+  /// parses skipped because the script was unchanged.
+  pacparser_latency parse;
+  /// Time spent in FindProxyForURL, including any DNS lookups it made.
+  pacparser_latency find_proxy;
+  /// Time spent resolving hostnames not found in the DNS cache, including
+  /// prefetches.
+  pacparser_latency dns;
+} pacparser_stats;
+
+/// @brief Gets library statistics.
+/// @param stats Struct to fill in.
+/// @returns 0 on failure and 1 on success.
+int pacparser_get_stats(pacparser_stats *stats        // Stats to fill in
+                        );
+
+/// @brief Resets library statistics to zero.
+///
+/// Also resets the aggregate builtin statistics.
+void pacparser_reset_stats(void);
+
+/// @brief Call statistics of one PAC builtin function.
+typedef struct pacparser_builtin_stats {
+  /// Name of the builtin, e.g. "shExpMatch".
+  const char *name;
+  /// Number of calls.
+  unsigned long calls;
+  /// Time spent in the builtin in nanoseconds, including builtins it called.
+  unsigned long long total_ns;
+  /// Time spent in the builtin itself, excluding builtins it called (e.g.
+  /// convert_addr and dnsResolve called by isInNet).
+  unsigned long long self_ns;
+} pacparser_builtin_stats;
+
+/// @brief Enables or disables timing of PAC builtin functions.
+/// @param enable 1 to count calls to and time the builtins, 0 to stop.
+///
+/// Covers the builtins pacparser provides (dnsResolve, myIpAddress, alert
+/// and their Ex variants) and the functions defined in pac_utils.h
+/// (shExpMatch, isInNet, dateRange, ...). Builtins are wrapped when a
+/// JavaScript context is created, so this must be called before
+/// pacparser_init or before loading scripts into a registry. Timing adds two
+/// clock reads per builtin call.
+void pacparser_enable_builtin_stats(int enable        // 1 or 0
+                                    );
+
+/// @brief Gets builtin call statistics aggregated over all threads.
+/// @param stats Array to fill in.
+/// @param max Number of entries in stats.
+/// @returns Number of entries filled in, one per builtin called since the
+/// library was loaded or pacparser_reset_stats was last called.
+int pacparser_get_builtin_stats(pacparser_builtin_stats *stats, // Stats
+                                int max               // Size of stats
+                                );
+
+/// @brief Gets builtin call statistics of the last lookup on this thread.
+/// @param stats Array to fill in.
+/// @param max Number of entries in stats.
+/// @returns Number of entries filled in, one per builtin called by the last
+/// pacparser_find_proxy, pacparser_just_find_proxy or
+/// pacparser_registry_find_proxy call made by the calling thread.
+int pacparser_get_lookup_builtin_stats(pacparser_builtin_stats *stats, // Stats
+                                       int max        // Size of stats
+                                       );
+
+/// @brief A traced lookup, see pacparser_set_trace_hook.
+///
+/// All pointers are only valid during the call to the trace hook.
+typedef struct pacparser_trace {
+  const char *url;
+  const char *host;
+  /// Proxy string returned, or NULL if the lookup failed.
+  const char *result;
+  /// Wall time of the lookup call in microseconds.
+  unsigned long duration_us;
+  /// 1 if the lookup ran past the timeout set with pacparser_set_timeout.
+  int timed_out;
+  /// Distinct hostnames passed to dnsResolve and dnsResolveEx (directly or
+  /// through isResolvable, isInNet etc.), in the order first resolved.
+  const char **dns_names;
+  int num_dns_names;
+  /// Time spent resolving them in microseconds, including DNS cache hits.
+  unsigned long dns_us;
+  /// Builtins called during the lookup. Empty if the JavaScript context was
+  /// created before the hook was set.
+  const pacparser_builtin_stats *builtins;
+  int num_builtins;
+} pacparser_trace;
+
+/// @brief Type definition for pacparser_trace_hook.
+typedef void (*pacparser_trace_hook)(const pacparser_trace *trace, // Lookup
+                                     void *opaque     // As given to
+                                                      // pacparser_set_trace_hook
+                                     );
+
+/// @brief Sets a function to call after sampled lookups.
+/// @param hook Function to call, or NULL to stop tracing.
+/// @param opaque Passed on to hook.
+/// @param sample_rate Fraction of lookups to trace, from 0 to 1.
+///
+/// Each pacparser_find_proxy, pacparser_just_find_proxy and
+/// pacparser_registry_find_proxy call is traced with probability sample_rate.
+/// The hook is called on the thread that made the lookup, after the lookup,
+/// without pacparser locks held. Lookups that are not traced only pay for a
+/// random number. To report builtins, set the hook before pacparser_init (or
+/// before loading scripts into a registry).
+void pacparser_set_trace_hook(pacparser_trace_hook hook, // Hook or NULL
+                              void *opaque,           // Passed on to hook
+                              double sample_rate      // 0 to 1
+                              );
+
+/// @brief Starts sampling the JavaScript stacks of PAC evaluations.
+/// @param interval_us Minimum time between samples in microseconds.
+/// @returns 0 on failure (interval_us not positive) and 1 on success.
+///
+/// Samples parses and lookups on all threads and engines, and discards the
+/// samples of the previous profile. Stacks are sampled when QuickJS checks
+/// for interrupts, every few thousand bytecode instructions, so the actual
+/// interval can be longer. Line numbers refer to the PAC script, so profiles
+/// are most useful with one script.
+int pacparser_start_profile(int interval_us          // Sampling interval
+                            );
+
+/// @brief Stops sampling. The samples are kept until the next
+/// pacparser_start_profile.
+void pacparser_stop_profile(void);
+
+/// @brief Type definition for pacparser_profile_stack_fn.
+///
+/// stack is a folded stack as used by flamegraph tools: frames from
+/// outermost to innermost separated by ';', with PAC script functions
+/// labeled "name:line" and builtins just "name".
+typedef void (*pacparser_profile_stack_fn)(const char *stack, // Folded stack
+                                           unsigned long samples, // Count
+                                           void *opaque // See
+                                                        // pacparser_get_profile
+                                           );
+
+/// @brief Type definition for pacparser_profile_line_fn.
+///
+/// Samples of a line of the PAC script: those whose innermost PAC script
+/// frame was executing that line, including time in builtins it called.
+typedef void (*pacparser_profile_line_fn)(int line,  // 1-based line number
+                                          unsigned long samples, // Count
+                                          void *opaque // See
+                                                       // pacparser_get_profile
+                                          );
+
+/// @brief Reports the samples collected by the profiler.
+/// @param stack_fn Called once per distinct stack sampled, or NULL.
+/// @param line_fn Called once per PAC script line sampled, in line order,
+/// or NULL.
+/// @param opaque Passed on to stack_fn and line_fn.
+void pacparser_get_profile(pacparser_profile_stack_fn stack_fn, // Or NULL
+                           pacparser_profile_line_fn line_fn,   // Or NULL
+                           void *opaque       // Passed on to the callbacks
+                           );
+
+/// @brief Coverage of one return statement of FindProxyForURL.
+typedef struct pacparser_rule_coverage {
+  /// Position of the return statement in the PAC script, 1-based.
+  int line;
+  int column;
+  /// Number of lookups that returned here.
+  unsigned long hits;
+  /// Total number of conditions those lookups evaluated in FindProxyForURL,
+  /// including those of the returned expression.
+  unsigned long predicates;
+} pacparser_rule_coverage;
+
+/// @brief Enables or disables PAC coverage.
+/// @param enable 1 to instrument PAC scripts parsed afterwards, 0 to stop.
+///
+/// Instrumented scripts count, per return statement in the body of
+/// FindProxyForURL, the lookups that returned there and the conditions they
+/// evaluated on the way, e.g. to find rules worth moving up. Conditions are
+/// those of if statements, switch cases, ?: and each operand of && and ||
+/// after the first. Functions defined outside FindProxyForURL, or nested in
+/// it, are not instrumented. Applies to scripts parsed with
+/// pacparser_parse_pac_*, pacparser_reload_pac_*, pacparser_just_find_proxy
+/// and pacparser_registry_load_*; each engine and registry script keeps the
+/// counts of its own script.
+void pacparser_enable_coverage(int enable             // 1 or 0
+                               );
+
+/// @brief Gets the coverage of the PAC script in the current engine.
+/// @param rules Array to fill in, in source order, or NULL.
+/// @param max Number of entries in rules.
+/// @returns Number of return statements in FindProxyForURL, which may be
+/// more than max, or 0 if the script was not instrumented.
+int pacparser_get_coverage(pacparser_rule_coverage *rules, // Coverage
+                           int max            // Size of rules
+                           );
+
+/// Log levels for pacparser_set_log_level. Errors are always printed.
+enum {
+  PACPARSER_LOG_ERROR = 0,
+  PACPARSER_LOG_INFO = 1,
+  PACPARSER_LOG_DEBUG = 2
+};
+
+/// @brief Sets the level of diagnostic messages printed.
+/// @param level PACPARSER_LOG_ERROR, PACPARSER_LOG_INFO or
+/// PACPARSER_LOG_DEBUG.
+///
+/// Messages are printed with the error printer (see
+/// pacparser_set_error_printer). Until this is called, the level is read once
+/// from the PACPARSER_LOG_LEVEL environment variable ("error", "info" or
+/// "debug"), or is debug if PACPARSER_DEBUG is set. Debug messages can be
+/// compiled out by building with -DPACPARSER_NO_DEBUG_LOG.
+void pacparser_set_log_level(int level          // Log level
+                             );
+
+/// @brief Gets the current log level.
+/// @returns One of PACPARSER_LOG_ERROR, PACPARSER_LOG_INFO or
+/// PACPARSER_LOG_DEBUG.
+int pacparser_get_log_level(void);
+
 /// @brief Type definition for pacparser_error_printer.
 typedef int (*pacparser_error_printer)(const char *fmt,	// printf format
 				       va_list argp	// Variadic arg list
@@ -125,6 +480,352 @@ typedef int (*pacparser_error_printer)(const char *fmt,	// printf format
 void pacparser_set_error_printer(pacparser_error_printer func	// Printing function
 				);
 
+/// @brief Opaque handle to a registry of PAC scripts.
+///
+/// A registry holds many PAC scripts, each under a string ID (e.g. a tenant
+/// name). All of them share one JavaScript runtime and one compiled copy of
+/// the PAC utility functions, which makes each additional script much cheaper
+/// than a separate process or pacparser instance. Registries are independent
+/// of the global pacparser_init/pacparser_parse_pac_* state.
+///
+/// A JavaScript runtime runs one script at a time, so calls on the same
+/// registry are serialized: a lookup holds the registry for its whole
+/// evaluation, including the DNS resolutions the PAC script makes. One slow
+/// PAC script (e.g. isResolvable() on a name whose resolver times out) delays
+/// lookups for every other script in the same registry. To evaluate scripts
+/// in parallel, or to isolate tenants from each other's latency, spread them
+/// over several registries; pacparser_set_dns_cache_ttl cuts repeated DNS
+/// waits.
+typedef struct pacparser_registry pacparser_registry;
+
+/// @brief Creates an empty registry.
+/// @returns New registry, or NULL on failure. Free with
+/// pacparser_registry_free.
+pacparser_registry *pacparser_registry_new(void);
+
+/// @brief Sets the profile of a registry's JavaScript contexts.
+/// @param reg Registry.
+/// @param profile PACPARSER_PROFILE_FULL (the default) or
+/// PACPARSER_PROFILE_MINIMAL; see pacparser_set_engine_profile.
+/// @returns 0 on failure and 1 on success.
+///
+/// Applies to PAC scripts loaded, or reloaded after eviction, afterwards.
+int pacparser_registry_set_profile(pacparser_registry *reg,
+                                   int profile
+                                   );
+
+/// @brief Frees a registry and all the PAC scripts in it.
+void pacparser_registry_free(pacparser_registry *reg   // Registry
+                             );
+
+/// @brief Adds a PAC file to the registry.
+/// @param reg Registry.
+/// @param id ID to store the PAC script under. Replaces any PAC script
+/// already stored under it.
+/// @param pacfile PAC file to load.
+/// @returns 0 on failure and 1 on success.
+int pacparser_registry_load_file(pacparser_registry *reg,
+                                 const char *id,
+                                 const char *pacfile
+                                 );
+
+/// @brief Adds a PAC script string to the registry.
+/// @param reg Registry.
+/// @param id ID to store the PAC script under. Replaces any PAC script
+/// already stored under it.
+/// @param script PAC script.
+/// @returns 0 on failure and 1 on success.
+int pacparser_registry_load_string(pacparser_registry *reg,
+                                   const char *id,
+                                   const char *script
+                                   );
+
+/// @brief Removes a PAC script from the registry.
+/// @returns 1 if the PAC script was removed, 0 if there was none under id.
+///
+/// The script's memory is reclaimed right away, including garbage cycles,
+/// which takes a garbage collection of the registry's runtime. The same goes
+/// for a script replaced by pacparser_registry_load_*.
+int pacparser_registry_unload(pacparser_registry *reg,
+                              const char *id
+                              );
+
+/// @brief Finds proxy for a URL using one of the registry's PAC scripts.
+/// @param reg Registry.
+/// @param id ID of the PAC script to use.
+/// @param url URL to find proxy for.
+/// @param host Host part of the URL.
+/// @returns proxy string on success and NULL on error. The string is
+/// allocated with malloc and must be freed by the caller.
+///
+/// If the PAC script's context was evicted, it is recreated first.
+char *pacparser_registry_find_proxy(pacparser_registry *reg,
+                                    const char *id,
+                                    const char *url,
+                                    const char *host
+                                    );
+
+/// @brief Evicts PAC scripts that have not been used for a while.
+/// @param reg Registry.
+/// @param idle_seconds Evict PAC scripts not used in the last idle_seconds.
+/// @returns Number of PAC scripts evicted.
+///
+/// Evicted PAC scripts release their JavaScript context, keeping only their
+/// compiled bytecode. They stay in the registry and are reloaded from the
+/// bytecode on their next lookup.
+int pacparser_registry_evict_idle(pacparser_registry *reg,
+                                  int idle_seconds
+                                  );
+
+/// @brief Gets the coverage of a PAC script in the registry.
+/// @param reg Registry.
+/// @param id ID of the PAC script.
+/// @param rules Array to fill in, in source order, or NULL.
+/// @param max Number of entries in rules.
+/// @returns Number of return statements in FindProxyForURL, which may be
+/// more than max, or 0 if there is no instrumented PAC script under id.
+///
+/// See pacparser_enable_coverage.
+int pacparser_registry_get_coverage(pacparser_registry *reg,
+                                    const char *id,
+                                    pacparser_rule_coverage *rules,
+                                    int max
+                                    );
+
+/// @brief Returns memory used by a PAC script in the registry.
+/// @param reg Registry.
+/// @param id ID of the PAC script, or NULL for the whole registry.
+/// @returns Bytes used, or -1 if there is no PAC script under id.
+///
+/// A PAC script's memory is its compiled bytecode plus the runtime memory
+/// its context took when it was loaded; evicted scripts report only their
+/// bytecode.
+long pacparser_registry_memory_usage(pacparser_registry *reg,
+                                     const char *id
+                                     );
+
+/// @brief Sets the limits of the parsed PAC file cache.
+/// @param max_entries Maximum number of PAC files kept parsed. 0 disables the
+/// cache.
+/// @param max_bytes Maximum memory used by all cached PAC files together.
+///
+/// When pacparser is not initialized, pacparser_just_find_proxy keeps the
+/// engines it parses PAC files into in a cache, keyed by the file's path,
+/// inode, size and modification time, so that calling it repeatedly for the
+/// same unchanged file doesn't read and parse it again. Least recently used
+/// files are evicted first when either limit is reached. Defaults to 8 entries
+/// and 64 MiB. Like the global engine, a cached PAC file keeps its global
+/// variables between lookups unless isolated lookups are enabled (see
+/// pacparser_set_isolated_lookups).
+void pacparser_set_pac_cache_limits(int max_entries,
+                                    size_t max_bytes
+                                    );
+
+/// @brief Frees all PAC files held in the parsed PAC file cache.
+///
+/// pacparser_cleanup also clears the cache.
+void pacparser_clear_pac_cache(void);
+
+/// @brief Memory allocation functions for the JavaScript engine.
+///
+/// The functions have the same semantics as their C library counterparts,
+/// with the extra opaque argument. usable_size_fn returns the usable size
+/// of a block, which memory accounting and pacparser_set_memory_limit rely
+/// on. It may be NULL, in which case each block is allocated with a 16 byte
+/// header in front of it that records its size.
+typedef struct pacparser_allocator {
+  void *(*calloc_fn)(void *opaque, size_t count, size_t size);
+  void *(*malloc_fn)(void *opaque, size_t size);
+  void (*free_fn)(void *opaque, void *ptr);
+  void *(*realloc_fn)(void *opaque, void *ptr, size_t size);
+  size_t (*usable_size_fn)(const void *ptr);
+  void *opaque;
+} pacparser_allocator;
+
+/// @brief Engine profiles: which JavaScript built-in objects engines have.
+enum {
+  /// Every built-in object QuickJS provides (the default).
+  PACPARSER_PROFILE_FULL = 0,
+  /// Only what PAC scripts need: base objects (Object, Function, Array,
+  /// String, Number, Boolean, Symbol, Math, Error, ...), Date, RegExp and
+  /// JSON. Leaves out Proxy, Map/Set, typed arrays, Promise, WeakRef,
+  /// DOMException and performance, making engines faster to create and
+  /// smaller.
+  PACPARSER_PROFILE_MINIMAL = 1,
+};
+
+/// @brief Sets the profile of the JavaScript engine.
+/// @param profile PACPARSER_PROFILE_FULL or PACPARSER_PROFILE_MINIMAL.
+/// @returns 0 on failure (unknown profile) and 1 on success.
+///
+/// Applies to engines created after the call: by pacparser_init,
+/// pacparser_reload_pac_* and pacparser_just_find_proxy. Each engine keeps
+/// the profile it was created with.
+int pacparser_set_engine_profile(int profile
+                                 );
+
+/// @brief Sets the allocator used by the JavaScript engine.
+/// @param allocator Allocator functions, or NULL to go back to the C
+/// library's malloc.
+/// @returns 0 on failure (missing functions) and 1 on success.
+///
+/// Takes effect for engines created after the call: by pacparser_init,
+/// pacparser_reload_pac_* and pacparser_just_find_proxy. Each engine is used
+/// by one thread at a time, but different engines may call the functions
+/// concurrently. Registries created afterwards (pacparser_registry_new) call
+/// it too, beneath the accounting they do for
+/// pacparser_registry_memory_usage.
+int pacparser_set_allocator(const pacparser_allocator *allocator
+                            );
+
+/// @brief Enables or disables the built-in pool allocator.
+/// @param enable 1 to use the pool allocator, 0 (the default) not to.
+///
+/// The pool allocator gives each engine its own pool of fixed size classes
+/// for the many small objects created by lookups, with no locking. This makes
+/// allocations cheaper, especially with several engines running on different
+/// threads, at the cost of memory freed by an engine being kept for reuse by
+/// that engine until it is destroyed. Takes precedence over
+/// pacparser_set_allocator, and like it, applies to engines created after the
+/// call.
+void pacparser_set_pool_allocator(int enable           // 1 or 0
+                                  );
+
+/// @brief Sets the memory limit of the JavaScript engine.
+/// @param bytes Maximum memory the engine may allocate, 0 for no limit (the
+/// default).
+///
+/// Applies to the current engine, to the engines pacparser_just_find_proxy
+/// has cached and to engines and registries created afterwards; registries
+/// that already exist keep their limit. The limit is per engine, and per
+/// registry (for all of its PAC scripts together). Parses and lookups that
+/// would exceed the limit fail with an out of memory error.
+void pacparser_set_memory_limit(size_t bytes           // Limit in bytes
+                                );
+
+/// @brief Sets the garbage collection threshold of the JavaScript engine.
+/// @param bytes Allocated size at which the next automatic garbage
+/// collection runs, 0 for QuickJS's default (256 KiB).
+///
+/// Most memory is freed as soon as it's unused through reference counting;
+/// the garbage collector only reclaims cycles. After an automatic collection,
+/// QuickJS moves the threshold to 1.5 times the memory still in use. Set it to
+/// (size_t)-1 to disable automatic collections and call pacparser_gc between
+/// batches of lookups instead, keeping collection pauses out of lookups.
+/// Applies to the same engines and registries as pacparser_set_memory_limit.
+void pacparser_set_gc_threshold(size_t bytes           // Threshold in bytes
+                                );
+
+/// @brief Runs the garbage collector.
+///
+/// Collects the current engine and the engines in the parsed PAC file cache.
+void pacparser_gc(void);
+
+/// @brief Sets a time limit for each lookup and PAC script evaluation.
+/// @param timeout_ms Maximum time in milliseconds, 0 (the default) for no
+/// limit.
+///
+/// Protects against PAC scripts with endless loops or pathological regular
+/// expressions: when a lookup or parse takes longer than timeout_ms, its
+/// JavaScript evaluation is aborted, the failure is counted in
+/// pacparser_stats.timeouts and pacparser_timed_out returns 1. A timed out
+/// lookup returns the fallback set with pacparser_set_timeout_fallback, or
+/// NULL if there is none. The time spent waiting for DNS responses counts
+/// towards the limit, but a DNS lookup in progress is not interrupted.
+/// Applies to all engines and registries.
+void pacparser_set_timeout(int timeout_ms               // Milliseconds
+                           );
+
+/// @brief Sets the result of lookups that time out.
+/// @param proxy Proxy string to return, e.g. "DIRECT", or NULL (the default)
+/// to fail timed out lookups.
+/// @returns 0 on failure and 1 on success.
+int pacparser_set_timeout_fallback(const char *proxy
+                                   );
+
+/// @brief Tells whether the last lookup or parse on this thread timed out.
+/// @returns 1 if it timed out, 0 otherwise.
+///
+/// Distinguishes timeouts from other failures, and a timeout fallback from a
+/// result returned by the PAC script.
+int pacparser_timed_out(void);
+
+/// @brief Sets the maximum JavaScript stack size.
+/// @param bytes Maximum stack used by JavaScript evaluation, 0 for QuickJS's
+/// default (1 MiB).
+///
+/// Deep or unbounded recursion in a PAC script fails with a stack overflow
+/// error instead of crashing the process. The threads doing lookups must
+/// have at least this much stack. Applies to the same engines and registries
+/// as pacparser_set_memory_limit.
+void pacparser_set_max_stack_size(size_t bytes          // Limit in bytes
+                                  );
+
+/// @brief Memory usage of the JavaScript engine.
+///
+/// All sizes are in bytes.
+typedef struct pacparser_memory_stats {
+  /// Memory allocated by the engine, and number of live allocations.
+  size_t malloc_size;
+  size_t malloc_count;
+  /// Memory limit (0 if none) and next garbage collection threshold.
+  size_t malloc_limit;
+  size_t gc_threshold;
+  /// Estimate of the memory in use by the items below, excluding allocator
+  /// overhead.
+  size_t memory_used_size;
+  /// Atoms: interned strings used for identifiers and property names.
+  size_t atom_count;
+  size_t atom_size;
+  /// Strings.
+  size_t str_count;
+  size_t str_size;
+  /// Objects, including their properties and shapes.
+  size_t obj_count;
+  size_t obj_size;
+  /// Compiled functions: their bytecode, and the rest (constants, variable
+  /// and debug information).
+  size_t js_func_count;
+  size_t js_func_code_size;
+  size_t js_func_size;
+} pacparser_memory_stats;
+
+/// @brief Gets the memory usage of the current engine.
+/// @param usage Struct to fill in.
+/// @returns 0 on failure (e.g. pacparser is not initialized) and 1 on
+/// success.
+///
+/// Only covers the engine of pacparser_init/pacparser_parse_pac_*, not the
+/// engines cached by pacparser_just_find_proxy; see
+/// pacparser_registry_memory_usage for registries.
+int pacparser_memory_usage(pacparser_memory_stats *usage
+                           );
+
+/// @brief Enables or disables isolated lookups.
+/// @param enable 1 to run each lookup in a fresh JavaScript context, 0 (the
+/// default) to run all lookups in the context the PAC script was parsed in.
+///
+/// PAC scripts can keep state in global variables between calls to
+/// FindProxyForURL. With isolated lookups, pacparser_find_proxy evaluates
+/// every lookup in a new context reset to a snapshot of the state right after
+/// the PAC script was parsed, so no lookup can see changes made by another.
+/// The snapshot is the script's compiled bytecode, captured at parse time.
+/// This is not a cheap reset: each lookup still creates and frees a context
+/// with QuickJS's built-in objects, adds pacparser's builtins,
+/// evaluates the bytecode of pac_utils and re-runs the script's top level
+/// code; only compilation is skipped. Creating and freeing the context
+/// dominate, so for a small PAC script an isolated lookup costs 15 to 20
+/// times a lookup in the shared context, about as much as pacparser_cleanup,
+/// pacparser_init and a new parse. PACPARSER_PROFILE_MINIMAL makes contexts
+/// cheaper to create.
+///
+/// Takes effect from the next pacparser_parse_pac_* or
+/// pacparser_reload_pac_* call; until then, lookups fail. If a later parse
+/// fails, lookups keep running from the snapshot of the last script parsed
+/// successfully.
+void pacparser_set_isolated_lookups(int enable          // 1 or 0
+                                    );
+
 /// @brief (Deprecated) Enable Microsoft IPv6 PAC extensions.
 ///
 /// Deprecated. IPv6 extension (*Ex functions) are enabled by default now.
@@ -22,22 +22,58 @@
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 
 #include "pacparser.h"
+#include "pac_compat.h"
+#include <ctype.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
 #include <unistd.h>
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
 #define STREQ(s1, s2) (strcmp((s1), (s2)) == 0)
 
 #define LINEMAX 4096  // Max length of any line read from text files (4 KiB)
-#define PACMAX (1024 * 1024)  // Max size of the PAC script (1 MiB)
+#define PACMAX_MB 64  // Default max size of the PAC script read from stdin
+#define PROFILE_INTERVAL_US 100  // Sampling interval of --profile
+#define PROFILE_TOP_LINES 20     // PAC script lines listed by --profile
+#define MAX_JOBS 256             // Max number of -j threads
+#define BATCH_LINES 4096         // Lines of urlslist evaluated per batch by -j
+#define BATCH_CHUNK 16           // Lines a -j thread takes at a time
+#define BENCH_ITERATIONS 10      // Default --iterations of --bench
+#define BENCH_WARMUP 1           // Default --warmup of --bench
+#define TRANSITION_BUCKETS 1024  // Hash buckets of --diff result transitions
 
 __attribute__((noreturn)) void usage(const char *progname)
 {
   fprintf(stderr, "\nUsage:  %s <-p pacfile> <-u url> [-h host] "
-          "[-c client_ip] [-e]", progname);
-  fprintf(stderr, "\n        %s <-p pacfile> <-f urlslist> "
-          "[-c client_ip] [-e]\n", progname);
+          "[-c client_ip] [-m max_mb] [-t timeout_ms] [-e]\n"
+          "        %*s [--format=jsonl] [--stats] [--builtin-stats] [--profile folded_file]\n"
+          "        %*s [--coverage]", progname, (int)strlen(progname), "", (int)strlen(progname), "");
+  fprintf(stderr, "\n        %s <-p pacfile> <-f urlslist> [-j jobs] "
+          "[-c client_ip] [-m max_mb] [-t timeout_ms] [-e]\n"
+          "        %*s [--format=jsonl] [--stats] [--builtin-stats] [--profile folded_file]\n"
+          "        %*s [--coverage]", progname, (int)strlen(progname), "", (int)strlen(progname), "");
+  fprintf(stderr, "\n        %s <-p pacfile> <-f urlslist> <--bench> "
+          "[--iterations N] [--warmup M]\n"
+          "        %*s [--threads T] [--dns-map file] [-c client_ip] "
+          "[-m max_mb] [-t timeout_ms]", progname, (int)strlen(progname), "");
+  fprintf(stderr, "\n        %s <--diff old_pacfile new_pacfile> "
+          "<-f urlslist> [--dns-map file]\n"
+          "        %*s [-c client_ip] [-t timeout_ms]", progname,
+          (int)strlen(progname), "");
+  fprintf(stderr, "\n        %s <-p pacfile> <--squid-helper> [-j jobs] "
+          "[-c client_ip] [-t timeout_ms] [-e]\n"
+          "        %*s [--stats] [--builtin-stats] [--profile folded_file]\n"
+          "        %*s [--coverage]", progname, (int)strlen(progname), "", (int)strlen(progname), "");
+  fprintf(stderr, "\n        %s <-p pacfile> <--serve-stdio> "
+          "[-c client_ip] [-t timeout_ms] [-e]\n"
+          "        %*s [--format=jsonl] [--stats] [--builtin-stats] [--profile folded_file]\n"
+          "        %*s [--coverage]\n", progname, (int)strlen(progname), "", (int)strlen(progname), "");
   fprintf(stderr, "\nOptions:\n");
   fprintf(stderr, "  -p pacfile   : PAC file to test (specify '-' to read "
                   "from standard input)\n");
@@ -50,7 +86,73 @@ __attribute__((noreturn)) void usage(const char *progname)
   fprintf(stderr, "  -e           : Deprecated: IPv6 extensions are enabled"
                   "by default now.\n");
   fprintf(stderr, "  -f urlslist  : a file containing list of URLs to be "
-          "tested.\n");
+          "tested (specify '-' to\n");
+  fprintf(stderr, "                 read from standard input).\n");
+  fprintf(stderr, "  -j jobs      : evaluate the URLs in urlslist (or Squid "
+                  "helper requests) on\n");
+  fprintf(stderr, "                 jobs threads, each with its "
+                  "own engine. Results of\n");
+  fprintf(stderr, "                 urlslist are printed in its "
+                  "order.\n");
+  fprintf(stderr, "  --serve-stdio: read lookups, one 'url [host "
+                  "[client_ip]]' per line, from\n");
+  fprintf(stderr, "                 standard input and write one result "
+                  "line for each, the\n");
+  fprintf(stderr, "                 proxy string or 'ERROR reason', to "
+                  "standard output.\n");
+  fprintf(stderr, "  --squid-helper: answer Squid helper requests, "
+                  "'[channel-ID] url [host]',\n");
+  fprintf(stderr, "                 from standard input with '[channel-ID] "
+                  "OK message=\"proxy\"'\n");
+  fprintf(stderr, "                 as they finish, on -j threads.\n");
+  fprintf(stderr, "  --format=jsonl: write each result as a line of JSON "
+                  "with the URL, host,\n");
+  fprintf(stderr, "                 client IP, result, error, evaluation "
+                  "time and DNS lookups.\n");
+  fprintf(stderr, "  --bench      : look up the URLs in urlslist, --warmup "
+                  "(default %d) and\n", BENCH_WARMUP);
+  fprintf(stderr, "                 --iterations (default %d) times on each "
+                  "of --threads (or -j)\n", BENCH_ITERATIONS);
+  fprintf(stderr, "                 threads, and print lookups/sec, "
+                  "latency percentiles,\n");
+  fprintf(stderr, "                 allocations per lookup and peak RSS. "
+                  "DNS is served from\n");
+  fprintf(stderr, "                 --dns-map only.\n");
+  fprintf(stderr, "  --dns-map file: resolve hostnames from file, lines of "
+                  "'hostname address...',\n");
+  fprintf(stderr, "                 instead of DNS.\n");
+  fprintf(stderr, "  --diff old_pacfile new_pacfile: evaluate urlslist "
+                  "with both PAC files\n");
+  fprintf(stderr, "                 at once, print the URLs with different "
+                  "results, the number\n");
+  fprintf(stderr, "                 of URLs per result transition and the "
+                  "speed of each file.\n");
+  fprintf(stderr, "  -m max_mb    : max size in MiB of the PAC script read "
+                  "from standard input\n");
+  fprintf(stderr, "                 (default %d, 0 for no limit).\n",
+          PACMAX_MB);
+  fprintf(stderr, "  -t timeout_ms: abort parsing or a lookup that takes longer "
+                  "than timeout_ms\n");
+  fprintf(stderr, "                 milliseconds.\n");
+  fprintf(stderr, "  --stats      : print parse, lookup and DNS latency "
+                  "statistics to standard\n");
+  fprintf(stderr, "                 error when done.\n");
+  fprintf(stderr, "  --builtin-stats: time PAC builtin functions "
+                  "(shExpMatch, isInNet, ...) and\n");
+  fprintf(stderr, "                 print their cost to standard error "
+                  "when done.\n");
+  fprintf(stderr, "  --profile folded_file: sample the PAC script's stacks, "
+                  "write them to\n");
+  fprintf(stderr, "                 folded_file for flamegraph tools and "
+                  "print the busiest\n");
+  fprintf(stderr, "                 lines of the PAC script to standard "
+                  "error.\n");
+  fprintf(stderr, "  --coverage   : print how many lookups each return "
+                  "statement of\n");
+  fprintf(stderr, "                 FindProxyForURL handled, and the "
+                  "average number of\n");
+  fprintf(stderr, "                 conditions they evaluated, to standard "
+                  "error.\n");
   fprintf(stderr, "  -v           : print version and exit\n");
   exit(1);
 }
@@ -82,20 +184,1415 @@ char *get_host_from_url(const char *url)
   while (*p != '/' && *p != ':' && *p != '\0')
     p++;
   *p = '\0';
-  return host;
+  // Move the host to the start of the copy so that callers can free it.
+  memmove(q, host, p - host + 1);
+  return q;
+}
+
+// Strips the leading blanks of a line of urlslist and terminates it after the
+// URL. Comment lines (starting with '#') are returned whole.
+char *trim_url_line(char *line)
+{
+  char *url = line;
+  // Remove spaces from the beginning.
+  while (*url == ' ' || *url == '\t')
+    url++;
+  if (*url == '#')
+    return url;
+  char *urlend = url;
+  while (*urlend != '\r' && *urlend != '\n' && *urlend != '\0' &&
+         *urlend != ' ' && *urlend != '\t')
+    urlend++;  // keep moving till you hit space or end of string
+  *urlend = '\0';
+  return url;
+}
+
+// Reads all of fp into a null terminated string.
+//
+// The buffer grows geometrically, so reading is linear in the size of the
+// input, but never past max_size + 2 bytes: room for one byte too many and
+// the terminating null. Returns NULL (after printing an error) on read error,
+// on running out of memory, or if the input is larger than max_size bytes
+// (unless max_size is 0).
+char *read_stream(FILE *fp, size_t max_size)
+{
+  size_t size = 0, capacity = 64 * 1024;
+  if (max_size && capacity > max_size + 2) capacity = max_size + 2;
+  char *buf = malloc(capacity);
+  if (buf == NULL) {
+    perror("pactester.c: Failed to allocate the memory for the script");
+    return NULL;
+  }
+  for (;;) {
+    if (capacity - size < 2) {
+      size_t new_capacity = capacity * 2;
+      if (max_size && new_capacity > max_size + 2) new_capacity = max_size + 2;
+      char *p = realloc(buf, new_capacity);
+      if (p == NULL) {
+        free(buf);
+        perror("pactester.c: Failed to allocate the memory for the script");
+        return NULL;
+      }
+      buf = p;
+      capacity = new_capacity;
+    }
+    size_t n = fread(buf + size, 1, capacity - size - 1, fp);
+    size += n;
+    if (max_size && size > max_size) {
+      free(buf);
+      fprintf(stderr, "Input file is too big. Maximum allowed size is: %zu\n",
+              max_size);
+      return NULL;
+    }
+    if (n == 0) break;
+  }
+  if (ferror(fp)) {
+    free(buf);
+    perror("pactester.c: Error reading from stdin");
+    return NULL;
+  }
+  buf[size] = '\0';
+  return buf;
+}
+
+static void print_latency(const char *name, const pacparser_latency *l)
+{
+  fprintf(stderr, "  %-10s %8lu calls  mean %8lu  p50 %8lu  p90 %8lu  "
+          "p99 %8lu  p99.9 %8lu  max %8lu\n", name, l->count, l->mean_us,
+          l->p50_us, l->p90_us, l->p99_us, l->p999_us, l->max_us);
+}
+
+// Prints library statistics to stderr, keeping stdout for the results.
+void print_stats(void)
+{
+  pacparser_stats stats;
+  if (!pacparser_get_stats(&stats)) return;
+  fprintf(stderr, "Latency (microseconds):\n");
+  print_latency("parse", &stats.parse);
+  print_latency("find_proxy", &stats.find_proxy);
+  print_latency("dns", &stats.dns);
+  fprintf(stderr, "Timeouts: %lu\n", stats.timeouts);
+}
+
+static int compare_builtin_cost(const void *a, const void *b)
+{
+  const pacparser_builtin_stats *x = a, *y = b;
+  if (x->self_ns != y->self_ns) return x->self_ns < y->self_ns ? 1 : -1;
+  return strcmp(x->name, y->name);
+}
+
+// Prints the builtins called so far to stderr, most expensive first.
+void print_builtin_stats(void)
+{
+  pacparser_builtin_stats builtins[64];
+  int n = pacparser_get_builtin_stats(builtins, 64);
+  unsigned long long total = 0;
+  for (int i = 0; i < n; i++) total += builtins[i].self_ns;
+  qsort(builtins, n, sizeof(builtins[0]), compare_builtin_cost);
+  fprintf(stderr, "%-20s %10s %12s %12s %10s %7s\n", "Builtin", "Calls",
+          "Self (us)", "Total (us)", "Self/call", "Self %");
+  for (int i = 0; i < n; i++) {
+    const pacparser_builtin_stats *b = &builtins[i];
+    fprintf(stderr, "%-20s %10lu %12.1f %12.1f %10.2f %6.1f%%\n", b->name,
+            b->calls, b->self_ns / 1e3, b->total_ns / 1e3,
+            b->self_ns / 1e3 / b->calls, total ? 100.0 * b->self_ns / total : 0);
+  }
+}
+
+// Returns the start of the given 1-based line of script, or NULL.
+const char *line_text(const char *script, int line)
+{
+  const char *text = script;
+  for (int n = 1; text && n < line; n++) {
+    text = strchr(text, '\n');
+    if (text) text++;
+  }
+  return text;
+}
+
+static void write_folded_stack(const char *stack, unsigned long samples,
+                               void *fp)
+{
+  fprintf(fp, "%s %lu\n", stack, samples);
+}
+
+typedef struct {
+  int line;
+  unsigned long samples;
+} line_samples;
+
+typedef struct {
+  line_samples *lines;
+  int count, size;
+  unsigned long total;
+} profile_lines;
+
+static void add_line_samples(int line, unsigned long samples, void *opaque)
+{
+  profile_lines *pl = opaque;
+  pl->total += samples;
+  if (pl->count == pl->size) {
+    int size = pl->size ? pl->size * 2 : 256;
+    line_samples *lines = realloc(pl->lines, size * sizeof(line_samples));
+    if (lines == NULL) return;
+    pl->lines = lines;
+    pl->size = size;
+  }
+  pl->lines[pl->count].line = line;
+  pl->lines[pl->count++].samples = samples;
+}
+
+static int compare_line_samples(const void *a, const void *b)
+{
+  const line_samples *x = a, *y = b;
+  if (x->samples != y->samples) return x->samples < y->samples ? 1 : -1;
+  return x->line - y->line;
+}
+
+// Writes the profile's folded stacks to path and prints the PAC script lines
+// with the most samples, with their source, to stderr.
+int write_profile(const char *path, const char *script)
+{
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror("pactester.c: Could not open the profile output file");
+    return 0;
+  }
+  pacparser_get_profile(write_folded_stack, NULL, fp);
+  fclose(fp);
+
+  profile_lines pl = { NULL, 0, 0, 0 };
+  pacparser_get_profile(NULL, add_line_samples, &pl);
+  qsort(pl.lines, pl.count, sizeof(line_samples), compare_line_samples);
+  fprintf(stderr, "%8s %7s  %s\n", "Samples", "%", "Line");
+  for (int i = 0; i < pl.count && i < PROFILE_TOP_LINES; i++) {
+    const char *text = line_text(script, pl.lines[i].line);
+    int len = text ? (int)strcspn(text, "\r\n") : 0;
+    fprintf(stderr, "%8lu %6.1f%%  %d: %.*s\n", pl.lines[i].samples,
+            100.0 * pl.lines[i].samples / pl.total, pl.lines[i].line,
+            len > 100 ? 100 : len, text ? text : "");
+  }
+  free(pl.lines);
+  return 1;
+}
+
+// Coverage of the registries of threads (-j, --squid and --bench), added up
+// by add_job_coverage as they finish.
+static pacparser_rule_coverage *job_coverage = NULL;
+static int job_coverage_count = 0;
+
+// Adds the coverage of the PAC script in reg to job_coverage.
+void add_job_coverage(pacparser_registry *reg)
+{
+  int n = pacparser_registry_get_coverage(reg, "pac", NULL, 0);
+  if (n == 0) return;
+  pacparser_rule_coverage *rules = calloc(n, sizeof(*rules));
+  if (rules == NULL) return;
+  pacparser_registry_get_coverage(reg, "pac", rules, n);
+  if (job_coverage == NULL) {
+    job_coverage = rules;
+    job_coverage_count = n;
+    return;
+  }
+  for (int i = 0; i < n && i < job_coverage_count; i++) {
+    job_coverage[i].hits += rules[i].hits;
+    job_coverage[i].predicates += rules[i].predicates;
+  }
+  free(rules);
+}
+
+// Prints the hits of each return statement in FindProxyForURL, in source
+// order, to stderr.
+void print_coverage(const char *script)
+{
+  int n = pacparser_get_coverage(NULL, 0);
+  pacparser_rule_coverage *rules = calloc(n ? n : 1, sizeof(*rules));
+  if (rules == NULL) return;
+  pacparser_get_coverage(rules, n);
+  for (int i = 0; i < n && i < job_coverage_count; i++) {
+    rules[i].hits += job_coverage[i].hits;
+    rules[i].predicates += job_coverage[i].predicates;
+  }
+  unsigned long lookups = 0, predicates = 0;
+  int never_hit = 0;
+  for (int i = 0; i < n; i++) {
+    lookups += rules[i].hits;
+    predicates += rules[i].predicates;
+    if (rules[i].hits == 0) never_hit++;
+  }
+  fprintf(stderr, "%10s %7s %10s  %s\n", "Hits", "%", "Avg preds", "Rule");
+  for (int i = 0; i < n; i++) {
+    const pacparser_rule_coverage *r = &rules[i];
+    const char *text = line_text(script, r->line);
+    int len = text ? (int)strcspn(text, "\r\n") : 0;
+    while (len > 0 && (*text == ' ' || *text == '\t')) {
+      text++;
+      len--;
+    }
+    fprintf(stderr, "%10lu %6.1f%% ", r->hits,
+            lookups ? 100.0 * r->hits / lookups : 0.0);
+    if (r->hits) fprintf(stderr, "%10.1f", (double)r->predicates / r->hits);
+    else fprintf(stderr, "%10s", "-");
+    fprintf(stderr, "  %d:%d: %.*s\n", r->line, r->column,
+            len > 80 ? 80 : len, text ? text : "");
+  }
+  fprintf(stderr, "%lu lookups, %.1f conditions per lookup, %d of %d "
+          "return statements never hit.\n", lookups,
+          lookups ? (double)predicates / lookups : 0.0, never_hit, n);
+  free(rules);
+}
+
+// JSON Lines output (--format=jsonl).
+//
+// Each lookup is written as one JSON object, with its timing taken from a
+// trace of every lookup and, if it failed, the messages pacparser printed
+// during it as the error.
+static int output_jsonl = 0;
+
+typedef struct {
+  unsigned long eval_us;
+  int dns_lookups;
+  unsigned long dns_us;
+  char messages[512];  // Printed by pacparser during the lookup.
+} lookup_info;
+
+// Lookup in progress on this thread, between lookup_begin and lookup_end.
+static PAC_THREAD_LOCAL lookup_info *current_lookup = NULL;
+
+// Error printer that also keeps the messages printed during a lookup.
+static int capture_messages(const char *fmt, va_list argp)
+{
+  lookup_info *info = current_lookup;
+  if (info) {
+    size_t len = strlen(info->messages);
+    va_list copy;
+    va_copy(copy, argp);
+    vsnprintf(info->messages + len, sizeof(info->messages) - len, fmt, copy);
+    va_end(copy);
+  }
+  return vfprintf(stderr, fmt, argp);
+}
+
+static void trace_lookup(const pacparser_trace *trace, void *opaque)
+{
+  lookup_info *info = current_lookup;
+  (void)opaque;
+  if (info == NULL)
+    return;
+  info->eval_us = trace->duration_us;
+  info->dns_lookups = trace->num_dns_names;
+  info->dns_us = trace->dns_us;
+}
+
+// Collects the timing and messages of the next lookup on this thread in info.
+void lookup_begin(lookup_info *info)
+{
+  memset(info, 0, sizeof(*info));
+  current_lookup = info;
+}
+
+void lookup_end(void)
+{
+  current_lookup = NULL;
+}
+
+// Writes s as a JSON string, or null if s is NULL.
+static void print_json_string(const char *s)
+{
+  if (s == NULL) {
+    fputs("null", stdout);
+    return;
+  }
+  putchar('"');
+  for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      printf("\\%c", *p);
+    else if (*p == '\n')
+      fputs("\\n", stdout);
+    else if (*p < 0x20)
+      printf("\\u%04x", *p);
+    else
+      putchar(*p);
+  }
+  putchar('"');
+}
+
+// Writes the result of a lookup as a line of JSON. If result is NULL, error
+// (or, if that is NULL too, the messages in info) says why.
+void print_jsonl(const char *url, const char *host, const char *client_ip,
+                 const char *result, const char *error,
+                 const lookup_info *info)
+{
+  char messages[sizeof(info->messages)];
+  if (result == NULL && error == NULL) {
+    strcpy(messages, info->messages);
+    size_t len = strlen(messages);
+    while (len > 0 && (messages[len - 1] == '\n' || messages[len - 1] == ' '))
+      messages[--len] = '\0';
+    error = len ? messages : "could not find proxy";
+  }
+  fputs("{\"url\":", stdout);
+  print_json_string(url);
+  fputs(",\"host\":", stdout);
+  print_json_string(host);
+  fputs(",\"client_ip\":", stdout);
+  print_json_string(client_ip);
+  fputs(",\"result\":", stdout);
+  print_json_string(result);
+  fputs(",\"error\":", stdout);
+  print_json_string(result ? NULL : error);
+  printf(",\"eval_us\":%lu,\"dns_lookups\":%d,\"dns_us\":%lu}\n",
+         info->eval_us, info->dns_lookups, info->dns_us);
+}
+
+// Parallel evaluation of urlslist (-j).
+//
+// The main thread reads urlslist in batches of BATCH_LINES lines, and jobs
+// threads, each with its own registry (and so its own JavaScript runtime)
+// holding the PAC script, evaluate BATCH_CHUNK lines at a time. Results are
+// printed in the original order once the whole batch is done.
+typedef struct {
+  char *line;          // Line of urlslist, trimmed by trim_url_line.
+  char *host;          // NULL for comments and lines without a proper URL.
+  char *proxy;         // NULL if not evaluated or if the lookup failed.
+  int timed_out;       // The lookup failed because it timed out.
+  lookup_info info;    // With --format=jsonl.
+} batch_item;
+
+typedef struct {
+  pac_mutex_t lock;
+  pac_cond_t work;     // Signaled when a batch is ready or on quit.
+  pac_cond_t done;     // Signaled when all lines of a batch are evaluated.
+  batch_item *items;
+  int count, next, finished, quit;
+} batch_pool;
+
+typedef struct {
+  batch_pool *pool;
+  pacparser_registry *reg;
+} batch_worker;
+
+static void *batch_thread(void *arg)
+{
+  batch_worker *w = arg;
+  batch_pool *pool = w->pool;
+  pac_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->quit && pool->next >= pool->count)
+      pac_cond_wait(&pool->work, &pool->lock);
+    if (pool->quit)
+      break;
+    int first = pool->next;
+    int last = first + BATCH_CHUNK < pool->count ? first + BATCH_CHUNK :
+                                                   pool->count;
+    pool->next = last;
+    pac_mutex_unlock(&pool->lock);
+    for (int i = first; i < last; i++) {
+      batch_item *item = &pool->items[i];
+      if (item->host == NULL)
+        continue;
+      lookup_begin(&item->info);
+      item->proxy = pacparser_registry_find_proxy(w->reg, "pac", item->line,
+                                                  item->host);
+      item->timed_out = item->proxy == NULL && pacparser_timed_out();
+      lookup_end();
+    }
+    pac_mutex_lock(&pool->lock);
+    pool->finished += last - first;
+    if (pool->finished == pool->count)
+      pac_cond_broadcast(&pool->done);
+  }
+  pac_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// Returns a new registry holding the PAC script under the ID "pac". script is
+// the PAC script if it was read from stdin, else pacfile is read.
+pacparser_registry *new_pac_registry(const char *pacfile, const char *script)
+{
+  pacparser_registry *reg = pacparser_registry_new();
+  if (reg &&
+      !(script ? pacparser_registry_load_string(reg, "pac", script) :
+                 pacparser_registry_load_file(reg, "pac", pacfile))) {
+    pacparser_registry_free(reg);
+    reg = NULL;
+  }
+  return reg;
+}
+
+// Evaluates the URLs in fp on jobs threads and prints the results in order.
+// script is the PAC script if it was read from stdin, else pacfile is read.
+// Returns 0 if a lookup failed; in text format, nothing after it is printed.
+int find_proxies_parallel(FILE *fp, const char *pacfile, const char *script,
+                          const char *client_ip, int jobs)
+{
+  batch_pool pool;
+  batch_worker workers[MAX_JOBS];
+  pac_thread_t threads[MAX_JOBS];
+  int started = 0, ok = 1, failed = 0;
+  char line[LINEMAX];
+
+  memset(&pool, 0, sizeof(pool));
+  pac_mutex_init(&pool.lock);
+  pac_cond_init(&pool.work);
+  pac_cond_init(&pool.done);
+  if (!(pool.items = calloc(BATCH_LINES, sizeof(batch_item)))) {
+    perror("pactester.c: Failed to allocate the memory for the URLs");
+    ok = 0;
+  }
+  for (; ok && started < jobs; started++) {
+    batch_worker *w = &workers[started];
+    w->pool = &pool;
+    w->reg = new_pac_registry(pacfile, script);
+    if (w->reg == NULL ||
+        pac_thread_create(&threads[started], batch_thread, w) != 0) {
+      fprintf(stderr, "pactester.c: Could not start job %d\n", started + 1);
+      if (w->reg)
+        pacparser_registry_free(w->reg);
+      ok = 0;
+      break;
+    }
+  }
+
+  while (ok) {
+    int count = 0;
+    while (count < BATCH_LINES && fgets(line, sizeof(line), fp)) {
+      batch_item *item = &pool.items[count++];
+      item->line = strdup(trim_url_line(line));
+      item->host = NULL;
+      item->proxy = NULL;
+      item->timed_out = 0;
+      memset(&item->info, 0, sizeof(item->info));
+      if (item->line && item->line[0] != '#')
+        item->host = get_host_from_url(item->line);
+    }
+    if (count == 0)
+      break;
+    pac_mutex_lock(&pool.lock);
+    pool.count = count;
+    pool.next = 0;
+    pool.finished = 0;
+    pac_cond_broadcast(&pool.work);
+    while (pool.finished < count)
+      pac_cond_wait(&pool.done, &pool.lock);
+    pac_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < count; i++) {
+      batch_item *item = &pool.items[i];
+      int comment = item->line == NULL || item->line[0] == '#';
+      if (output_jsonl) {
+        // Keep going after failed lookups; the error is in the output.
+        if (!comment)
+          print_jsonl(item->line, item->host, client_ip, item->proxy,
+                      item->host == NULL ? "not a proper URL" :
+                      item->timed_out ? "timed out" : NULL, &item->info);
+        if (item->host && item->proxy == NULL)
+          failed = 1;
+      } else if (ok && comment) {
+        if (item->line)
+          printf("%s", item->line);
+      } else if (ok && item->proxy) {
+        printf("%s : %s\n", item->line, item->proxy);
+      } else if (ok && item->host) {
+        // Like the single-threaded loop, stop at the first failed lookup.
+        fprintf(stderr, "pactester.c: %s %s.\n",
+                "Problem in finding proxy for", item->line);
+        ok = 0;
+      }
+      free(item->line);
+      free(item->host);
+      free(item->proxy);
+    }
+  }
+
+  pac_mutex_lock(&pool.lock);
+  pool.quit = 1;
+  pac_cond_broadcast(&pool.work);
+  pac_mutex_unlock(&pool.lock);
+  for (int i = 0; i < started; i++) {
+    pac_thread_join(threads[i]);
+    add_job_coverage(workers[i].reg);
+    pacparser_registry_free(workers[i].reg);
+  }
+  free(pool.items);
+  pac_cond_destroy(&pool.done);
+  pac_cond_destroy(&pool.work);
+  pac_mutex_destroy(&pool.lock);
+  return ok && !failed;
+}
+
+// Returns the next blank separated field of the string at *p, or NULL if there
+// is none, and moves *p past it.
+static char *next_field(char **p)
+{
+  char *field = *p;
+  while (*field == ' ' || *field == '\t')
+    field++;
+  if (*field == '\0')
+    return NULL;
+  char *end = field;
+  while (*end != '\0' && *end != ' ' && *end != '\t')
+    end++;
+  if (*end != '\0')
+    *end++ = '\0';
+  *p = end;
+  return field;
+}
+
+// Writes the answer to a request of --serve-stdio that could not be looked up.
+static void serve_error(const char *url, const char *host, const char *ip,
+                        const char *error, const lookup_info *info)
+{
+  if (output_jsonl)
+    print_jsonl(url, host, *ip ? ip : NULL, NULL, error, info);
+  else
+    printf("ERROR %s\n", error);
+}
+
+// Answers lookups read from stdin, one 'url [host [client_ip]]' per line,
+// until the end of the input. Every other line gets exactly one line on
+// stdout, flushed right away: the proxy string, or "ERROR " and the reason
+// (or a line of JSON with --format=jsonl).
+// Blank and comment lines are skipped without an answer. client_ip, if not
+// NULL, is used for lines that don't give one.
+void serve_stdio(const char *client_ip)
+{
+  char line[LINEMAX];
+  char current_ip[LINEMAX];          // Client IP in effect, "" for this host's.
+
+  strcpy(current_ip, client_ip ? client_ip : "");
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  while (fgets(line, sizeof(line), stdin)) {
+    size_t len = strlen(line);
+    if (len == sizeof(line) - 1 && line[len - 1] != '\n') {
+      // Skip the rest of the line so that it gets a single answer.
+      int ch;
+      while ((ch = getchar()) != EOF && ch != '\n')
+        ;
+      lookup_info info = { 0 };
+      serve_error(NULL, NULL, "", "line too long", &info);
+      continue;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    char *p = line;
+    char *url = next_field(&p);
+    if (url == NULL || *url == '#')
+      continue;
+    char *host = next_field(&p);
+    char *ip = next_field(&p);
+    if (ip == NULL)
+      ip = client_ip ? (char *)client_ip : "";
+    lookup_info info = { 0 };
+    if (!STREQ(ip, current_ip)) {
+      if (!pacparser_setmyip(*ip ? ip : NULL)) {
+        serve_error(url, host, ip, "invalid client IP", &info);
+        continue;
+      }
+      strcpy(current_ip, ip);
+    }
+    char *url_host = host ? NULL : get_host_from_url(url);
+    if (host == NULL && url_host == NULL) {
+      serve_error(url, NULL, ip, "not a proper URL", &info);
+      continue;
+    }
+    if (host == NULL)
+      host = url_host;
+    lookup_begin(&info);
+    char *proxy = pacparser_find_proxy(url, host);
+    lookup_end();
+    if (output_jsonl)
+      print_jsonl(url, host, *ip ? ip : NULL, proxy,
+                  pacparser_timed_out() ? "timed out" : NULL, &info);
+    else if (proxy)
+      printf("%s\n", proxy);
+    else if (pacparser_timed_out())
+      printf("ERROR timed out\n");
+    else
+      printf("ERROR could not find proxy\n");
+    free(url_host);
+  }
+}
+
+// Squid helper mode (--squid-helper).
+//
+// Speaks Squid's helper protocol, e.g. for an external_acl_type helper with
+// the format "%URI %DST" and concurrency set. Requests are
+//   [channel-ID] url [host]
+// and each gets one response, tagged with the request's channel ID if it had
+// one:
+//   [channel-ID] OK message="proxy string"
+//   [channel-ID] ERR message="reason"
+// The main thread reads requests into a queue and jobs worker threads, each
+// with its own registry holding the PAC script, answer them in the order they
+// finish. Without channel IDs Squid sends one request at a time, so answers
+// stay in order.
+typedef struct squid_request {
+  char *channel;       // Channel ID, or NULL if the request had none.
+  char *url;
+  char *host;          // Host given in the request, or NULL.
+  struct squid_request *next;
+} squid_request;
+
+typedef struct {
+  pac_mutex_t lock;
+  pac_cond_t ready;    // Signaled when a request is queued or on quit.
+  squid_request *head, *tail;
+  int quit;            // Set at the end of the input.
+  pac_mutex_t out_lock;
+} squid_queue;
+
+typedef struct {
+  squid_queue *queue;
+  pacparser_registry *reg;
+} squid_worker;
+
+// Writes a response, quoting message for Squid's key=value syntax. Responses
+// are flushed once no more requests are queued; until then a later response
+// will flush them.
+static void squid_respond(squid_queue *queue, const char *channel,
+                          const char *status, const char *message)
+{
+  pac_mutex_lock(&queue->out_lock);
+  if (channel)
+    printf("%s ", channel);
+  printf("%s message=\"", status);
+  for (const char *p = message; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      putchar('\\');
+    putchar(*p);
+  }
+  printf("\"\n");
+  pac_mutex_lock(&queue->lock);
+  int idle = queue->head == NULL;
+  pac_mutex_unlock(&queue->lock);
+  if (idle)
+    fflush(stdout);
+  pac_mutex_unlock(&queue->out_lock);
+}
+
+static void squid_answer(squid_worker *w, squid_request *req)
+{
+  char *url_host = req->host ? NULL : get_host_from_url(req->url);
+  const char *host = req->host ? req->host : url_host;
+  if (host == NULL) {
+    squid_respond(w->queue, req->channel, "ERR", "not a proper URL");
+    return;
+  }
+  char *proxy = pacparser_registry_find_proxy(w->reg, "pac", req->url, host);
+  free(url_host);
+  if (proxy)
+    squid_respond(w->queue, req->channel, "OK", proxy);
+  else if (pacparser_timed_out())
+    squid_respond(w->queue, req->channel, "ERR", "timed out");
+  else
+    squid_respond(w->queue, req->channel, "ERR", "could not find proxy");
+  free(proxy);
+}
+
+static void *squid_thread(void *arg)
+{
+  squid_worker *w = arg;
+  squid_queue *queue = w->queue;
+  for (;;) {
+    pac_mutex_lock(&queue->lock);
+    while (!queue->quit && queue->head == NULL)
+      pac_cond_wait(&queue->ready, &queue->lock);
+    squid_request *req = queue->head;
+    if (req) {
+      queue->head = req->next;
+      if (queue->head == NULL)
+        queue->tail = NULL;
+    }
+    pac_mutex_unlock(&queue->lock);
+    if (req == NULL)
+      break;  // Quit with an empty queue.
+    squid_answer(w, req);
+    free(req);
+  }
+  return NULL;
+}
+
+// Answers Squid helper requests read from stdin until the end of the input.
+int squid_helper(const char *pacfile, int jobs)
+{
+  squid_queue queue;
+  squid_worker workers[MAX_JOBS];
+  pac_thread_t threads[MAX_JOBS];
+  int started = 0, ok = 1;
+  char line[LINEMAX];
+
+  memset(&queue, 0, sizeof(queue));
+  pac_mutex_init(&queue.lock);
+  pac_mutex_init(&queue.out_lock);
+  pac_cond_init(&queue.ready);
+  for (; started < jobs; started++) {
+    squid_worker *w = &workers[started];
+    w->queue = &queue;
+    w->reg = new_pac_registry(pacfile, NULL);
+    if (w->reg == NULL ||
+        pac_thread_create(&threads[started], squid_thread, w) != 0) {
+      fprintf(stderr, "pactester.c: Could not start job %d\n", started + 1);
+      if (w->reg)
+        pacparser_registry_free(w->reg);
+      ok = 0;
+      break;
+    }
+  }
+
+  while (ok && fgets(line, sizeof(line), stdin)) {
+    size_t len = strlen(line);
+    int too_long = len == sizeof(line) - 1 && line[len - 1] != '\n';
+    if (too_long) {
+      int ch;
+      while ((ch = getchar()) != EOF && ch != '\n')
+        ;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    char *p = line;
+    char *channel = next_field(&p), *url;
+    if (channel == NULL)
+      continue;
+    if (channel[strspn(channel, "0123456789")] == '\0') {
+      url = next_field(&p);
+    } else {
+      // No channel ID: the first field is the URL.
+      url = channel;
+      channel = NULL;
+    }
+    char *host = next_field(&p);
+    if (too_long || url == NULL) {
+      squid_respond(&queue, channel, "ERR",
+                    too_long ? "line too long" : "no URL");
+      continue;
+    }
+    // Copy the fields into the request, after the struct itself.
+    size_t channel_len = channel ? strlen(channel) + 1 : 0;
+    size_t url_len = strlen(url) + 1;
+    size_t host_len = host ? strlen(host) + 1 : 0;
+    squid_request *req = malloc(sizeof(*req) + channel_len + url_len +
+                                host_len);
+    if (req == NULL) {
+      squid_respond(&queue, channel, "BH", "out of memory");
+      continue;
+    }
+    char *fields = (char *)(req + 1);
+    req->channel = channel ? memcpy(fields, channel, channel_len) : NULL;
+    req->url = memcpy(fields + channel_len, url, url_len);
+    req->host = host ? memcpy(fields + channel_len + url_len, host, host_len) :
+                       NULL;
+    req->next = NULL;
+    pac_mutex_lock(&queue.lock);
+    if (queue.tail)
+      queue.tail->next = req;
+    else
+      queue.head = req;
+    queue.tail = req;
+    pac_cond_signal(&queue.ready);
+    pac_mutex_unlock(&queue.lock);
+  }
+
+  pac_mutex_lock(&queue.lock);
+  queue.quit = 1;
+  pac_cond_broadcast(&queue.ready);
+  pac_mutex_unlock(&queue.lock);
+  for (int i = 0; i < started; i++) {
+    pac_thread_join(threads[i]);
+    add_job_coverage(workers[i].reg);
+    pacparser_registry_free(workers[i].reg);
+  }
+  pac_cond_destroy(&queue.ready);
+  pac_mutex_destroy(&queue.out_lock);
+  pac_mutex_destroy(&queue.lock);
+  return ok;
+}
+
+// Stub DNS (--dns-map).
+//
+// Hostnames are resolved from a file of 'hostname address...' lines instead
+// of the system resolver, so that results and timings don't depend on the
+// network. Names that are not in the file don't resolve.
+typedef struct {
+  char *name;          // Lower case.
+  char *addrs;         // ';' separated.
+} dns_entry;
+
+static dns_entry *dns_map = NULL;
+static int dns_map_count = 0;
+
+static int compare_dns_entry(const void *a, const void *b)
+{
+  return strcmp(((const dns_entry *)a)->name, ((const dns_entry *)b)->name);
+}
+
+// Loads the stub DNS mapping from path, or an empty one if path is NULL.
+int load_dns_map(const char *path)
+{
+  char line[LINEMAX];
+  int size = 0;
+  FILE *fp;
+  if (path == NULL)
+    return 1;
+  if (!(fp = fopen(path, "r"))) {
+    perror("pactester.c: Could not open the DNS map");
+    return 0;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *p = line;
+    char *name = next_field(&p);
+    if (name == NULL || *name == '#')
+      continue;
+    if (dns_map_count == size) {
+      size = size ? size * 2 : 64;
+      dns_entry *map = realloc(dns_map, size * sizeof(dns_entry));
+      if (map == NULL) {
+        perror("pactester.c: Failed to allocate the memory for the DNS map");
+        fclose(fp);
+        return 0;
+      }
+      dns_map = map;
+    }
+    dns_entry *e = &dns_map[dns_map_count++];
+    for (char *c = name; *c; c++)
+      *c = tolower((unsigned char)*c);
+    e->name = strdup(name);
+    // Join the addresses, whether separated by blanks or ';'.
+    e->addrs = strdup(p);
+    char *out = e->addrs;
+    for (char *addr; (addr = next_field(&p));) {
+      if (out != e->addrs)
+        *out++ = ';';
+      size_t len = strlen(addr);
+      memmove(out, addr, len);
+      out += len;
+    }
+    *out = '\0';
+  }
+  fclose(fp);
+  qsort(dns_map, dns_map_count, sizeof(dns_entry), compare_dns_entry);
+  return 1;
+}
+
+// pacparser_dns_resolver serving the addresses of the requested IP version
+// from the stub DNS mapping.
+static char *stub_resolve(const char *hostname, int ip_version, void *opaque)
+{
+  char name[256];
+  (void)opaque;
+  if (strlen(hostname) >= sizeof(name))
+    return NULL;
+  for (int i = 0; ; i++) {
+    name[i] = tolower((unsigned char)hostname[i]);
+    if (name[i] == '\0')
+      break;
+  }
+  dns_entry key = { name, NULL };
+  dns_entry *e = bsearch(&key, dns_map, dns_map_count, sizeof(dns_entry),
+                         compare_dns_entry);
+  if (e == NULL)
+    return NULL;
+  char *list = malloc(strlen(e->addrs) + 1), *out = list;
+  if (list == NULL)
+    return NULL;
+  for (const char *addr = e->addrs; *addr;) {
+    size_t len = strcspn(addr, ";");
+    int is_ipv6 = memchr(addr, ':', len) != NULL;
+    if (is_ipv6 == (ip_version == 6)) {
+      if (out != list)
+        *out++ = ';';
+      memcpy(out, addr, len);
+      out += len;
+    }
+    addr += len;
+    if (*addr == ';')
+      addr++;
+  }
+  *out = '\0';
+  return list;
+}
+
+// Benchmark mode (--bench).
+//
+// Loads the URLs of urlslist into memory and looks all of them up, warmup
+// times and then iterations times, on each of threads threads, each with its
+// own registry holding the PAC script. Latency percentiles are those of
+// pacparser_get_stats; allocations are counted by an allocator set with
+// pacparser_set_allocator.
+typedef struct {
+  char *url;
+  char *host;
+} bench_url;
+
+typedef struct {
+  const bench_url *urls;
+  int num_urls;
+  int passes;
+  pacparser_registry *reg;
+  unsigned long lookups, failures, allocations;
+} bench_worker;
+
+static PAC_THREAD_LOCAL unsigned long bench_allocations = 0;
+
+static void *bench_calloc(void *opaque, size_t count, size_t size)
+{
+  (void)opaque;
+  bench_allocations++;
+  return calloc(count, size);
+}
+
+static void *bench_malloc(void *opaque, size_t size)
+{
+  (void)opaque;
+  bench_allocations++;
+  return malloc(size);
+}
+
+static void bench_free(void *opaque, void *ptr)
+{
+  (void)opaque;
+  free(ptr);
+}
+
+static void *bench_realloc(void *opaque, void *ptr, size_t size)
+{
+  (void)opaque;
+  bench_allocations++;
+  return realloc(ptr, size);
+}
+
+static void *bench_thread(void *arg)
+{
+  bench_worker *w = arg;
+  bench_allocations = 0;
+  for (int pass = 0; pass < w->passes; pass++) {
+    for (int i = 0; i < w->num_urls; i++) {
+      char *proxy = pacparser_registry_find_proxy(w->reg, "pac",
+                                                  w->urls[i].url,
+                                                  w->urls[i].host);
+      if (proxy == NULL)
+        w->failures++;
+      free(proxy);
+      w->lookups++;
+    }
+  }
+  w->allocations = bench_allocations;
+  return NULL;
+}
+
+// Runs passes over the URLs on every worker's thread. Returns the wall time
+// in seconds, or a negative value if a thread could not be started.
+static double bench_run(bench_worker *workers, int threads, int passes)
+{
+  pac_thread_t tids[MAX_JOBS];
+  int started = 0;
+  int64_t start_ns = pac_now_ns();
+  for (; started < threads; started++) {
+    bench_worker *w = &workers[started];
+    w->passes = passes;
+    w->lookups = w->failures = w->allocations = 0;
+    if (pac_thread_create(&tids[started], bench_thread, w) != 0)
+      break;
+  }
+  for (int i = 0; i < started; i++)
+    pac_thread_join(tids[i]);
+  if (started < threads) {
+    fprintf(stderr, "pactester.c: Could not start benchmark thread %d\n",
+            started + 1);
+    return -1;
+  }
+  return (pac_now_ns() - start_ns) / 1e9;
+}
+
+// Peak resident set size of this process in KiB, or -1 if not known.
+static long peak_rss_kb(void)
+{
+#ifdef _WIN32
+  return -1;
+#else
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+#endif
+}
+
+// Benchmarks lookups of the URLs in fp and prints the results to stdout.
+// script is the PAC script if it was read from stdin, else pacfile is read.
+int run_bench(FILE *fp, const char *pacfile, const char *script, int threads,
+              int iterations, int warmup)
+{
+  static const pacparser_allocator counting = {
+    bench_calloc, bench_malloc, bench_free, bench_realloc, NULL, NULL,
+  };
+  bench_worker workers[MAX_JOBS];
+  bench_url *urls = NULL;
+  int num_urls = 0, size = 0, ok = 1, created = 0;
+  char line[LINEMAX];
+
+  while (fgets(line, sizeof(line), fp)) {
+    char *url = trim_url_line(line);
+    char *host;
+    if (*url == '#' || *url == '\0' || !(host = get_host_from_url(url)))
+      continue;
+    if (num_urls == size) {
+      size = size ? size * 2 : 1024;
+      bench_url *p = realloc(urls, size * sizeof(bench_url));
+      if (p == NULL) {
+        perror("pactester.c: Failed to allocate the memory for the URLs");
+        free(host);
+        ok = 0;
+        break;
+      }
+      urls = p;
+    }
+    urls[num_urls].url = strdup(url);
+    urls[num_urls++].host = host;
+  }
+  if (ok && num_urls == 0) {
+    fprintf(stderr, "pactester.c: No URLs to benchmark in the urlslist\n");
+    ok = 0;
+  }
+
+  pacparser_set_allocator(&counting);
+  for (; ok && created < threads; created++) {
+    bench_worker *w = &workers[created];
+    w->urls = urls;
+    w->num_urls = num_urls;
+    if (!(w->reg = new_pac_registry(pacfile, script))) {
+      fprintf(stderr, "pactester.c: Could not load the PAC file for "
+              "benchmark thread %d\n", created + 1);
+      ok = 0;
+      break;
+    }
+  }
+  if (ok && warmup > 0 && bench_run(workers, threads, warmup) < 0)
+    ok = 0;
+  pacparser_reset_stats();
+  double elapsed = ok ? bench_run(workers, threads, iterations) : -1;
+  if (elapsed < 0)
+    ok = 0;
+
+  if (ok) {
+    unsigned long lookups = 0, failures = 0, allocations = 0;
+    for (int i = 0; i < threads; i++) {
+      lookups += workers[i].lookups;
+      failures += workers[i].failures;
+      allocations += workers[i].allocations;
+    }
+    pacparser_stats stats;
+    pacparser_get_stats(&stats);
+    const pacparser_latency *l = &stats.find_proxy;
+    printf("Benchmark: %d URLs, %d warmup and %d measured iterations, "
+           "%d thread%s, stub DNS with %d names\n", num_urls, warmup,
+           iterations, threads, threads > 1 ? "s" : "", dns_map_count);
+    printf("  lookups/sec   %.0f\n", elapsed > 0 ? lookups / elapsed : 0.0);
+    printf("  lookups       %lu in %.3f s (%lu failed)\n", lookups, elapsed,
+           failures);
+    printf("  latency (us)  mean %lu  p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  "
+           "max %lu\n", l->mean_us, l->p50_us, l->p90_us, l->p99_us,
+           l->p999_us, l->max_us);
+    printf("  allocations   %.1f per lookup\n",
+           lookups ? (double)allocations / lookups : 0.0);
+    long rss = peak_rss_kb();
+    if (rss >= 0)
+      printf("  peak RSS      %ld KiB\n", rss);
+  }
+
+  for (int i = 0; i < created; i++) {
+    add_job_coverage(workers[i].reg);
+    pacparser_registry_free(workers[i].reg);
+  }
+  pacparser_set_allocator(NULL);
+  for (int i = 0; i < num_urls; i++) {
+    free(urls[i].url);
+    free(urls[i].host);
+  }
+  free(urls);
+  return ok;
+}
+
+// Differential evaluation (--diff).
+//
+// Evaluates every URL of urlslist with two PAC files, one thread and registry
+// each, batch by batch. Prints the URLs whose results differ, in the order of
+// urlslist, then how many URLs went from each old result to each new one and
+// how fast each PAC file was.
+typedef struct {
+  char *url;
+  char *host;          // NULL for lines without a proper URL.
+  char *result[2];     // Of the old and the new PAC file; NULL if failed.
+} diff_item;
+
+typedef struct {
+  pacparser_registry *reg;
+  const char *pacfile;
+  diff_item *items;
+  int count;
+  int side;            // 0 for the old PAC file, 1 for the new one.
+  int64_t busy_ns;
+  unsigned long lookups, failures;
+} diff_side;
+
+typedef struct transition {
+  char *from, *to;     // "(error)" for failed lookups.
+  unsigned long count;
+  struct transition *next;
+} transition;
+
+static void *diff_thread(void *arg)
+{
+  diff_side *d = arg;
+  int64_t start_ns = pac_now_ns();
+  for (int i = 0; i < d->count; i++) {
+    diff_item *item = &d->items[i];
+    if (item->host == NULL)
+      continue;
+    item->result[d->side] = pacparser_registry_find_proxy(d->reg, "pac",
+                                                          item->url,
+                                                          item->host);
+    d->lookups++;
+    if (item->result[d->side] == NULL)
+      d->failures++;
+  }
+  d->busy_ns += pac_now_ns() - start_ns;
+  return NULL;
+}
+
+static unsigned int hash_transition(const char *from, const char *to)
+{
+  unsigned int h = 5381;
+  for (const unsigned char *p = (const unsigned char *)from; *p; p++)
+    h = h * 33 + *p;
+  h = h * 33;
+  for (const unsigned char *p = (const unsigned char *)to; *p; p++)
+    h = h * 33 + *p;
+  return h % TRANSITION_BUCKETS;
+}
+
+// Counts one URL going from result from to result to.
+static int count_transition(transition **buckets, const char *from,
+                            const char *to)
+{
+  transition **pt = &buckets[hash_transition(from, to)];
+  while (*pt && !(STREQ((*pt)->from, from) && STREQ((*pt)->to, to)))
+    pt = &(*pt)->next;
+  if (*pt == NULL) {
+    transition *t = calloc(1, sizeof(transition));
+    if (t == NULL || !(t->from = strdup(from)) || !(t->to = strdup(to))) {
+      if (t)
+        free(t->from);
+      free(t);
+      return 0;
+    }
+    *pt = t;
+  }
+  (*pt)->count++;
+  return 1;
+}
+
+static int compare_transitions(const void *a, const void *b)
+{
+  const transition *x = *(const transition **)a, *y = *(const transition **)b;
+  if (x->count != y->count)
+    return x->count < y->count ? 1 : -1;
+  int c = strcmp(x->from, y->from);
+  return c ? c : strcmp(x->to, y->to);
+}
+
+static void print_diff_speed(const diff_side *d)
+{
+  double seconds = d->busy_ns / 1e9;
+  printf("  %-30s %10.0f lookups/s  mean %8.1f us  (%lu failed)\n", d->pacfile,
+         seconds > 0 ? d->lookups / seconds : 0.0,
+         d->lookups ? d->busy_ns / 1e3 / d->lookups : 0.0, d->failures);
+}
+
+// Diffs the results of old_pac and new_pac for the URLs in fp. Returns 0 if
+// they are the same for all URLs, 1 if they differ and 2 on error, like
+// diff(1).
+int run_diff(FILE *fp, const char *old_pac, const char *new_pac)
+{
+  diff_side sides[2];
+  transition *buckets[TRANSITION_BUCKETS] = { NULL };
+  unsigned long urls = 0, differ = 0, num_transitions = 0;
+  int status = 0;
+  char line[LINEMAX];
+  diff_item *items = calloc(BATCH_LINES, sizeof(diff_item));
+
+  memset(sides, 0, sizeof(sides));
+  for (int side = 0; side < 2; side++) {
+    diff_side *d = &sides[side];
+    d->pacfile = side ? new_pac : old_pac;
+    d->side = side;
+    d->items = items;
+    if (!(d->reg = new_pac_registry(d->pacfile, NULL))) {
+      fprintf(stderr, "pactester.c: Could not load the pac file: %s\n",
+              d->pacfile);
+      status = 2;
+    }
+  }
+  if (items == NULL) {
+    perror("pactester.c: Failed to allocate the memory for the URLs");
+    status = 2;
+  }
+
+  while (status != 2) {
+    int count = 0;
+    while (count < BATCH_LINES && fgets(line, sizeof(line), fp)) {
+      char *url = trim_url_line(line);
+      if (*url == '#' || *url == '\0')
+        continue;
+      diff_item *item = &items[count++];
+      item->url = strdup(url);
+      item->host = item->url ? get_host_from_url(item->url) : NULL;
+      item->result[0] = item->result[1] = NULL;
+    }
+    if (count == 0)
+      break;
+
+    // Evaluate the batch with both PAC files at the same time.
+    pac_thread_t threads[2];
+    int started = 0;
+    for (; started < 2; started++) {
+      sides[started].count = count;
+      if (pac_thread_create(&threads[started], diff_thread,
+                            &sides[started]) != 0)
+        break;
+    }
+    for (int i = 0; i < started; i++)
+      pac_thread_join(threads[i]);
+    if (started < 2) {
+      fprintf(stderr, "pactester.c: Could not start a diff thread\n");
+      status = 2;
+    }
+
+    for (int i = 0; i < count; i++) {
+      diff_item *item = &items[i];
+      if (status != 2 && item->host) {
+        const char *from = item->result[0] ? item->result[0] : "(error)";
+        const char *to = item->result[1] ? item->result[1] : "(error)";
+        urls++;
+        if (!STREQ(from, to)) {
+          printf("%s : %s -> %s\n", item->url, from, to);
+          differ++;
+          status = 1;
+        }
+        if (!count_transition(buckets, from, to)) {
+          perror("pactester.c: Failed to count result transitions");
+          status = 2;
+        }
+      }
+      free(item->url);
+      free(item->host);
+      free(item->result[0]);
+      free(item->result[1]);
+    }
+  }
+
+  if (status != 2) {
+    transition **all = NULL;
+    for (int i = 0; i < TRANSITION_BUCKETS; i++)
+      for (transition *t = buckets[i]; t; t = t->next)
+        num_transitions++;
+    if (num_transitions)
+      all = malloc(num_transitions * sizeof(transition *));
+    if (all) {
+      unsigned long n = 0;
+      for (int i = 0; i < TRANSITION_BUCKETS; i++)
+        for (transition *t = buckets[i]; t; t = t->next)
+          all[n++] = t;
+      qsort(all, n, sizeof(transition *), compare_transitions);
+    }
+    printf("%lu URLs, %lu with different results.\n", urls, differ);
+    printf("Transitions:\n");
+    for (unsigned long i = 0; all && i < num_transitions; i++) {
+      printf("  %10lu  %s%s -> %s\n", all[i]->count,
+             STREQ(all[i]->from, all[i]->to) ? "(same) " : "",
+             all[i]->from, all[i]->to);
+    }
+    free(all);
+    printf("Speed:\n");
+    print_diff_speed(&sides[0]);
+    print_diff_speed(&sides[1]);
+  }
+
+  for (int i = 0; i < TRANSITION_BUCKETS; i++) {
+    while (buckets[i]) {
+      transition *t = buckets[i];
+      buckets[i] = t->next;
+      free(t->from);
+      free(t->to);
+      free(t);
+    }
+  }
+  for (int side = 0; side < 2; side++)
+    if (sides[side].reg)
+      pacparser_registry_free(sides[side].reg);
+  free(items);
+  return status;
+}
+
+// Reports requested on the command line, printed by print_reports.
+static int show_stats = 0, show_builtin_stats = 0, show_coverage = 0;
+static char *profile_file = NULL;
+static char *stdin_script = NULL;  // PAC script read from stdin, if kept.
+
+void print_reports(const char *pacfile)
+{
+  char *script = stdin_script;
+  FILE *fp;
+  if ((profile_file || show_coverage) && script == NULL &&
+      (fp = fopen(pacfile, "r"))) {
+    script = read_stream(fp, 0);
+    fclose(fp);
+  }
+  if (profile_file) {
+    pacparser_stop_profile();
+    write_profile(profile_file, script);
+  }
+  if (show_coverage) print_coverage(script);
+  if (show_stats) print_stats();
+  if (show_builtin_stats) print_builtin_stats();
+  if (script != stdin_script) free(script);
 }
 
 int main(int argc, char* argv[])
 {
   char *pacfile = NULL, *url = NULL, *host = NULL, *urlslist = NULL,
        *client_ip = NULL;
+  int serve = 0, squid = 0, bench = 0;
+  int iterations = BENCH_ITERATIONS, warmup = BENCH_WARMUP;
+  char *dns_map_file = NULL, *diff_old = NULL;
+  long max_mb = PACMAX_MB;
+  int timeout_ms = 0, jobs = 1;
+  static const struct option long_options[] = {
+    {"stats", no_argument, NULL, 'S'},
+    {"builtin-stats", no_argument, NULL, 'B'},
+    {"profile", required_argument, NULL, 'P'},
+    {"coverage", no_argument, NULL, 'C'},
+    {"serve-stdio", no_argument, NULL, 'I'},
+    {"squid-helper", no_argument, NULL, 'Q'},
+    {"format", required_argument, NULL, 'F'},
+    {"bench", no_argument, NULL, 'K'},
+    {"iterations", required_argument, NULL, 'N'},
+    {"warmup", required_argument, NULL, 'W'},
+    {"threads", required_argument, NULL, 'j'},
+    {"dns-map", required_argument, NULL, 'D'},
+    {"diff", required_argument, NULL, 'd'},
+    {NULL, 0, NULL, 0}
+  };
 
   if (argv[1] && (STREQ(argv[1], "--help") || STREQ(argv[1], "--helpshort"))) {
     usage(argv[0]);
   }
 
   signed char c;
-  while ((c = getopt(argc, argv, "evp:u:h:f:c:")) != -1)
+  while ((c = getopt_long(argc, argv, "evp:u:h:f:c:m:t:j:", long_options,
+                          NULL)) != -1)
     switch (c)
     {
       case 'v':
@@ -116,8 +1613,59 @@ int main(int argc, char* argv[])
       case 'c':
         client_ip = optarg;
         break;
+      case 'm':
+        max_mb = atol(optarg);
+        if (max_mb < 0) usage(argv[0]);
+        break;
+      case 't':
+        timeout_ms = atoi(optarg);
+        if (timeout_ms <= 0) usage(argv[0]);
+        break;
+      case 'j':
+        jobs = atoi(optarg);
+        if (jobs < 1 || jobs > MAX_JOBS) usage(argv[0]);
+        break;
       case 'e':
         break;
+      case 'S':
+        show_stats = 1;
+        break;
+      case 'B':
+        show_builtin_stats = 1;
+        break;
+      case 'P':
+        profile_file = optarg;
+        break;
+      case 'C':
+        show_coverage = 1;
+        break;
+      case 'I':
+        serve = 1;
+        break;
+      case 'Q':
+        squid = 1;
+        break;
+      case 'F':
+        if (STREQ(optarg, "jsonl")) output_jsonl = 1;
+        else if (!STREQ(optarg, "text")) usage(argv[0]);
+        break;
+      case 'K':
+        bench = 1;
+        break;
+      case 'N':
+        iterations = atoi(optarg);
+        if (iterations < 1) usage(argv[0]);
+        break;
+      case 'W':
+        warmup = atoi(optarg);
+        if (warmup < 0) usage(argv[0]);
+        break;
+      case 'D':
+        dns_map_file = optarg;
+        break;
+      case 'd':
+        diff_old = optarg;
+        break;
       case '?':
         usage(argv[0]);
         /* fallthrough */
@@ -125,14 +1673,57 @@ int main(int argc, char* argv[])
         abort ();
     }
 
+  // --diff old.pac new.pac: the new PAC file is parsed like -p pacfile.
+  if (diff_old) {
+    if (pacfile || url || optind != argc - 1 || !urlslist || show_coverage ||
+        STREQ("-", diff_old) || STREQ("-", argv[optind])) {
+      fprintf(stderr, "pactester.c: --diff needs two PAC files and a "
+              "urlslist (-f), and no -p, -u or --coverage\n");
+      usage(argv[0]);
+    }
+    pacfile = argv[optind];
+  }
   if (!pacfile) {
     fprintf(stderr, "pactester.c: You didn't specify the PAC file\n");
     usage(argv[0]);
   }
-  if (!url && !urlslist) {
+  if (!url && !urlslist && !serve && !squid) {
     fprintf(stderr, "pactester.c: You didn't specify the URL\n");
     usage(argv[0]);
   }
+  if (STREQ("-", pacfile) &&
+      (serve || squid || (urlslist && STREQ("-", urlslist)))) {
+    fprintf(stderr, "pactester.c: The PAC file and the URLs can't both be "
+            "read from standard input\n");
+    usage(argv[0]);
+  }
+
+  if (bench && !urlslist) {
+    fprintf(stderr, "pactester.c: --bench needs a urlslist (-f)\n");
+    usage(argv[0]);
+  }
+
+  if (squid && output_jsonl) {
+    fprintf(stderr, "pactester.c: --format=jsonl doesn't apply to "
+            "--squid-helper\n");
+    usage(argv[0]);
+  }
+
+  // Benchmarks always use the stub DNS, if need be with no names in it.
+  if (dns_map_file || bench) {
+    if (!load_dns_map(dns_map_file))
+      return 1;
+    pacparser_set_dns_resolver(stub_resolve, NULL);
+  }
+
+  if (output_jsonl) {
+    pacparser_set_error_printer(capture_messages);
+    pacparser_set_trace_hook(trace_lookup, NULL, 1.0);
+  }
+  pacparser_set_timeout(timeout_ms);
+  pacparser_enable_builtin_stats(show_builtin_stats);
+  if (profile_file) pacparser_start_profile(PROFILE_INTERVAL_US);
+  pacparser_enable_coverage(show_coverage);
 
   // Initialize pacparser.
   if (!pacparser_init()) {
@@ -142,37 +1733,9 @@ int main(int argc, char* argv[])
 
   // Read pacfile from stdin.
   if (STREQ("-", pacfile)) {
-    char *script;
-    size_t script_size = 1;  // for the null terminator
-    char buffer[LINEMAX];
-
-    script = (char *) malloc(sizeof(char) * LINEMAX);
+    char *script = read_stream(stdin, (size_t)max_mb * 1024 * 1024);
     if (script == NULL) {
-      perror("pactetser.c: Failed to allocate the memory for the script");
-      return 1;
-    }
-    script[0] = '\0';                   // Null terminate to prepare for strcat
-
-    while (fgets(buffer, LINEMAX, stdin)) {
-      if (strlen(buffer) == 0)
-        break;
-      script_size += strlen(buffer);
-      if (script_size > PACMAX) {
-        fprintf(stderr, "Input file is too big. Maximum allowed size is: %d",
-                PACMAX);
-        exit(1);
-      }
-      script = realloc(script, script_size);
-      if (script == NULL) {
-        perror("pactester.c: Failed to allocate the memory for the script");
-        exit(1);
-      }
-      strcat(script, buffer);
-    }
-
-    if (ferror(stdin)) {
-      free(script);
-      perror("pactester.c: Error reading from stdin");
+      pacparser_cleanup();
       return 1;
     }
 
@@ -182,7 +1745,11 @@ int main(int argc, char* argv[])
       pacparser_cleanup();
       exit(1);
     }
-    free(script);
+    // Keep the script to show its lines in the reports and to load it into
+    // the engines of -j threads.
+    if (profile_file || show_coverage || (urlslist && (jobs > 1 || bench)))
+      stdin_script = script;
+    else free(script);
   }
   else {
     if (!pacparser_parse_pac_file(pacfile)) {
@@ -207,9 +1774,22 @@ int main(int argc, char* argv[])
     // function will print a proper error message in that case).
     host = host ? host: get_host_from_url(url);
     if (!host) {
+      if (output_jsonl) {
+        lookup_info info = { 0 };
+        print_jsonl(url, NULL, client_ip, NULL, "not a proper URL", &info);
+      }
       exit(1);
     }
+    lookup_info info;
+    lookup_begin(&info);
     proxy = pacparser_find_proxy(url, host);
+    lookup_end();
+    if (output_jsonl) {
+      print_jsonl(url, host, client_ip, proxy,
+                  pacparser_timed_out() ? "timed out" : NULL, &info);
+      print_reports(pacfile);
+      exit(proxy ? 0 : 1);
+    }
     if (proxy == NULL) {
       fprintf(stderr, "pactester.c: %s %s.\n",
               "Problem in finding proxy for", url);
@@ -217,36 +1797,94 @@ int main(int argc, char* argv[])
       exit(1);
     }
     printf("%s\n", proxy);
+    print_reports(pacfile);
+    exit(0);
+  }
+
+  if (squid) {
+    int ok = squid_helper(pacfile, jobs);
+    print_reports(pacfile);
+    pacparser_cleanup();
+    return ok ? 0 : 1;
+  }
+
+  if (serve) {
+    serve_stdio(client_ip);
+    print_reports(pacfile);
     exit(0);
   }
 
   if (urlslist) {
     char line[LINEMAX];
     FILE *fp;
-    if (!(fp = fopen(urlslist, "r"))) {
+    if (STREQ("-", urlslist)) {
+      fp = stdin;
+      // Write each result as soon as it's known when used as a coprocess.
+      setvbuf(stdout, NULL, _IOLBF, 0);
+    } else if (!(fp = fopen(urlslist, "r"))) {
       fprintf(stderr, "pactester.c: Could not open urlslist: %s", urlslist);
       pacparser_cleanup();
       exit(1);
     }
+    if (diff_old) {
+      int status = run_diff(fp, diff_old, pacfile);
+      fclose(fp);
+      if (status == 2) {
+        pacparser_cleanup();
+        exit(2);
+      }
+      print_reports(pacfile);
+      exit(status);
+    }
+    if (bench) {
+      int ok = run_bench(fp, pacfile, stdin_script, jobs, iterations, warmup);
+      fclose(fp);
+      if (!ok) {
+        pacparser_cleanup();
+        exit(1);
+      }
+      print_reports(pacfile);
+      exit(0);
+    }
+    if (jobs > 1) {
+      int ok = find_proxies_parallel(fp, pacfile, stdin_script, client_ip,
+                                     jobs);
+      fclose(fp);
+      if (!ok && !output_jsonl) {
+        pacparser_cleanup();
+        exit(1);
+      }
+      print_reports(pacfile);
+      exit(ok ? 0 : 1);
+    }
+    int failed = 0;
     while (fgets(line, sizeof(line), fp)) {
-      char *url = line;
-      // Remove spaces from the beginning.
-      while (*url == ' ' || *url == '\t')
-        url++;
+      char *url = trim_url_line(line);
       // Skip comment lines.
       if (*url == '#') {
-        printf("%s", url);
+        if (!output_jsonl)
+          printf("%s", url);
         continue;
       }
-      char *urlend = url;
-      while (*urlend != '\r' && *urlend != '\n' && *urlend != '\0' &&
-             *urlend != ' ' && *urlend != '\t')
-        urlend++;  // keep moving till you hit space or end of string
-      *urlend = '\0';
-      if (!(host = get_host_from_url(url)) )
+      lookup_info info = { 0 };
+      if (!(host = get_host_from_url(url)) ) {
+        if (output_jsonl)
+          print_jsonl(url, NULL, client_ip, NULL, "not a proper URL", &info);
         continue;
+      }
       proxy = NULL;
+      lookup_begin(&info);
       proxy = pacparser_find_proxy(url, host);
+      lookup_end();
+      if (output_jsonl) {
+        // Keep going after failed lookups; the error is in the output.
+        print_jsonl(url, host, client_ip, proxy,
+                    pacparser_timed_out() ? "timed out" : NULL, &info);
+        failed |= proxy == NULL;
+        free(host);
+        continue;
+      }
+      free(host);
       if (proxy == NULL) {
         fprintf(stderr, "pactester.c: %s %s.\n",
                 "Problem in finding proxy for", url);
@@ -257,7 +1895,8 @@ int main(int argc, char* argv[])
         printf("%s : %s\n", url, proxy);
     }
     fclose(fp);
-    exit(0);
+    print_reports(pacfile);
+    exit(failed);
   }
 
   pacparser_cleanup();
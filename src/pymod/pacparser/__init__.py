@@ -40,6 +40,14 @@ class URLError(Exception):
     super(URLError, self).__init__('URL: {} is not valid'.format(url))
     self.url = url
 
+def _host_from_url(url):
+  m = _URL_REGEX.match(url)
+  if not m:
+    raise URLError(url)
+  if len(m.groups()) == 1:
+    return m.groups()[0]
+  raise URLError(url)
+
 def init():
   """
   Initializes pacparser engine.
@@ -76,13 +84,7 @@ def find_proxy(url, host=None):
   defined, it's extracted from the url.
   """
   if host is None:
-    m = _URL_REGEX.match(url)
-    if not m:
-      raise URLError(url)
-    if len(m.groups()) == 1:
-      host = m.groups()[0]
-    else:
-      raise URLError(url)
+    host = _host_from_url(url)
   return _pacparser.find_proxy(url, host)
 
 def version():
@@ -101,15 +103,22 @@ def just_find_proxy(pacfile, url, host=None):
   """
   This function is a wrapper around init, parse_pac, find_proxy
   and cleanup. This is the function to call if you want to find
-  proxy just for one url.
+  proxy just for one url. Parsed pac files are cached (see
+  set_pac_cache_limits), so calling it in a loop for the same file
+  doesn't parse the file every time.
   """
   if not os.path.isfile(pacfile):
     raise IOError('Pac file does not exist: {}'.format(pacfile))
-  init()
-  parse_pac(pacfile)
-  proxy = find_proxy(url,host)
-  cleanup()
-  return proxy
+  if host is None:
+    host = _host_from_url(url)
+  return _pacparser.just_find_proxy(pacfile, url, host)
+
+def set_pac_cache_limits(max_entries, max_bytes):
+  """
+  Sets how many parsed pac files just_find_proxy keeps, and how much
+  memory they may use together. max_entries 0 disables the cache.
+  """
+  _pacparser.set_pac_cache_limits(max_entries, max_bytes)
 
 def setmyip(ip_address):
   """
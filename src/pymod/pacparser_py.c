@@ -105,6 +105,42 @@ py_pacparser_find_proxy(PyObject *self, PyObject *args)
   return Py_BuildValue("s", proxy);
 }
 
+// Finds proxy for the given PAC file, URL and Host.
+//
+// Uses the library's parsed PAC file cache, so calling it repeatedly for the
+// same file doesn't parse it again.
+static PyObject *                            // Proxy string or NULL if failed.
+py_pacparser_just_find_proxy(PyObject *self, PyObject *args)
+{
+  char *proxy;
+  const char *pacfile;
+  const char *url;
+  const char *host;
+  if (!PyArg_ParseTuple(args, "sss", &pacfile, &url, &host))
+    return NULL;
+  if(!(proxy = pacparser_just_find_proxy(pacfile, url, host)))
+  {
+    PyErr_SetString(PacparserError, "Could not find proxy");
+    return NULL;
+  }
+  PyObject *result = Py_BuildValue("s", proxy);
+  free(proxy);
+  return result;
+}
+
+// Sets the limits of the parsed PAC file cache.
+static PyObject *
+py_pacparser_set_pac_cache_limits(PyObject *self, PyObject *args)
+{
+  int max_entries;
+  Py_ssize_t max_bytes;
+  if (!PyArg_ParseTuple(args, "in", &max_entries, &max_bytes))
+    return NULL;
+  pacparser_set_pac_cache_limits(max_entries,
+                                 max_bytes < 0 ? 0 : (size_t)max_bytes);
+  Py_RETURN_NONE;
+}
+
 // Return pacparser version.
 static PyObject *                            // Version string.
 py_pacparser_version(PyObject *self, PyObject *args)
@@ -145,6 +181,10 @@ static PyMethodDef  PpMethods[] = {
   {"parse_pac_string", py_pacparser_parse_pac_string, METH_VARARGS,
     "parses pac script string"},
   {"find_proxy", py_pacparser_find_proxy, METH_VARARGS, "returns proxy string"},
+  {"just_find_proxy", py_pacparser_just_find_proxy, METH_VARARGS,
+    "returns proxy string for the given pac file"},
+  {"set_pac_cache_limits", py_pacparser_set_pac_cache_limits, METH_VARARGS,
+    "set parsed pac file cache limits"},
   {"version", py_pacparser_version, METH_VARARGS, "returns pacparser version"},
   {"cleanup", py_pacparser_cleanup, METH_VARARGS, "destroy pacparser engine"},
   {"setmyip", py_pacparser_setmyip, METH_VARARGS, "set my ip address"},
@@ -0,0 +1,609 @@
+// Copyright (C) 2024 Manu Garg.
+// Author: Manu Garg <manugarg@gmail.com>
+//
+// Micro-benchmarks for pacparser library.
+//
+// Build and run all benchmarks with:
+//   make -C src bench
+// or run selected ones:
+//   src/bench_pacparser parse_file
+//
+// Benchmarks fork a child per measured configuration so that peak RSS
+// numbers are not polluted by earlier runs. POSIX only.
+//
+// pacparser is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "pacparser.h"
+
+static double
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Peak resident set size of this process in KiB.
+static long
+peak_rss_kb(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+// Current resident set size of this process in KiB, or -1 where it isn't
+// available (it's read from /proc).
+static long
+rss_kb(void)
+{
+  long pages = -1;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL) return -1;
+  if (fscanf(fp, "%*d %ld", &pages) != 1) pages = -1;
+  fclose(fp);
+  return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Runs fn in a forked child and waits for it.
+static void
+run_in_child(void (*fn)(void *), void *arg)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    fn(arg);
+    fflush(stdout);
+    _exit(0);
+  }
+  if (pid > 0) waitpid(pid, NULL, 0);
+}
+
+static int
+quiet_printer(const char *fmt, va_list argp)
+{
+  (void)fmt;
+  (void)argp;
+  return 0;
+}
+
+// Writes a generated PAC file of roughly size_mb MiB and returns its path.
+static char *
+generate_pac(int size_mb)
+{
+  static char path[] = "/tmp/pacparser-bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    exit(1);
+  }
+  FILE *fp = fdopen(fd, "w");
+  long target = (long)size_mb * 1024 * 1024;
+  fprintf(fp, "function FindProxyForURL(url, host) {\n");
+  for (long i = 0; ftell(fp) < target; i++) {
+    fprintf(fp, "  if (shExpMatch(host, \"*.tenant%ld.example.com\")) "
+                "return \"PROXY proxy%ld.example.com:8080\";\n", i, i % 64);
+  }
+  fprintf(fp, "  return \"DIRECT\";\n}\n");
+  fclose(fp);
+  chmod(path, 0644);                // Like a deployed PAC file.
+  return path;
+}
+
+// parse_file: parse time and peak RSS of parsing a large PAC file, through
+// pacparser_parse_pac_file versus reading it into a heap string first.
+
+typedef struct {
+  const char *pacfile;
+  int via_string;
+} parse_file_arg;
+
+static void
+parse_file_child(void *p)
+{
+  parse_file_arg *arg = p;
+  pacparser_set_error_printer(quiet_printer);
+  pacparser_init();
+  long rss_before = peak_rss_kb();
+  long rss_now = rss_kb();
+  double start = now_ms();
+  int ok;
+  if (arg->via_string) {
+    FILE *fp = fopen(arg->pacfile, "rb");
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *script = malloc(size + 1);
+    script[fread(script, 1, size, fp)] = '\0';
+    fclose(fp);
+    ok = pacparser_parse_pac_string(script);
+    free(script);
+  } else {
+    ok = pacparser_parse_pac_file(arg->pacfile);
+  }
+  double elapsed = now_ms() - start;
+  // What stays resident after the parse, e.g. copies of the script.
+  long rss_after = rss_kb();
+  printf("  %-28s %s  parse %8.1f ms  peak RSS +%ld KiB  after +%ld KiB\n",
+         arg->via_string ? "read + parse_pac_string" : "parse_pac_file",
+         ok ? "ok    " : "FAILED", elapsed, peak_rss_kb() - rss_before,
+         rss_now < 0 || rss_after < 0 ? 0 : rss_after - rss_now);
+  pacparser_cleanup();
+}
+
+static void
+bench_parse_file(void)
+{
+  int size_mb = getenv("BENCH_PAC_MB") ? atoi(getenv("BENCH_PAC_MB")) : 16;
+  char *pacfile = generate_pac(size_mb);
+  printf("parse_file: %d MiB generated PAC\n", size_mb);
+  parse_file_arg args[] = { { pacfile, 1 }, { pacfile, 0 } };
+  for (int i = 0; i < 2; i++) run_in_child(parse_file_child, &args[i]);
+  unlink(pacfile);
+}
+
+// pactester_stdin: time for pactester to read a large PAC script from a pipe
+// (-p -). The script is mostly comments so that reading, not parsing,
+// dominates. Expects to be run from the src directory, or PACTESTER to point
+// to the pactester binary.
+
+static void
+bench_pactester_stdin(void)
+{
+  const char *pactester = getenv("PACTESTER") ? getenv("PACTESTER") :
+                          "./pactester";
+  int size_mb = 20;
+  char cmd[1024];
+  snprintf(cmd, sizeof(cmd), "%s -p - -m 0 -u http://example.com/ >/dev/null",
+           pactester);
+  char line[128];
+  memset(line, '/', sizeof(line) - 1);
+  line[sizeof(line) - 2] = '\n';
+  line[sizeof(line) - 1] = '\0';
+
+  printf("pactester_stdin: %d MiB script piped to %s\n", size_mb, pactester);
+  double start = now_ms();
+  FILE *fp = popen(cmd, "w");
+  if (fp == NULL) {
+    perror("popen");
+    return;
+  }
+  fprintf(fp, "function FindProxyForURL(url, host) { return \"DIRECT\"; }\n");
+  for (long written = 0; written < (long)size_mb * 1024 * 1024;
+       written += sizeof(line) - 1) {
+    fputs(line, fp);
+  }
+  int status = pclose(fp);
+  double elapsed = now_ms() - start;
+  printf("  %-28s %s  total %8.1f ms  %.1f MiB/s\n", "pactester -p -",
+         status == 0 ? "ok    " : "FAILED", elapsed, size_mb / (elapsed / 1e3));
+}
+
+// isolated: throughput of evaluating each lookup in a clean PAC state, by
+// tearing down and re-creating pacparser, through pacparser_just_find_proxy
+// without and with its parsed PAC file cache, and with isolated lookups;
+// plain lookups in a shared context for reference.
+
+#define ISOLATED_PAC \
+  "var lookups = 0;\n" \
+  "var corp = [\"intranet\", \"corp\", \"internal\", \"local\"];\n" \
+  "function FindProxyForURL(url, host) {\n" \
+  "  lookups++;\n" \
+  "  for (var i = 0; i < corp.length; i++) {\n" \
+  "    if (dnsDomainIs(host, \".\" + corp[i])) return \"DIRECT\";\n" \
+  "  }\n" \
+  "  if (isPlainHostName(host)) return \"DIRECT\";\n" \
+  "  if (shExpMatch(url, \"https://*\")) return \"PROXY secure:3128\";\n" \
+  "  return \"PROXY proxy:3128; DIRECT\";\n" \
+  "}\n"
+
+static void
+isolated_child(void *p)
+{
+  int mode = *(int *)p;
+  static const char *names[] = {
+    "init + parse + cleanup", "just_find_proxy", "just_find_proxy cached",
+    "isolated lookups", "shared context",
+  };
+  static char pacfile[] = "/tmp/pacparser-bench-XXXXXX";
+  int fd = mkstemp(pacfile);
+  if (fd < 0 || write(fd, ISOLATED_PAC, strlen(ISOLATED_PAC)) < 0) {
+    perror("pacfile");
+    return;
+  }
+  close(fd);
+  pacparser_set_error_printer(quiet_printer);
+  if (mode == 1) pacparser_set_pac_cache_limits(0, 0);
+  if (mode >= 3) {
+    pacparser_set_isolated_lookups(mode == 3);
+    pacparser_init();
+    pacparser_parse_pac_string(ISOLATED_PAC);
+  }
+  int n = 0, ok = 1;
+  double start = now_ms(), elapsed;
+  do {
+    for (int i = 0; i < 10; i++, n++) {
+      char *proxy;
+      switch (mode) {
+        case 0:
+          pacparser_init();
+          pacparser_parse_pac_string(ISOLATED_PAC);
+          ok &= pacparser_find_proxy("http://www.example.com/",
+                                     "www.example.com") != NULL;
+          pacparser_cleanup();
+          break;
+        case 1:
+        case 2:
+          proxy = pacparser_just_find_proxy(pacfile, "http://www.example.com/",
+                                            "www.example.com");
+          ok &= proxy != NULL;
+          free(proxy);
+          break;
+        default:
+          ok &= pacparser_find_proxy("http://www.example.com/",
+                                     "www.example.com") != NULL;
+      }
+    }
+    elapsed = now_ms() - start;
+  } while (elapsed < 1000);
+  printf("  %-28s %s  %8.1f us/lookup  %8.0f lookups/s\n", names[mode],
+         ok ? "ok    " : "FAILED", elapsed * 1e3 / n, n / (elapsed / 1e3));
+  if (mode >= 3) pacparser_cleanup();
+  unlink(pacfile);
+}
+
+static void
+bench_isolated(void)
+{
+  printf("isolated: lookups in a clean PAC state\n");
+  for (int mode = 0; mode < 5; mode++) run_in_child(isolated_child, &mode);
+}
+
+// allocator: QuickJS allocations per lookup, and lookup throughput with the
+// C library's malloc versus the pool allocator, with 1 to BENCH_THREADS
+// (default 4) threads each running its own engine. Each thread looks up URLs
+// with pacparser_just_find_proxy on its own PAC file, so that the engines are
+// kept in the parsed PAC file cache.
+
+#define ALLOCATOR_PAC \
+  "function FindProxyForURL(url, host) {\n" \
+  "  var parts = host.toLowerCase().split(\".\");\n" \
+  "  var path = url.substring(url.indexOf(\"/\", 8));\n" \
+  "  if (parts.length < 2 || isPlainHostName(host)) return \"DIRECT\";\n" \
+  "  if (/^\\/(api|static)\\//.test(path)) return \"PROXY fast:3128\";\n" \
+  "  if (weekdayRange(\"MON\", \"FRI\") && timeRange(8, 18))\n" \
+  "    return \"PROXY \" + parts.slice(-2).join(\"-\") + \":3128\";\n" \
+  "  return [\"PROXY a:3128\", \"PROXY b:3128\", \"DIRECT\"].join(\"; \");\n" \
+  "}\n"
+
+static volatile long allocations;
+
+static void *
+counting_calloc(void *opaque, size_t count, size_t size)
+{
+  (void)opaque;
+  __sync_fetch_and_add(&allocations, 1);
+  return calloc(count, size);
+}
+
+static void *
+counting_malloc(void *opaque, size_t size)
+{
+  (void)opaque;
+  __sync_fetch_and_add(&allocations, 1);
+  return malloc(size);
+}
+
+static void
+counting_free(void *opaque, void *ptr)
+{
+  (void)opaque;
+  free(ptr);
+}
+
+static void *
+counting_realloc(void *opaque, void *ptr, size_t size)
+{
+  (void)opaque;
+  __sync_fetch_and_add(&allocations, 1);
+  return realloc(ptr, size);
+}
+
+typedef struct {
+  char pacfile[64];
+  int lookups;
+} allocator_thread_arg;
+
+static void *
+allocator_thread(void *p)
+{
+  allocator_thread_arg *arg = p;
+  static const char *urls[] = {
+    "http://www.example.com/index.html", "https://api.example.org/api/v1",
+    "http://intranet/", "http://cdn.example.net/static/app.js",
+  };
+  for (int i = 0; i < arg->lookups; i++) {
+    const char *url = urls[i % 4];
+    char host[64];
+    sscanf(strstr(url, "//") + 2, "%63[^/]", host);
+    free(pacparser_just_find_proxy(arg->pacfile, url, host));
+  }
+  return NULL;
+}
+
+static void
+allocator_child(void *p)
+{
+  int use_pool = *(int *)p;
+  int max_threads = getenv("BENCH_THREADS") ? atoi(getenv("BENCH_THREADS")) : 4;
+  if (max_threads < 1) max_threads = 1;
+  if (max_threads > 64) max_threads = 64;
+  int lookups = 20000;
+  allocator_thread_arg args[64];
+  pthread_t threads[64];
+  for (int t = 0; t < max_threads; t++) {
+    snprintf(args[t].pacfile, sizeof(args[t].pacfile),
+             "/tmp/pacparser-bench-XXXXXX");
+    int fd = mkstemp(args[t].pacfile);
+    if (fd < 0 || write(fd, ALLOCATOR_PAC, strlen(ALLOCATOR_PAC)) < 0) {
+      perror("pacfile");
+      return;
+    }
+    close(fd);
+  }
+  pacparser_set_error_printer(quiet_printer);
+  pacparser_set_pac_cache_limits(max_threads, 1 << 30);
+
+  if (use_pool) {
+    pacparser_set_pool_allocator(1);
+  } else {
+    // Count allocations on a single thread first.
+    pacparser_allocator counting = {
+      counting_calloc, counting_malloc, counting_free, counting_realloc,
+      NULL, NULL,
+    };
+    pacparser_set_allocator(&counting);
+    args[0].lookups = 100;
+    allocator_thread(&args[0]);     // Warm up: parses the PAC file.
+    allocations = 0;
+    args[0].lookups = 1000;
+    allocator_thread(&args[0]);
+    printf("  %-28s %8.1f allocations/lookup\n", "QuickJS",
+           allocations / 1000.0);
+    pacparser_clear_pac_cache();
+    pacparser_set_allocator(NULL);
+  }
+
+  for (int n = 1; n <= max_threads; n *= 2) {
+    for (int t = 0; t < n; t++) {
+      args[t].lookups = 100;
+      allocator_thread(&args[t]);   // Warm up: parses the PAC file.
+      args[t].lookups = lookups;
+    }
+    double start = now_ms();
+    for (int t = 0; t < n; t++) {
+      pthread_create(&threads[t], NULL, allocator_thread, &args[t]);
+    }
+    for (int t = 0; t < n; t++) pthread_join(threads[t], NULL);
+    double elapsed = now_ms() - start;
+    printf("  %-8s %2d threads             %8.0f lookups/s  peak RSS %ld KiB\n",
+           use_pool ? "pool" : "malloc", n, n * lookups / (elapsed / 1e3),
+           peak_rss_kb());
+  }
+  pacparser_clear_pac_cache();
+  for (int t = 0; t < max_threads; t++) unlink(args[t].pacfile);
+}
+
+static void
+bench_allocator(void)
+{
+  printf("allocator: malloc versus pool allocator\n");
+  for (int use_pool = 0; use_pool < 2; use_pool++) {
+    run_in_child(allocator_child, &use_pool);
+  }
+}
+
+// profile: pacparser_init time and memory per engine or registry context
+// with the full and the minimal engine profile.
+
+static void
+profile_child(void *p)
+{
+  int profile = *(int *)p;
+  const char *name = profile == PACPARSER_PROFILE_MINIMAL ? "minimal" : "full";
+  pacparser_set_error_printer(quiet_printer);
+  pacparser_set_engine_profile(profile);
+  pacparser_init();                 // Warm up: compiles pac_utils.
+  pacparser_cleanup();
+
+  int n = 0;
+  double start = now_ms(), elapsed;
+  do {
+    pacparser_init();
+    pacparser_cleanup();
+    n++;
+    elapsed = now_ms() - start;
+  } while (elapsed < 1000);
+  pacparser_memory_stats usage;
+  pacparser_init();
+  pacparser_memory_usage(&usage);
+  pacparser_cleanup();
+  printf("  %-8s pacparser_init %8.1f us  engine %7zu bytes (%zu objects)\n",
+         name, elapsed * 1e3 / n, usage.malloc_size, usage.obj_count);
+
+  int tenants = 200;
+  pacparser_registry *reg = pacparser_registry_new();
+  pacparser_registry_set_profile(reg, profile);
+  char id[32];
+  for (int i = 0; i < tenants; i++) {
+    snprintf(id, sizeof(id), "tenant%d", i);
+    pacparser_registry_load_string(reg, id,
+        "function FindProxyForURL(url, host) { return \"DIRECT\"; }");
+  }
+  printf("  %-8s registry context %7ld bytes/tenant\n", name,
+         pacparser_registry_memory_usage(reg, NULL) / tenants);
+  pacparser_registry_free(reg);
+}
+
+static void
+bench_profile(void)
+{
+  printf("profile: full versus minimal engine profile\n");
+  int profiles[] = { PACPARSER_PROFILE_FULL, PACPARSER_PROFILE_MINIMAL };
+  for (int i = 0; i < 2; i++) run_in_child(profile_child, &profiles[i]);
+}
+
+// registry: memory and lookup throughput of many small PAC scripts loaded
+// into one pacparser_registry (BENCH_TENANTS, default 1000).
+
+static void
+registry_child(void *p)
+{
+  int tenants = *(int *)p;
+  pacparser_set_error_printer(quiet_printer);
+  long rss_before = peak_rss_kb();
+  double start = now_ms();
+  pacparser_registry *reg = pacparser_registry_new();
+  char id[32], script[512];
+  for (int i = 0; i < tenants; i++) {
+    snprintf(id, sizeof(id), "tenant%d", i);
+    snprintf(script, sizeof(script),
+             "function FindProxyForURL(url, host) {\n"
+             "  if (isPlainHostName(host) || dnsDomainIs(host, \".corp%d\"))\n"
+             "    return \"DIRECT\";\n"
+             "  if (shExpMatch(url, \"*://*.example.com/*\"))\n"
+             "    return \"PROXY proxy%d.example.com:8080\";\n"
+             "  return \"PROXY default.example.com:3128; DIRECT\";\n"
+             "}\n", i, i % 16);
+    if (!pacparser_registry_load_string(reg, id, script)) {
+      printf("  load failed for %s\n", id);
+      return;
+    }
+  }
+  double load_ms = now_ms() - start;
+  long total = pacparser_registry_memory_usage(reg, NULL);
+  printf("  load %d tenants %8.1f ms  registry %ld KiB (%ld bytes/tenant)  "
+         "peak RSS +%ld KiB\n", tenants, load_ms, total / 1024,
+         total / tenants, peak_rss_kb() - rss_before);
+
+  int lookups = 100000;
+  start = now_ms();
+  for (int i = 0; i < lookups; i++) {
+    snprintf(id, sizeof(id), "tenant%d", i % tenants);
+    free(pacparser_registry_find_proxy(reg, id, "http://www.example.com/",
+                                       "www.example.com"));
+  }
+  double elapsed = now_ms() - start;
+  printf("  %d lookups across tenants  %8.1f ms  %.0f lookups/s\n", lookups,
+         elapsed, lookups / (elapsed / 1e3));
+
+  int evicted = pacparser_registry_evict_idle(reg, 0);
+  printf("  evicted %d idle tenants  registry %ld KiB\n", evicted,
+         pacparser_registry_memory_usage(reg, NULL) / 1024);
+  start = now_ms();
+  for (int i = 0; i < tenants; i++) {
+    snprintf(id, sizeof(id), "tenant%d", i);
+    free(pacparser_registry_find_proxy(reg, id, "http://www.example.com/",
+                                       "www.example.com"));
+  }
+  printf("  reload on first lookup  %8.1f us/tenant\n",
+         (now_ms() - start) * 1e3 / tenants);
+  pacparser_registry_free(reg);
+}
+
+static void
+bench_registry(void)
+{
+  int tenants = getenv("BENCH_TENANTS") ? atoi(getenv("BENCH_TENANTS")) : 1000;
+  if (tenants < 1) tenants = 1;
+  printf("registry: %d tenants in one registry\n", tenants);
+  run_in_child(registry_child, &tenants);
+}
+
+// logging: lookup throughput with logging off and at debug level (into a
+// printer that discards messages), and the cost of the getenv() call that
+// used to be made on every debug check, for reference.
+
+static void
+logging_child(void *p)
+{
+  int level = *(int *)p;
+  pacparser_set_error_printer(quiet_printer);
+  pacparser_set_log_level(level);
+  pacparser_init();
+  pacparser_parse_pac_string(ISOLATED_PAC);
+  int n = 0;
+  double start = now_ms(), elapsed;
+  do {
+    for (int i = 0; i < 100; i++, n++) {
+      pacparser_find_proxy("http://www.example.com/", "www.example.com");
+    }
+    elapsed = now_ms() - start;
+  } while (elapsed < 1000);
+  printf("  %-20s %8.2f us/lookup  %8.0f lookups/s\n",
+         level == PACPARSER_LOG_DEBUG ? "log level debug" : "log level error",
+         elapsed * 1e3 / n, n / (elapsed / 1e3));
+  pacparser_cleanup();
+}
+
+static void
+bench_logging(void)
+{
+  printf("logging: per-lookup overhead of the log level check\n");
+  int levels[] = { PACPARSER_LOG_ERROR, PACPARSER_LOG_DEBUG };
+  for (int i = 0; i < 2; i++) run_in_child(logging_child, &levels[i]);
+
+  int checks = 1000000, set = 0;
+  double start = now_ms();
+  for (int i = 0; i < checks; i++) {
+    set += getenv("PACPARSER_DEBUG") != NULL;
+  }
+  printf("  %-20s %8.1f ns/check%s\n", "getenv per check",
+         (now_ms() - start) * 1e6 / checks, set ? " (set)" : "");
+}
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} benchmarks[] = {
+  { "parse_file", bench_parse_file },
+  { "pactester_stdin", bench_pactester_stdin },
+  { "isolated", bench_isolated },
+  { "registry", bench_registry },
+  { "allocator", bench_allocator },
+  { "profile", bench_profile },
+  { "logging", bench_logging },
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int
+main(int argc, char *argv[])
+{
+  for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+    int selected = argc < 2;
+    for (int j = 1; j < argc; j++) {
+      if (strcmp(argv[j], benchmarks[i].name) == 0) selected = 1;
+    }
+    if (selected) benchmarks[i].run();
+  }
+  return 0;
+}
@@ -77,6 +77,26 @@ def runtests(pacfile, testdata, tests_dir):
     if result != expected_result:
       raise Exception('Tests failed. Got "%s", expected "%s"' % (result, expected_result))
 
+  # just_find_proxy keeps parsed pac files cached; repeated calls, and calls
+  # after the file changes, must give the same results as a fresh parse.
+  for _ in range(3):
+    result = pacparser.just_find_proxy(pacfile, 'http://host1')
+    if result != 'plainhost/.manugarg.com':
+      raise Exception('just_find_proxy test failed: got "%s"' % result)
+  with tempfile.NamedTemporaryFile(mode='w', suffix='.pac',
+                                   delete=False) as tmp_pac:
+    tmp_pac.write('function FindProxyForURL(url, host) { return "A"; }\n')
+  try:
+    first = pacparser.just_find_proxy(tmp_pac.name, 'http://host1')
+    with open(tmp_pac.name, 'w') as f:
+      f.write('function FindProxyForURL(url, host) { return "BB"; }\n')
+    second = pacparser.just_find_proxy(tmp_pac.name, 'http://host1')
+  finally:
+    os.unlink(tmp_pac.name)
+  if (first, second) != ('A', 'BB'):
+    raise Exception('just_find_proxy cache test failed: got %s, %s' %
+                    (first, second))
+
   # Logging test: alert() / console.log() should emit to the C library's
   # stderr. The extension writes directly via vfprintf, so redirect at the
   # file-descriptor level rather than via sys.stderr.
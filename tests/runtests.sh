@@ -79,4 +79,219 @@ if [ "$actual_stderr" != "$expected_stderr" ]; then
   exit 1
 fi
 
+# Reading the PAC script from standard input.
+stdin_result=$($pactester -p - -c 10.10.100.112 -u http://www.somehost.com < $pacfile)
+if [ "$stdin_result" != "10.10.0.0" ]; then
+  echo "Stdin test failed: got \"$stdin_result\", expected \"10.10.0.0\""
+  exit 1
+fi
+if $pactester -p - -m 0 -u http://www.somehost.com < /dev/null 2>/dev/null; then
+  echo "Stdin test failed: empty script was accepted"
+  exit 1
+fi
+# -m 1 accepts a script of exactly 1 MiB and rejects one byte more.
+mib_pac=$(mktemp)
+{ head -c $((1024 * 1024 - 57)) /dev/zero | tr '\0' ' '
+  printf '%s\n' 'function FindProxyForURL(url, host) { return "DIRECT"; }'
+} > $mib_pac
+mib_result=$($pactester -p - -m 1 -u http://www.somehost.com < $mib_pac)
+if [ "$(wc -c < $mib_pac)" != 1048576 ] || [ "$mib_result" != "DIRECT" ] ||
+   { echo >> $mib_pac; $pactester -p - -m 1 -u http://www.somehost.com < $mib_pac 2>/dev/null; }; then
+  echo "Stdin test failed: -m 1 limit not applied at exactly 1 MiB"
+  rm -f $mib_pac
+  exit 1
+fi
+rm -f $mib_pac
+
+# Lookup timeout: an endless loop in FindProxyForURL must be aborted.
+loop_pac=$(mktemp)
+echo 'function FindProxyForURL(url, host) { while (true) {} }' > $loop_pac
+if $pactester -p $loop_pac -t 100 -u http://www.somehost.com 2>/dev/null; then
+  echo "Timeout test failed: endless loop did not fail"
+  rm -f $loop_pac
+  exit 1
+fi
+squid_timeout=$(echo "0 http://www.somehost.com/" |
+  $pactester -p $loop_pac -t 100 --squid-helper -j 2 2>/dev/null)
+if [ "$squid_timeout" != '0 ERR message="timed out"' ]; then
+  echo "Timeout test failed: Squid helper answered \"$squid_timeout\""
+  rm -f $loop_pac
+  exit 1
+fi
+timeout_urls=$(mktemp)
+printf '%s\n' "http://a.somehost.com/" "http://b.somehost.com/" > $timeout_urls
+jsonl_timeout=$($pactester -p $loop_pac -t 100 -f $timeout_urls -j 2 \
+  --format=jsonl 2>/dev/null)
+rm -f $timeout_urls
+if [ "$(echo "$jsonl_timeout" | grep -c '"result":null,"error":"timed out"')" != 2 ]; then
+  echo "Timeout test failed: -j JSON Lines output was:"
+  echo "$jsonl_timeout"
+  rm -f $loop_pac
+  exit 1
+fi
+rm -f $loop_pac
+
+# Latency statistics go to stderr and leave the result on stdout alone.
+stats_stderr=$(mktemp)
+stats_result=$($pactester -p $pacfile -c 10.10.100.112 -u http://www.somehost.com --stats 2>$stats_stderr)
+if [ "$stats_result" != "10.10.0.0" ] ||
+   ! grep -q "^  find_proxy  *1 calls" $stats_stderr; then
+  echo "Stats test failed: got \"$stats_result\" and:"
+  cat $stats_stderr
+  rm -f $stats_stderr
+  exit 1
+fi
+rm -f $stats_stderr
+
+# Builtin statistics: every builtin the lookup called is reported.
+builtin_stats=$($pactester -p $pacfile -c 10.10.100.112 -u http://www.somehost.com --builtin-stats 2>&1 >/dev/null)
+if ! echo "$builtin_stats" | grep -q "^isInNet  *[1-9]"; then
+  echo "Builtin stats test failed, got:"
+  echo "$builtin_stats"
+  exit 1
+fi
+
+# Profiling: samples of a busy PAC script are written as folded stacks.
+busy_pac=$(mktemp)
+profile_out=$(mktemp)
+cat > $busy_pac <<'EOF'
+function FindProxyForURL(url, host) {
+  for (var i = 0; i < 20000; i++) shExpMatch(host, "*.example" + i + ".com");
+  return "DIRECT";
+}
+EOF
+profile_result=$($pactester -p $busy_pac -u http://www.somehost.com --profile $profile_out 2>/dev/null)
+if [ "$profile_result" != "DIRECT" ] ||
+   ! grep -q "^findProxyForURL;FindProxyForURL:2;shExpMatch.* [0-9][0-9]*$" $profile_out; then
+  echo "Profile test failed: got \"$profile_result\" and:"
+  cat $profile_out
+  rm -f $busy_pac $profile_out
+  exit 1
+fi
+rm -f $busy_pac $profile_out
+
+# Coverage: the hit rule is counted along with the if conditions before it.
+coverage=$($pactester -p - -c 10.10.100.112 -u http://www.somehost.com --coverage < $pacfile 2>&1 >/dev/null)
+if ! echo "$coverage" | grep -q "^ *1  *100.0%  *8.0  30:59: if (isInNet"; then
+  echo "Coverage test failed, got:"
+  echo "$coverage"
+  exit 1
+fi
+
+# Parallel batch mode: -j prints the same results, in the same order, as a
+# single thread.
+urlslist=$(mktemp)
+{
+  echo "# comment"
+  for i in $(seq 1 200); do
+    echo "http://www$i.manugarg.com/"
+    echo "http://host$i/"
+  done
+} > $urlslist
+serial_result=$($pactester -p $pacfile -c 10.10.100.112 -f $urlslist)
+parallel_result=$($pactester -p $pacfile -c 10.10.100.112 -f $urlslist -j 4)
+rm -f $urlslist
+if [ -z "$serial_result" ] || [ "$serial_result" != "$parallel_result" ]; then
+  echo "Parallel batch test failed, got:"
+  echo "$parallel_result" | head
+  exit 1
+fi
+
+# Serve mode: one answer per request line, with optional host and client IP.
+serve_result=$(printf '%s\n' "http://www1.manugarg.com/" "# comment" \
+  "http://x.com/ x.com 10.10.100.112" "notaurl" "http://x.com/" |
+  $pactester -p $pacfile --serve-stdio -c 0.0.0.0 2>/dev/null)
+expected_serve_result=$(printf '%s\n' "plainhost/.manugarg.com" "10.10.0.0" \
+  "ERROR not a proper URL" "END-OF-SCRIPT")
+if [ "$serve_result" != "$expected_serve_result" ]; then
+  echo "Serve mode test failed, got:"
+  echo "$serve_result"
+  exit 1
+fi
+
+# Squid helper mode: answers are tagged with their channel IDs.
+squid_result=$(printf '%s\n' "0 http://www1.manugarg.com/" "1 http://x.com/ x.com" \
+  "2 notaurl" | $pactester -p $pacfile --squid-helper -j 2 -c 10.10.100.112 2>/dev/null |
+  sort)
+expected_squid_result=$(printf '%s\n' '0 OK message="plainhost/.manugarg.com"' \
+  '1 OK message="10.10.0.0"' '2 ERR message="not a proper URL"')
+if [ "$squid_result" != "$expected_squid_result" ]; then
+  echo "Squid helper test failed, got:"
+  echo "$squid_result"
+  exit 1
+fi
+
+# JSON Lines output: one object per URL, failures included.
+jsonl_urls=$(mktemp)
+printf '%s\n' "# comment" "http://www1.manugarg.com/" "notaurl" > $jsonl_urls
+jsonl_result=$($pactester -p $pacfile -f $jsonl_urls --format=jsonl 2>/dev/null)
+rm -f $jsonl_urls
+if [ "$(echo "$jsonl_result" | wc -l)" != 2 ] ||
+   ! echo "$jsonl_result" | grep -q '^{"url":"http://www1.manugarg.com/","host":"www1.manugarg.com","client_ip":null,"result":"plainhost/.manugarg.com","error":null,"eval_us":[0-9]*,"dns_lookups":[0-9]*,"dns_us":[0-9]*}$' ||
+   ! echo "$jsonl_result" | grep -q '^{"url":"notaurl","host":null,.*"result":null,"error":"not a proper URL",'; then
+  echo "JSON Lines test failed, got:"
+  echo "$jsonl_result"
+  exit 1
+fi
+
+# Benchmark mode with stub DNS: every lookup resolves from the DNS map.
+dns_map=$(mktemp)
+bench_urls=$(mktemp)
+echo "www.google.com 10.10.1.1" > $dns_map
+printf '%s\n' "http://www.google.com/" "http://host1/" > $bench_urls
+bench_result=$($pactester -p $pacfile -f $bench_urls --bench --iterations 3 --warmup 1 --threads 2 --dns-map $dns_map)
+dns_result=$($pactester -p $pacfile -u http://www.google.com/ --dns-map $dns_map)
+rm -f $dns_map $bench_urls
+if ! echo "$bench_result" | grep -q "^  lookups  *12 in .* (0 failed)$" ||
+   ! echo "$bench_result" | grep -q "^  allocations  *[0-9.]* per lookup$" ||
+   [ "$dns_result" != "isResolvable" ]; then
+  echo "Benchmark test failed, got \"$dns_result\" and:"
+  echo "$bench_result"
+  exit 1
+fi
+
+# Differential evaluation: a PAC file against a copy with a different default.
+new_pacfile=$(mktemp)
+diff_urls=$(mktemp)
+sed "s/'END-OF-SCRIPT'/'PROXY new:8080'/" $pacfile > $new_pacfile
+printf '%s\n' "http://www.somehost.com/" "http://host1/" "http://www.somehost.com/a" > $diff_urls
+diff_result=$($pactester --diff $pacfile $new_pacfile -f $diff_urls)
+diff_status=$?
+same_result=$($pactester --diff $pacfile $pacfile -f $diff_urls)
+same_status=$?
+rm -f $new_pacfile $diff_urls
+if [ $diff_status != 1 ] || [ $same_status != 0 ] ||
+   ! echo "$diff_result" | grep -q "^http://www.somehost.com/a : END-OF-SCRIPT -> PROXY new:8080$" ||
+   ! echo "$diff_result" | grep -q "^3 URLs, 2 with different results.$" ||
+   ! echo "$diff_result" | grep -q "^  *2  END-OF-SCRIPT -> PROXY new:8080$" ||
+   ! echo "$same_result" | grep -q "^3 URLs, 0 with different results.$"; then
+  echo "Diff test failed, got status $diff_status and $same_status:"
+  echo "$diff_result"
+  echo "$same_result"
+  exit 1
+fi
+
+# PAC files are memory-mapped; one whose size is a multiple of the page size
+# has no zero bytes after it in its last page.
+paged_pac=$(mktemp)
+cp $pacfile $paged_pac
+page_size=$(getconf PAGESIZE)
+pad=$((page_size - $(wc -c < $paged_pac) % page_size))
+[ $pad -lt 3 ] && pad=$((pad + page_size))
+{ printf '//'; head -c $((pad - 3)) /dev/zero | tr '\0' x; echo; } >> $paged_pac
+paged_result=$($pactester -p $paged_pac -u http://www1.manugarg.com/)
+paged_size=$(wc -c < $paged_pac)
+rm -f $paged_pac
+if [ $((paged_size % page_size)) != 0 ] ||
+   [ "$paged_result" != "plainhost/.manugarg.com" ]; then
+  echo "Page-sized PAC file test failed, got \"$paged_result\""
+  exit 1
+fi
+
+# Library APIs that pactester doesn't expose; see test_pacparser.c.
+if ! $script_dir/../src/test_pacparser; then
+  echo "Library API tests failed."
+  exit 1
+fi
+
 echo "All tests were successful."
@@ -0,0 +1,852 @@
+// Copyright (C) 2024 Manu Garg.
+// Author: Manu Garg <manugarg@gmail.com>
+//
+// Tests for pacparser library APIs that pactester doesn't expose. Run by
+// runtests.sh; build and run them by hand with:
+//   make -C src test_pacparser && src/test_pacparser [test ...]
+//
+// Each test prints what went wrong and returns non-zero on failure. No test
+// needs network access: hostnames are resolved by a stub resolver.
+//
+// pacparser is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pacparser.h"
+
+static double
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Waits up to timeout_ms for *counter to reach at least n.
+static int
+wait_for_count(int *counter, int n, int timeout_ms)
+{
+  double deadline = now_ms() + timeout_ms;
+  while (__atomic_load_n(counter, __ATOMIC_RELAXED) < n) {
+    if (now_ms() > deadline) return 0;
+    usleep(10 * 1000);
+  }
+  return 1;
+}
+
+// Error printer for all tests: pacparser's messages are expected for the
+// failures tests provoke, so they are only counted.
+static int error_messages;
+
+static int
+count_errors(const char *fmt, va_list argp)
+{
+  (void)fmt;
+  (void)argp;
+  __atomic_add_fetch(&error_messages, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// Reports a failed check of test name and returns 1.
+static int
+fail(const char *name, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s: ", name);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  return 1;
+}
+
+// Stub resolver: counts its calls per IP version. "v4.test" and "v6.test"
+// have addresses, everything else doesn't exist.
+static int resolver_calls[7];
+
+static char *
+stub_resolver(const char *hostname, int ip_version, void *opaque)
+{
+  (void)opaque;
+  __atomic_add_fetch(&resolver_calls[ip_version], 1, __ATOMIC_RELAXED);
+  if (strcmp(hostname, "v4.test") == 0 && ip_version == 4)
+    return strdup("192.0.2.1");
+  if (strcmp(hostname, "v6.test") == 0)
+    return strdup(ip_version == 6 ? "2001:db8::1" : "192.0.2.6");
+  return NULL;
+}
+
+static int
+total_resolver_calls(void)
+{
+  return resolver_calls[4] + resolver_calls[6];
+}
+
+// Parses script into a fresh global engine.
+static int
+init_with_script(const char *script)
+{
+  return pacparser_init() && pacparser_parse_pac_string(script);
+}
+
+// Checks that pacparser_find_proxy(url) returns expected.
+static int
+expect_proxy(const char *name, const char *url, const char *expected)
+{
+  char *host = strstr(url, "://") + 3;
+  char host_buf[256];
+  snprintf(host_buf, sizeof(host_buf), "%.*s", (int)strcspn(host, "/"), host);
+  char *proxy = pacparser_find_proxy(url, host_buf);
+  if (proxy == NULL || strcmp(proxy, expected) != 0)
+    return fail(name, "%s: got \"%s\", expected \"%s\"", url,
+                proxy ? proxy : "(null)", expected);
+  return 0;
+}
+
+// DNS cache: off by default, answers (and names that don't exist) are
+// reused for the TTL, and dnsResolveEx resolves and caches both families.
+static int
+test_dns_cache(void)
+{
+  const char *name = "dns_cache";
+  const char *script =
+      "function FindProxyForURL(url, host) {\n"
+      "  if (host == 'ex') return 'EX ' + dnsResolveEx('v6.test');\n"
+      "  return isResolvable(host) ? 'PROXY ' + dnsResolve(host) : 'DIRECT';\n"
+      "}\n";
+  int failed = 0;
+  pacparser_set_dns_resolver(stub_resolver, NULL);
+  pacparser_enable_microsoft_extensions();
+
+  // Disabled: every lookup asks the resolver.
+  memset(resolver_calls, 0, sizeof(resolver_calls));
+  if (!init_with_script(script)) return fail(name, "parse failed");
+  failed |= expect_proxy(name, "http://v4.test/", "PROXY 192.0.2.1");
+  failed |= expect_proxy(name, "http://v4.test/", "PROXY 192.0.2.1");
+  if (total_resolver_calls() != 4)
+    failed |= fail(name, "%d resolver calls without cache, expected 4",
+                   total_resolver_calls());
+  pacparser_cleanup();
+
+  // Enabled: one call per name and family, for missing names too.
+  pacparser_set_dns_cache_ttl(60);
+  memset(resolver_calls, 0, sizeof(resolver_calls));
+  if (!init_with_script(script)) return fail(name, "parse failed");
+  failed |= expect_proxy(name, "http://v4.test/", "PROXY 192.0.2.1");
+  failed |= expect_proxy(name, "http://v4.test/", "PROXY 192.0.2.1");
+  failed |= expect_proxy(name, "http://missing.test/", "DIRECT");
+  failed |= expect_proxy(name, "http://missing.test/", "DIRECT");
+  failed |= expect_proxy(name, "http://ex/", "EX 2001:db8::1;192.0.2.6");
+  failed |= expect_proxy(name, "http://ex/", "EX 2001:db8::1;192.0.2.6");
+  if (resolver_calls[4] != 3 || resolver_calls[6] != 1)
+    failed |= fail(name, "%d IPv4 and %d IPv6 resolver calls with cache, "
+                   "expected 3 and 1", resolver_calls[4], resolver_calls[6]);
+  pacparser_cleanup();
+
+  // Expired answers are resolved again.
+  pacparser_set_dns_cache_ttl(1);
+  memset(resolver_calls, 0, sizeof(resolver_calls));
+  if (!init_with_script(script)) return fail(name, "parse failed");
+  failed |= expect_proxy(name, "http://v4.test/", "PROXY 192.0.2.1");
+  usleep(1100 * 1000);
+  failed |= expect_proxy(name, "http://v4.test/", "PROXY 192.0.2.1");
+  if (total_resolver_calls() != 2)
+    failed |= fail(name, "%d resolver calls across expiry, expected 2",
+                   total_resolver_calls());
+  pacparser_cleanup();
+
+  pacparser_set_dns_cache_ttl(0);
+  pacparser_set_dns_resolver(NULL, NULL);
+  return failed;
+}
+
+// Resolver for the prefetch test: "pre.test" resolves until prefetch_fail is
+// set, "slow.test" takes 1.5 s not to resolve.
+static int prefetch_calls, prefetch_fail;
+
+static char *
+prefetch_resolver(const char *hostname, int ip_version, void *opaque)
+{
+  (void)ip_version;
+  (void)opaque;
+  if (strcmp(hostname, "slow.test") == 0) {
+    usleep(1500 * 1000);
+    return NULL;
+  }
+  if (strcmp(hostname, "pre.test") != 0) return NULL;
+  __atomic_add_fetch(&prefetch_calls, 1, __ATOMIC_RELAXED);
+  return __atomic_load_n(&prefetch_fail, __ATOMIC_RELAXED) ?
+      NULL : strdup("192.0.2.7");
+}
+
+// DNS prefetch: off by default, keeps the last good answer when a refresh
+// fails, and pacparser_cleanup doesn't wait for a resolution in progress.
+static int
+test_dns_prefetch(void)
+{
+  const char *name = "dns_prefetch";
+  const char *script =
+      "function FindProxyForURL(url, host) {\n"
+      "  return 'PROXY ' + dnsResolve('pre.test');\n"
+      "}\n";
+  const char *slow_script =
+      "function FindProxyForURL(url, host) {\n"
+      "  return dnsResolve('slow.test') ? 'PROXY' : 'DIRECT';\n"
+      "}\n";
+  int failed = 0;
+  pacparser_set_dns_resolver(prefetch_resolver, NULL);
+  pacparser_set_dns_cache_ttl(1);
+
+  // Off by default.
+  prefetch_calls = prefetch_fail = 0;
+  if (!init_with_script(script)) return fail(name, "parse failed");
+  usleep(200 * 1000);
+  if (prefetch_calls != 0)
+    failed |= fail(name, "%d resolver calls with prefetch off, expected 0",
+                   prefetch_calls);
+  pacparser_cleanup();
+
+  // Resolved at parse time, then refreshed every second (half the TTL,
+  // rounded up). Failed refreshes keep the last good answer.
+  pacparser_set_dns_prefetch(1);
+  if (!init_with_script(script)) return fail(name, "parse failed");
+  if (!wait_for_count(&prefetch_calls, 1, 2000))
+    failed |= fail(name, "pre.test wasn't prefetched");
+  __atomic_store_n(&prefetch_fail, 1, __ATOMIC_RELAXED);
+  if (!wait_for_count(&prefetch_calls, 3, 4000))
+    failed |= fail(name, "pre.test wasn't refreshed");
+  failed |= expect_proxy(name, "http://www.example.com/", "PROXY 192.0.2.7");
+  pacparser_cleanup();
+
+  // Neither cleanup nor a new parse waits for the prefetch thread.
+  if (!init_with_script(slow_script)) return fail(name, "parse failed");
+  usleep(100 * 1000);
+  double start = now_ms();
+  pacparser_cleanup();
+  if (now_ms() - start > 500)
+    failed |= fail(name, "pacparser_cleanup took %.0f ms",
+                   now_ms() - start);
+
+  pacparser_set_dns_prefetch(0);
+  pacparser_set_dns_cache_ttl(0);
+  pacparser_set_dns_resolver(NULL, NULL);
+  return failed;
+}
+
+// Resolver for the dns_workers test: every answer takes 300 ms.
+static char *
+slow_resolver(const char *hostname, int ip_version, void *opaque)
+{
+  (void)hostname;
+  (void)opaque;
+  usleep(300 * 1000);
+  return strdup(ip_version == 6 ? "2001:db8::2" : "192.0.2.2");
+}
+
+#define DNS_WORKERS_THREADS 4
+
+static void *
+dns_workers_thread(void *arg)
+{
+  const char *script =
+      "function FindProxyForURL(url, host) {\n"
+      "  return 'PROXY ' + dnsResolveEx(host);\n"
+      "}\n";
+  char **proxy = arg;
+  pacparser_registry *reg = pacparser_registry_new();
+  if (reg && pacparser_registry_load_string(reg, "t", script)) {
+    char *p = pacparser_registry_find_proxy(reg, "t", "http://w.test/",
+                                            "w.test");
+    if (p) *proxy = strdup(p);
+  }
+  pacparser_registry_free(reg);
+  return NULL;
+}
+
+// Concurrent dnsResolveEx calls each get a DNS worker, so their A and AAAA
+// lookups all overlap, and the families are merged IPv6 first for a
+// pacparser_dns_resolver.
+static int
+test_dns_workers(void)
+{
+  const char *name = "dns_workers";
+  pthread_t threads[DNS_WORKERS_THREADS];
+  char *proxies[DNS_WORKERS_THREADS] = { NULL };
+  int failed = 0;
+  pacparser_set_dns_resolver(slow_resolver, NULL);
+  pacparser_enable_microsoft_extensions();
+
+  double start = now_ms();
+  for (int i = 0; i < DNS_WORKERS_THREADS; i++)
+    pthread_create(&threads[i], NULL, dns_workers_thread, &proxies[i]);
+  for (int i = 0; i < DNS_WORKERS_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = now_ms() - start;
+  // One resolver call's time, plus slack; two if lookups shared a worker.
+  if (elapsed > 500)
+    failed |= fail(name, "%d concurrent lookups took %.0f ms",
+                   DNS_WORKERS_THREADS, elapsed);
+  for (int i = 0; i < DNS_WORKERS_THREADS; i++) {
+    if (proxies[i] == NULL ||
+        strcmp(proxies[i], "PROXY 2001:db8::2;192.0.2.2") != 0)
+      failed |= fail(name, "thread %d got \"%s\"", i,
+                     proxies[i] ? proxies[i] : "(null)");
+    free(proxies[i]);
+  }
+
+  pacparser_set_dns_resolver(NULL, NULL);
+  return failed;
+}
+
+// Parsing the script parsed last is skipped; any other script, even one of
+// the same length, is evaluated.
+static int
+test_unchanged_script(void)
+{
+  const char *name = "unchanged_script";
+  const char *script_a =
+      "function FindProxyForURL(url, host) { return 'PROXY a:1'; }\n";
+  const char *script_b =
+      "function FindProxyForURL(url, host) { return 'PROXY b:1'; }\n";
+  pacparser_stats stats;
+  int failed = 0;
+
+  pacparser_reset_stats();
+  if (!init_with_script(script_a) || !pacparser_parse_pac_string(script_a) ||
+      !pacparser_reload_pac_string(script_a))
+    return fail(name, "parse failed");
+  pacparser_get_stats(&stats);
+  if (stats.parses_changed != 1 || stats.parses_unchanged != 2)
+    failed |= fail(name, "%lu changed and %lu unchanged parses, expected 1 "
+                   "and 2", stats.parses_changed, stats.parses_unchanged);
+
+  pacparser_reset_stats();
+  if (!pacparser_parse_pac_string(script_b) ||
+      !pacparser_reload_pac_string(script_a))
+    failed |= fail(name, "parse failed");
+  pacparser_get_stats(&stats);
+  if (stats.parses_changed != 2 || stats.parses_unchanged != 0)
+    failed |= fail(name, "%lu changed and %lu unchanged parses, expected 2 "
+                   "and 0", stats.parses_changed, stats.parses_unchanged);
+  failed |= expect_proxy(name, "http://a.test/", "PROXY a:1");
+  pacparser_cleanup();
+  return failed;
+}
+
+// Unloading or replacing a registry's PAC script gives its memory back,
+// including cycles.
+static int
+test_registry_unload(void)
+{
+  const char *name = "registry_unload";
+  const char *script =
+      "var cycles = [];\n"
+      "for (var i = 0; i < 1000; i++) { var o = {i: i}; o.self = o;"
+      " cycles.push(o); }\n"
+      "function FindProxyForURL(url, host) { return 'DIRECT'; }\n";
+  int failed = 0;
+  pacparser_registry *reg = pacparser_registry_new();
+  if (reg == NULL || !pacparser_registry_load_string(reg, "base", script))
+    return fail(name, "setup failed");
+  long base = pacparser_registry_memory_usage(reg, NULL);
+
+  for (int i = 0; i < 3; i++) {
+    if (!pacparser_registry_load_string(reg, "tenant", script) ||
+        !pacparser_registry_load_string(reg, "tenant", script))
+      failed |= fail(name, "load failed");
+    pacparser_registry_unload(reg, "tenant");
+  }
+  long after = pacparser_registry_memory_usage(reg, NULL);
+  // Allow for the runtime's own bookkeeping (atoms, shapes) to grow a bit.
+  if (after > base + 4096)
+    failed |= fail(name, "memory grew from %ld to %ld bytes", base, after);
+  pacparser_registry_free(reg);
+  return failed;
+}
+
+// Writes a PAC file whose FindProxyForURL returns result.
+static int
+write_pac(const char *path, const char *result)
+{
+  FILE *f = fopen(path, "w");
+  if (f == NULL) return 0;
+  fprintf(f, "function FindProxyForURL(url, host) { return '%s'; }\n",
+          result);
+  return fclose(f) == 0;
+}
+
+// Reload: the next lookup sees the new file; a failed reload keeps the old
+// engine. Watch: rewriting the watched file reloads it.
+static int
+test_reload(void)
+{
+  const char *name = "reload";
+  char path[] = "/tmp/test_pacparser_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) return fail(name, "mkstemp failed");
+  close(fd);
+  int failed = 0;
+
+  if (!write_pac(path, "PROXY old:1") || !pacparser_init() ||
+      !pacparser_parse_pac_file(path)) {
+    unlink(path);
+    return fail(name, "setup failed");
+  }
+  failed |= expect_proxy(name, "http://a.test/", "PROXY old:1");
+
+  write_pac(path, "PROXY new:2");
+  if (!pacparser_reload_pac_file(path))
+    failed |= fail(name, "reload of a valid file failed");
+  failed |= expect_proxy(name, "http://a.test/", "PROXY new:2");
+
+  FILE *f = fopen(path, "w");
+  fputs("function FindProxyForURL(url, host) { return ", f);
+  fclose(f);
+  error_messages = 0;
+  if (pacparser_reload_pac_file(path) || error_messages == 0)
+    failed |= fail(name, "reload of a broken file succeeded");
+  if (pacparser_reload_pac_file("/nonexistent/proxy.pac"))
+    failed |= fail(name, "reload of a missing file succeeded");
+  failed |= expect_proxy(name, "http://a.test/", "PROXY new:2");
+
+  write_pac(path, "PROXY new:2");
+  if (!pacparser_reload_pac_file(path) || !pacparser_watch_pac_file(path)) {
+    failed |= fail(name, "watch failed");
+  } else {
+    write_pac(path, "PROXY watched:3");
+    double deadline = now_ms() + 5000;
+    char *proxy;
+    while ((proxy = pacparser_find_proxy("http://a.test/", "a.test")) &&
+           strcmp(proxy, "PROXY watched:3") != 0 && now_ms() < deadline)
+      usleep(20 * 1000);
+    failed |= expect_proxy(name, "http://a.test/", "PROXY watched:3");
+  }
+
+  pacparser_cleanup();
+  unlink(path);
+  return failed;
+}
+
+// A custom allocator without usable_size_fn.
+static void *
+plain_calloc(void *opaque, size_t count, size_t size)
+{
+  (void)opaque;
+  return calloc(count, size);
+}
+
+static void *
+plain_malloc(void *opaque, size_t size)
+{
+  (void)opaque;
+  return malloc(size);
+}
+
+static void
+plain_free(void *opaque, void *ptr)
+{
+  (void)opaque;
+  free(ptr);
+}
+
+static void *
+plain_realloc(void *opaque, void *ptr, size_t size)
+{
+  (void)opaque;
+  return realloc(ptr, size);
+}
+
+static const pacparser_allocator plain_allocator = {
+  plain_calloc, plain_malloc, plain_free, plain_realloc, NULL, NULL,
+};
+
+// A lookup or load over the memory limit fails without taking the engine
+// down, for the global engine, cached engines and registries.
+static int
+test_memory_limit(void)
+{
+  const char *name = "memory_limit";
+  const char *script =
+      "function FindProxyForURL(url, host) {\n"
+      "  if (host != 'big') return 'DIRECT';\n"
+      "  var a = [];\n"
+      "  for (var i = 0; i < 1000000; i++) a.push('x' + i);\n"
+      "  return 'BIG';\n"
+      "}\n";
+  const size_t limit = 4 * 1024 * 1024;
+  pacparser_memory_stats usage;
+  int failed = 0;
+
+  char path[] = "/tmp/test_pacparser_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, script, strlen(script)) < 0) {
+    unlink(path);
+    return fail(name, "setup failed");
+  }
+  close(fd);
+
+  // An engine pacparser_just_find_proxy cached before the limit was set.
+  free(pacparser_just_find_proxy(path, "http://a.test/", "a.test"));
+  pacparser_set_memory_limit(limit);
+  char *proxy = pacparser_just_find_proxy(path, "http://big/", "big");
+  if (proxy != NULL)
+    failed |= fail(name, "cached engine lookup over the limit didn't fail");
+  free(proxy);
+  proxy = pacparser_just_find_proxy(path, "http://a.test/", "a.test");
+  if (proxy == NULL || strcmp(proxy, "DIRECT") != 0)
+    failed |= fail(name, "cached engine broken after running out of memory");
+  free(proxy);
+  pacparser_set_memory_limit(0);
+  pacparser_clear_pac_cache();
+
+  // The current engine, parsed before the limit was set.
+  if (!init_with_script(script)) return fail(name, "parse failed");
+  pacparser_set_memory_limit(limit);
+  error_messages = 0;
+  if (pacparser_find_proxy("http://big/", "big") != NULL ||
+      error_messages == 0)
+    failed |= fail(name, "lookup over the limit didn't fail");
+  failed |= expect_proxy(name, "http://a.test/", "DIRECT");
+  if (!pacparser_memory_usage(&usage) || usage.malloc_limit != limit)
+    failed |= fail(name, "engine limit is %zu, expected %zu",
+                   usage.malloc_limit, limit);
+
+  // An engine whose custom allocator can't tell block sizes is accounted
+  // for like one using malloc.
+  size_t malloc_size = usage.malloc_size;
+  pacparser_cleanup();
+  pacparser_set_allocator(&plain_allocator);
+  if (!init_with_script(script)) {
+    failed |= fail(name, "parse with a custom allocator failed");
+  } else {
+    if (pacparser_find_proxy("http://big/", "big") != NULL)
+      failed |= fail(name, "lookup over the limit didn't fail with a custom "
+                     "allocator");
+    failed |= expect_proxy(name, "http://a.test/", "DIRECT");
+    if (!pacparser_memory_usage(&usage) ||
+        usage.malloc_size < malloc_size / 2)
+      failed |= fail(name, "custom allocator accounted for %zu bytes, malloc "
+                     "for %zu", usage.malloc_size, malloc_size);
+  }
+  pacparser_set_allocator(NULL);
+
+  // A registry created after the limit was set.
+  pacparser_registry *reg = pacparser_registry_new();
+  if (reg == NULL || !pacparser_registry_load_string(reg, "t", script)) {
+    failed |= fail(name, "registry setup failed");
+  } else {
+    if (pacparser_registry_load_string(reg, "big",
+                                       "var a = [];\n"
+                                       "for (var i = 0; i < 1000000; i++)"
+                                       " a.push('x' + i);\n"))
+      failed |= fail(name, "registry load over the limit didn't fail");
+    proxy = pacparser_registry_find_proxy(reg, "t", "http://big/", "big");
+    if (proxy != NULL)
+      failed |= fail(name, "registry lookup over the limit didn't fail");
+    free(proxy);
+    proxy = pacparser_registry_find_proxy(reg, "t", "http://a.test/",
+                                          "a.test");
+    if (proxy == NULL || strcmp(proxy, "DIRECT") != 0)
+      failed |= fail(name, "registry broken after running out of memory");
+    free(proxy);
+  }
+  pacparser_registry_free(reg);
+
+  pacparser_set_memory_limit(0);
+  pacparser_cleanup();
+  unlink(path);
+  return failed;
+}
+
+// Isolated lookups: every lookup starts from the state right after the
+// parse, a failed re-parse keeps that state, and lookups fail rather than
+// share the context when the script was parsed before they were enabled.
+static int
+test_isolated_lookups(void)
+{
+  const char *name = "isolated_lookups";
+  const char *script =
+      "var n = 0;\n"
+      "function FindProxyForURL(url, host) { n++; return 'PROXY p:' + n; }\n";
+  int failed = 0;
+
+  pacparser_set_isolated_lookups(1);
+  if (!init_with_script(script)) {
+    pacparser_set_isolated_lookups(0);
+    return fail(name, "parse failed");
+  }
+  failed |= expect_proxy(name, "http://a.test/", "PROXY p:1");
+  failed |= expect_proxy(name, "http://a.test/", "PROXY p:1");
+  if (pacparser_parse_pac_string("function FindProxyForURL(u, h) {"
+                                 " return 'BROKEN'; }\nthrow 'broken';\n"))
+    failed |= fail(name, "broken script parsed");
+  failed |= expect_proxy(name, "http://a.test/", "PROXY p:1");
+  pacparser_cleanup();
+
+  // Enabled after the parse.
+  pacparser_set_isolated_lookups(0);
+  if (!init_with_script(script)) return fail(name, "parse failed");
+  pacparser_set_isolated_lookups(1);
+  error_messages = 0;
+  char *proxy = pacparser_find_proxy("http://a.test/", "a.test");
+  if (proxy != NULL || error_messages == 0)
+    failed |= fail(name, "lookup without a snapshot returned \"%s\"",
+                   proxy ? proxy : "(null)");
+  free(proxy);
+  if (!pacparser_parse_pac_string(script))
+    failed |= fail(name, "re-parse failed");
+  failed |= expect_proxy(name, "http://a.test/", "PROXY p:1");
+  failed |= expect_proxy(name, "http://a.test/", "PROXY p:1");
+  pacparser_cleanup();
+
+  // An engine pacparser_just_find_proxy cached before they were enabled.
+  char path[] = "/tmp/test_pacparser_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, script, strlen(script)) < 0) {
+    pacparser_set_isolated_lookups(0);
+    unlink(path);
+    return fail(name, "setup failed");
+  }
+  close(fd);
+  pacparser_set_isolated_lookups(0);
+  free(pacparser_just_find_proxy(path, "http://a.test/", "a.test"));
+  pacparser_set_isolated_lookups(1);
+  for (int i = 0; i < 2; i++) {
+    proxy = pacparser_just_find_proxy(path, "http://a.test/", "a.test");
+    if (proxy == NULL || strcmp(proxy, "PROXY p:1") != 0)
+      failed |= fail(name, "cached engine returned \"%s\"",
+                     proxy ? proxy : "(null)");
+    free(proxy);
+  }
+  pacparser_set_isolated_lookups(0);
+  pacparser_clear_pac_cache();
+  unlink(path);
+  return failed;
+}
+
+// What the trace hook saw of the last lookup it was called for.
+static struct {
+  int calls;
+  char url[64], host[64], result[64], dns_name[64];
+  int has_result, num_dns_names, dns_resolve_calls, timed_out;
+} traced;
+
+static void
+record_trace(const pacparser_trace *t, void *opaque)
+{
+  traced.calls++;
+  snprintf(traced.url, sizeof(traced.url), "%s", t->url);
+  snprintf(traced.host, sizeof(traced.host), "%s", t->host);
+  traced.has_result = t->result != NULL;
+  snprintf(traced.result, sizeof(traced.result), "%s",
+           t->result ? t->result : "");
+  traced.timed_out = t->timed_out;
+  traced.num_dns_names = t->num_dns_names;
+  snprintf(traced.dns_name, sizeof(traced.dns_name), "%s",
+           t->num_dns_names ? t->dns_names[0] : "");
+  traced.dns_resolve_calls = 0;
+  for (int i = 0; i < t->num_builtins; i++) {
+    if (strcmp(t->builtins[i].name, "dnsResolve") == 0)
+      traced.dns_resolve_calls = t->builtins[i].calls;
+  }
+  *(int *)opaque = 1;
+}
+
+// Trace hook with sample rate 1: called once per lookup, including failed
+// ones, with the lookup's URL, host, result and DNS names.
+static int
+test_trace_hook(void)
+{
+  const char *name = "trace_hook";
+  const char *script =
+      "function FindProxyForURL(url, host) {\n"
+      "  if (host == 'fail.test') throw 'failed';\n"
+      "  return 'PROXY ' + dnsResolve('v4.test') + ':' +"
+      " dnsResolve('v4.test');\n"
+      "}\n";
+  int opaque_seen = 0, failed = 0;
+  pacparser_set_dns_resolver(stub_resolver, NULL);
+  pacparser_set_trace_hook(record_trace, &opaque_seen, 1.0);
+  memset(&traced, 0, sizeof(traced));
+  if (!init_with_script(script)) return fail(name, "parse failed");
+
+  for (int i = 1; i <= 3; i++) {
+    failed |= expect_proxy(name, "http://a.test/x",
+                           "PROXY 192.0.2.1:192.0.2.1");
+    if (traced.calls != i)
+      failed |= fail(name, "hook called %d times for %d lookups",
+                     traced.calls, i);
+  }
+  if (!opaque_seen || strcmp(traced.url, "http://a.test/x") != 0 ||
+      strcmp(traced.host, "a.test") != 0 || !traced.has_result ||
+      strcmp(traced.result, "PROXY 192.0.2.1:192.0.2.1") != 0 ||
+      traced.timed_out)
+    failed |= fail(name, "traced url \"%s\", host \"%s\", result \"%s\"",
+                   traced.url, traced.host, traced.result);
+  if (traced.num_dns_names != 1 || strcmp(traced.dns_name, "v4.test") != 0 ||
+      traced.dns_resolve_calls != 2)
+    failed |= fail(name, "traced %d DNS names (first \"%s\") and %d "
+                   "dnsResolve calls, expected 1 (v4.test) and 2",
+                   traced.num_dns_names, traced.dns_name,
+                   traced.dns_resolve_calls);
+
+  if (pacparser_find_proxy("http://fail.test/", "fail.test") != NULL)
+    failed |= fail(name, "failing lookup succeeded");
+  if (traced.calls != 4 || traced.has_result ||
+      strcmp(traced.host, "fail.test") != 0)
+    failed |= fail(name, "failed lookup traced %d times, with a result: %d",
+                   traced.calls - 3, traced.has_result);
+
+  // Sample rate 0 traces nothing.
+  pacparser_set_trace_hook(record_trace, &opaque_seen, 0.0);
+  failed |= expect_proxy(name, "http://a.test/x",
+                         "PROXY 192.0.2.1:192.0.2.1");
+  if (traced.calls != 4)
+    failed |= fail(name, "hook called with sample rate 0");
+
+  pacparser_set_trace_hook(NULL, NULL, 0.0);
+  pacparser_cleanup();
+  pacparser_set_dns_resolver(NULL, NULL);
+  return failed;
+}
+
+// Coverage: the rules are the return statements of FindProxyForURL itself,
+// its conditions (if, ||, &&, case, ?:) are counted but not those of other
+// functions, and each engine and registry script keeps its own counts.
+static int
+test_coverage(void)
+{
+  const char *name = "coverage";
+  const char *script =
+      "function isLocal(host) {\n"
+      "  if (host == 'local.test') return true;\n"
+      "  return false;\n"
+      "}\n"
+      "function FindProxyForURL(url, host) {\n"
+      "  var pick = function (h) { if (h) return 1; return 0; };\n"
+      "  var inner = h => h ? 'a' : 'b';\n"
+      "  pick(host);\n"
+      "  inner(host);\n"
+      "  if (isLocal(host) || host == 'b.test' && url != '')\n"
+      "    return 'DIRECT';\n"
+      "  switch (host) {\n"
+      "  case 'c.test': return 'PROXY c:1';\n"
+      "  case 'd.test': return 'PROXY d:1';\n"
+      "  }\n"
+      "  return host == 'e.test' ? 'PROXY e:1' : 'PROXY f:1';\n"
+      "}\n";
+  static const struct {
+    const char *url, *proxy;
+    int rule, predicates;
+  } lookups[] = {
+    { "http://local.test/", "DIRECT", 0, 1 },
+    { "http://b.test/", "DIRECT", 0, 3 },
+    { "http://c.test/", "PROXY c:1", 1, 3 },
+    { "http://d.test/", "PROXY d:1", 2, 4 },
+    { "http://e.test/", "PROXY e:1", 3, 5 },
+    { "http://f.test/", "PROXY f:1", 3, 5 },
+  };
+  static const int lines[] = { 11, 13, 14, 16 };
+  unsigned long hits[4] = { 0 }, predicates[4] = { 0 };
+  pacparser_rule_coverage rules[8];
+  int failed = 0;
+
+  pacparser_enable_coverage(1);
+  if (!init_with_script(script)) {
+    pacparser_enable_coverage(0);
+    return fail(name, "parse failed");
+  }
+  for (size_t i = 0; i < sizeof(lookups) / sizeof(lookups[0]); i++) {
+    failed |= expect_proxy(name, lookups[i].url, lookups[i].proxy);
+    hits[lookups[i].rule]++;
+    predicates[lookups[i].rule] += lookups[i].predicates;
+  }
+  int n = pacparser_get_coverage(rules, 8);
+  if (n != 4)
+    failed |= fail(name, "%d rules, expected 4", n);
+  for (int i = 0; i < n && i < 4; i++) {
+    if (rules[i].line != lines[i] || rules[i].hits != hits[i] ||
+        rules[i].predicates != predicates[i])
+      failed |= fail(name, "rule %d: line %d, %lu hits, %lu predicates; "
+                     "expected line %d, %lu hits, %lu predicates", i,
+                     rules[i].line, rules[i].hits, rules[i].predicates,
+                     lines[i], hits[i], predicates[i]);
+  }
+
+  // A script that fails to evaluate leaves the counts alone.
+  if (pacparser_parse_pac_string("function FindProxyForURL(u, h) {\n"
+                                 "  return 'DIRECT';\n}\nthrow 'broken';\n"))
+    failed |= fail(name, "broken script parsed");
+  if (pacparser_get_coverage(rules, 8) != 4 || rules[3].hits != hits[3])
+    failed |= fail(name, "failed parse replaced the counts");
+
+  // Lookups in a registry script count there only, and loading another
+  // script leaves them alone.
+  pacparser_registry *reg = pacparser_registry_new();
+  if (reg == NULL || !pacparser_registry_load_string(reg, "a", script)) {
+    failed |= fail(name, "registry load failed");
+  } else {
+    free(pacparser_registry_find_proxy(reg, "a", "http://c.test/", "c.test"));
+    if (!pacparser_registry_load_string(reg, "b", script))
+      failed |= fail(name, "registry load failed");
+    if (pacparser_registry_get_coverage(reg, "a", rules, 8) != 4 ||
+        rules[1].hits != 1 || rules[1].predicates != 3)
+      failed |= fail(name, "registry script a: %lu hits, %lu predicates "
+                     "for rule 1, expected 1 and 3", rules[1].hits,
+                     rules[1].predicates);
+    if (pacparser_registry_get_coverage(reg, "b", rules, 8) != 4 ||
+        rules[1].hits != 0)
+      failed |= fail(name, "registry script b counted a's lookup");
+    if (pacparser_get_coverage(rules, 8) != 4 || rules[1].hits != hits[1])
+      failed |= fail(name, "registry lookup counted in the global engine");
+  }
+  pacparser_registry_free(reg);
+  pacparser_cleanup();
+  pacparser_enable_coverage(0);
+  return failed;
+}
+
+static const struct {
+  const char *name;
+  int (*run)(void);
+} tests[] = {
+  { "dns_cache", test_dns_cache },
+  { "dns_prefetch", test_dns_prefetch },
+  { "dns_workers", test_dns_workers },
+  { "reload", test_reload },
+  { "unchanged_script", test_unchanged_script },
+  { "registry_unload", test_registry_unload },
+  { "memory_limit", test_memory_limit },
+  { "isolated_lookups", test_isolated_lookups },
+  { "trace_hook", test_trace_hook },
+  { "coverage", test_coverage },
+};
+
+#define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+int
+main(int argc, char *argv[])
+{
+  int failed = 0;
+  pacparser_set_error_printer(count_errors);
+  for (size_t i = 0; i < NUM_TESTS; i++) {
+    int selected = argc < 2;
+    for (int j = 1; j < argc; j++) {
+      if (strcmp(argv[j], tests[i].name) == 0) selected = 1;
+    }
+    if (selected && tests[i].run() != 0) {
+      fprintf(stderr, "Test %s failed.\n", tests[i].name);
+      failed = 1;
+    }
+  }
+  return failed;
+}